@@ -11,9 +11,12 @@
 
 package io.smollai.smollaiandroid.ui.screens.chat
 
+import android.content.ComponentCallbacks2
 import android.content.Context
+import android.content.res.Configuration
 import android.graphics.Color
 import android.graphics.Typeface
+import android.os.PowerManager
 import android.util.Log
 import android.util.TypedValue
 import androidx.compose.runtime.mutableStateOf
@@ -41,10 +44,15 @@ import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.launch
 import kotlinx.coroutines.withContext
 import org.koin.android.annotation.KoinViewModel
+import java.io.File
 import java.util.Date
 
 const val LOGTAG = "[smollaiAndroid]"
 val LOGD: (String) -> Unit = { Log.d(LOGTAG, it) }
+private const val LARGE_MODEL_BYTES = 2L * 1024 * 1024 * 1024
+
+// a little above reading speed, see decodeThreading()
+private const val BATTERY_SAVER_TOKENS_PER_SECOND = 8f
 
 @KoinViewModel
 class ChatScreenViewModel(
@@ -66,10 +74,34 @@ class ChatScreenViewModel(
     val isInitializingModel = mutableStateOf(false)
     var responseGenerationJob: Job? = null
 
+    // chat whose model, system prompt and history are currently loaded in smollai
+    private var loadedChat: Chat? = null
+
     val markwon: Markwon
 
+    // under memory pressure the native layer spills idle KV caches to disk instead of the whole
+    // app being killed and the model loaded again when the user comes back
+    private val memoryCallbacks =
+        object : ComponentCallbacks2 {
+            override fun onTrimMemory(level: Int) {
+                CoroutineScope(Dispatchers.Default).launch {
+                    smollai.trimMemory(level, spillDir().absolutePath)
+                }
+            }
+
+            override fun onConfigurationChanged(newConfig: Configuration) {}
+
+            @Deprecated("Deprecated in Java")
+            override fun onLowMemory() {
+                onTrimMemory(ComponentCallbacks2.TRIM_MEMORY_COMPLETE)
+            }
+        }
+
     init {
         currChatState.value = chatsDB.loadDefaultChat(context)
+        context.registerComponentCallbacks(memoryCallbacks)
+        // left over if the process was killed while a cache was spilled
+        spillDir().listFiles()?.forEach { it.delete() }
         val prism4j = Prism4j(smollaiPrismGrammarLocator())
         markwon =
             Markwon
@@ -134,7 +166,12 @@ class ChatScreenViewModel(
                 CoroutineScope(Dispatchers.Default).launch {
                     partialResponse.value = ""
                     try {
-                        smollai.getResponse(query).collect { partialResponse.value += it }
+                        smollai
+                            .getResponse(query) { nDone, nTotal, tokensPerSecond ->
+                                if (nDone == nTotal) {
+                                    LOGD("Prompt prefill: $nTotal tokens at $tokensPerSecond tokens/s")
+                                }
+                            }.collect { partialResponse.value += it }
                         // Completar la generación normalmente
                         smollai.stopCompletion()
                     } catch (e: Exception) {
@@ -183,6 +220,7 @@ class ChatScreenViewModel(
         stopGeneration()
         chatsDB.deleteChat(chat)
         messagesDB.deleteMessages(chat.id)
+        sessionDir().listFiles { file -> file.name.startsWith("chat-${chat.id}-") }?.forEach { it.delete() }
         currChatState.value = null
     }
 
@@ -191,6 +229,7 @@ class ChatScreenViewModel(
         if (currChatState.value?.llmModelId == modelId) {
             currChatState.value = currChatState.value?.copy(llmModelId = -1)
             smollai.close()
+            loadedChat = null
         }
     }
 
@@ -201,28 +240,51 @@ class ChatScreenViewModel(
      */
     fun loadModel() {
         currChatState.value?.let { chat ->
+            val loaded = loadedChat
+            if (loaded != null && loaded.id == chat.id && loaded.llmModelId == chat.llmModelId &&
+                loaded.systemPrompt == chat.systemPrompt
+            ) {
+                // same model and history, only the sampler has to follow the settings
+                if (loaded.minP != chat.minP || loaded.temperature != chat.temperature) {
+                    smollai.setSamplingParams(chat.minP, chat.temperature)
+                }
+                loadedChat = chat
+                return
+            }
             if (chat.llmModelId == -1L) {
                 showSelectModelListDialogState.value = true
             } else {
                 val model = modelsRepository.getModelFromId(chat.llmModelId)
                 if (model != null) {
                     isInitializingModel.value = true
+                    loadedChat = chat
                     CoroutineScope(Dispatchers.Default).launch {
-                        smollai.create(model.path, chat.minP, chat.temperature, true)
+                        smollai.create(
+                            model.path,
+                            chat.minP,
+                            chat.temperature,
+                            true,
+                            SmollAI.DEFAULT_N_BATCH,
+                            prefillUBatchSize(model.path),
+                            decodeThreading(),
+                        )
                         LOGD("Model loaded")
+                        if (smollai.setSessionFile(sessionDir().absolutePath, chat.id)) {
+                            LOGD("KV cache restored for chat ${chat.id}")
+                        }
+                        val roles = mutableListOf<String>()
+                        val contents = mutableListOf<String>()
                         if (chat.systemPrompt.isNotEmpty()) {
-                            smollai.addSystemPrompt(chat.systemPrompt)
-                            LOGD("System prompt added")
+                            roles.add("system")
+                            contents.add(chat.systemPrompt)
                         }
                         messagesDB.getMessagesForModel(chat.id).forEach { message ->
-                            if (message.isUserMessage) {
-                                smollai.addUserMessage(message.message)
-                                LOGD("User message added: ${message.message}")
-                            } else {
-                                smollai.addAssistantMessage(message.message)
-                                LOGD("Assistant message added: ${message.message}")
-                            }
+                            roles.add(if (message.isUserMessage) "user" else "assistant")
+                            contents.add(message.message)
                         }
+                        // whatever the restored cache lacks is processed while the user types
+                        smollai.loadHistory(roles, contents, prefill = true)
+                        LOGD("History loaded: ${contents.size} messages")
                         withContext(Dispatchers.Main) { isInitializingModel.value = false }
                     }
                 } else {
@@ -232,8 +294,33 @@ class ChatScreenViewModel(
         }
     }
 
+    /**
+     * In battery saver mode, replies are generated at a steady reading pace instead of as fast as
+     * the cores allow, which drains less battery and keeps the device from heating up.
+     */
+    private fun decodeThreading(): SmollAI.ThreadingOptions {
+        val powerManager = context.getSystemService(Context.POWER_SERVICE) as PowerManager
+        return SmollAI.ThreadingOptions(
+            targetTokensPerSecond = if (powerManager.isPowerSaveMode) BATTERY_SAVER_TOKENS_PER_SECOND else 0f,
+        )
+    }
+
+    /** Directory holding the saved KV cache of each chat, see [SmollAI.setSessionFile] */
+    private fun sessionDir(): File = File(context.filesDir, "kv_sessions").apply { mkdirs() }
+
+    /** Directory the KV caches of idle chats are spilled to under memory pressure, see [SmollAI.trimMemory] */
+    private fun spillDir(): File = File(context.cacheDir, "kv_spill").apply { mkdirs() }
+
+    /**
+     * Larger models take longer per prefill chunk, so use smaller ubatches for them to keep
+     * progress updates (and the stop button) responsive while the prompt is processed.
+     */
+    private fun prefillUBatchSize(modelPath: String): Int =
+        if (File(modelPath).length() > LARGE_MODEL_BYTES) SmollAI.DEFAULT_N_UBATCH / 2 else SmollAI.DEFAULT_N_UBATCH
+
     override fun onCleared() {
         super.onCleared()
+        context.unregisterComponentCallbacks(memoryCallbacks)
         smollai.close()
     }
 }
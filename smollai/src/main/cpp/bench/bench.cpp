@@ -0,0 +1,443 @@
+// Host benchmark for the smollai native core: replays recorded chat transcripts
+// through LLMInference and reports per-turn latency and throughput as JSON.
+//
+//   smollai-bench -m model.gguf -f transcript.json [-f ...] [-n 64] [-r 3] [-md draft.gguf] [-ctk q8_0 -ctv q8_0 -fa] [-o out.json]
+//
+// A transcript is a JSON array of {"role": ..., "content": ...} messages. Every
+// user message starts a completion of at most n_predict tokens; the recorded
+// assistant message that follows it (if any) replaces the generated reply in the
+// history, so every run sees the same conversation.
+
+#include "embedder.h"
+#include "llm_inference.h"
+#include "memory_pressure.h"
+#include "prefix_cache.h"
+#include "vector_index.h"
+#include "ggml.h"
+#include <nlohmann/json.hpp>
+#include <sys/resource.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using json = nlohmann::ordered_json;
+
+namespace {
+
+// returned by completion_loop() instead of a piece when generation stops
+const char* const end_markers[] = {
+    "[EOG]", "[CONTEXT_EXCEEDED]", "[CANCELLED]", "[INVALID_STATE]", "[DECODE_ERROR]", "[LOGITS_ERROR]",
+    "[VOCAB_ERROR]", "[INVALID_TOKEN]", "[TOKEN_OUT_OF_RANGE]"
+};
+
+struct BenchParams {
+    std::string model_path;
+    std::string draft_model_path;
+    std::vector<std::string> transcripts;
+    std::string output_path;
+    int n_predict = 64;
+    int repetitions = 1;
+    int n_batch = 0;
+    int n_ubatch = 0;
+    int n_threads = 0;
+    int n_threads_batch = 0;
+    bool adaptive_threads = false;
+    float target_tokens_per_sec = 0.0f;
+    int n_draft = 8;
+    bool prompt_lookup = false;
+    int trim_level = 0;
+    long prefix_cache_mb = -1;
+    std::string json_schema_path;
+    std::string embed_model_path;
+    KvCacheConfig kv_cache;
+    float min_p = 0.05f;
+    float temperature = 1.0f;
+};
+
+struct Message {
+    std::string role;
+    std::string content;
+};
+
+void print_usage(const char* argv0) {
+    fprintf(stderr,
+            "usage: %s -m MODEL -f TRANSCRIPT [-f TRANSCRIPT ...] [options]\n"
+            "  -n N           tokens to generate per turn (default: 64)\n"
+            "  -r N           repetitions of every transcript (default: 1)\n"
+            "  -b N           n_batch (default: library default)\n"
+            "  -ub N          n_ubatch (default: library default)\n"
+            "  -t N           decode threads (default: auto)\n"
+            "  -tb N          prefill threads (default: same as -t)\n"
+            "  --adaptive     adapt the decode threads to throttling\n"
+            "  --target-tps F pace decoding to F tokens per second (default: 0, unpaced)\n"
+            "  -c N           context size (default: from free memory, growing as needed)\n"
+            "  -ctk TYPE      KV cache type of the keys: f16, q8_0, q4_0, ... (default: f16)\n"
+            "  -ctv TYPE      KV cache type of the values, quantized types need -fa (default: f16)\n"
+            "  -fa            flash attention\n"
+            "  -md FILE       draft model for speculative decoding\n"
+            "  --lookup       prompt-lookup (n-gram) drafting from the conversation\n"
+            "  --draft N      most tokens drafted per step (default: 8)\n"
+            "  --prefix-cache-mb N  byte budget of the system prompt snapshots (default: 64)\n"
+            "  --json-schema FILE  constrain every reply to JSON matching the schema in FILE\n"
+            "  --trim LEVEL   trim memory at an onTrimMemory() level before every turn after the first\n"
+            "  --embed-model FILE  also embed every message with FILE, index them and search with each\n"
+            "  --min-p F      (default: 0.05)\n"
+            "  --temp F       (default: 1.0)\n"
+            "  -o FILE        write the JSON report to FILE instead of stdout\n",
+            argv0);
+}
+
+BenchParams parse_args(int argc, char** argv) {
+    BenchParams params;
+    for (int i = 1; i < argc; i++) {
+        const std::string arg = argv[i];
+        auto value = [&]() -> const char* {
+            if (i + 1 >= argc) {
+                throw std::invalid_argument("missing value for " + arg);
+            }
+            return argv[++i];
+        };
+        if (arg == "-m") {
+            params.model_path = value();
+        } else if (arg == "-f") {
+            params.transcripts.emplace_back(value());
+        } else if (arg == "-o") {
+            params.output_path = value();
+        } else if (arg == "-n") {
+            params.n_predict = std::atoi(value());
+        } else if (arg == "-r") {
+            params.repetitions = std::atoi(value());
+        } else if (arg == "-b") {
+            params.n_batch = std::atoi(value());
+        } else if (arg == "-ub") {
+            params.n_ubatch = std::atoi(value());
+        } else if (arg == "-t") {
+            params.n_threads = std::atoi(value());
+        } else if (arg == "-tb") {
+            params.n_threads_batch = std::atoi(value());
+        } else if (arg == "--adaptive") {
+            params.adaptive_threads = true;
+        } else if (arg == "--target-tps") {
+            params.target_tokens_per_sec = std::strtof(value(), nullptr);
+        } else if (arg == "-c") {
+            params.kv_cache.n_ctx = std::max(0, std::atoi(value()));
+        } else if (arg == "-ctk" || arg == "-ctv") {
+            const ggml_type type = kv_type_from_name(value());
+            if (type == GGML_TYPE_COUNT) {
+                throw std::invalid_argument(std::string("unsupported KV cache type ") + argv[i]);
+            }
+            (arg == "-ctk" ? params.kv_cache.type_k : params.kv_cache.type_v) = type;
+        } else if (arg == "-fa") {
+            params.kv_cache.flash_attn = true;
+        } else if (arg == "-md") {
+            params.draft_model_path = value();
+        } else if (arg == "--lookup") {
+            params.prompt_lookup = true;
+        } else if (arg == "--draft") {
+            params.n_draft = std::atoi(value());
+        } else if (arg == "--prefix-cache-mb") {
+            params.prefix_cache_mb = std::max(0L, std::atol(value()));
+        } else if (arg == "--json-schema") {
+            params.json_schema_path = value();
+        } else if (arg == "--embed-model") {
+            params.embed_model_path = value();
+        } else if (arg == "--trim") {
+            params.trim_level = std::atoi(value());
+        } else if (arg == "--min-p") {
+            params.min_p = std::strtof(value(), nullptr);
+        } else if (arg == "--temp") {
+            params.temperature = std::strtof(value(), nullptr);
+        } else {
+            throw std::invalid_argument("unknown argument " + arg);
+        }
+    }
+    if (params.model_path.empty() || params.transcripts.empty()) {
+        throw std::invalid_argument("a model and at least one transcript are required");
+    }
+    return params;
+}
+
+std::vector<Message> load_transcript(const std::string& path) {
+    std::ifstream file(path);
+    if (!file) {
+        throw std::runtime_error("cannot open transcript " + path);
+    }
+    std::vector<Message> messages;
+    for (const auto& item : json::parse(file)) {
+        messages.push_back({item.at("role").get<std::string>(), item.at("content").get<std::string>()});
+    }
+    return messages;
+}
+
+long peak_rss_kb() {
+    struct rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss / 1024;
+#else
+    return usage.ru_maxrss;
+#endif
+}
+
+double per_second(int n, int64_t t_us) {
+    return t_us > 0 ? 1e6 * n / (double) t_us : 0.0;
+}
+
+// Embeds every message of the transcripts in one call, adds them to a temporary index
+// and searches it with each of them
+json run_embeddings(const BenchParams& params, const std::vector<std::string>& texts) {
+    ThreadingConfig threading;
+    threading.n_threads = params.n_threads;
+    threading.n_threads_batch = params.n_threads_batch;
+
+    const int64_t t_load_start_us = ggml_time_us();
+    Embedder embedder(params.embed_model_path.c_str(), threading);
+    const int64_t t_load_us = ggml_time_us() - t_load_start_us;
+
+    const size_t n_dims = embedder.n_dims();
+    std::vector<float> embeddings(texts.size() * n_dims);
+    const int64_t t_embed_start_us = ggml_time_us();
+    if (!embedder.embed(texts, embeddings.data())) {
+        throw std::runtime_error("cannot embed with " + params.embed_model_path);
+    }
+    const int64_t t_embed_us = ggml_time_us() - t_embed_start_us;
+
+    const std::string index_path = (std::filesystem::temp_directory_path() / "smollai-bench.index").string();
+    std::filesystem::remove(index_path);
+    int64_t t_search_us = 0;
+    {
+        VectorIndex index(index_path, (uint32_t) n_dims);
+        for (size_t i = 0; i < texts.size(); i++) {
+            index.add((int64_t) i, embeddings.data() + i * n_dims);
+        }
+        const int64_t t_search_start_us = ggml_time_us();
+        for (size_t i = 0; i < texts.size(); i++) {
+            index.search(embeddings.data() + i * n_dims, 5);
+        }
+        t_search_us = ggml_time_us() - t_search_start_us;
+    }
+    std::filesystem::remove(index_path);
+
+    json result;
+    result["model"] = params.embed_model_path;
+    result["dims"] = n_dims;
+    result["texts"] = texts.size();
+    result["load_ms"] = t_load_us / 1e3;
+    result["embed_ms"] = t_embed_us / 1e3;
+    result["texts_s"] = per_second((int) texts.size(), t_embed_us);
+    result["search_us"] = texts.empty() ? 0.0 : t_search_us / (double) texts.size();
+    return result;
+}
+
+json run_transcript(const BenchParams& params, const std::vector<Message>& transcript) {
+    ThreadingConfig threading;
+    threading.n_threads = params.n_threads;
+    threading.n_threads_batch = params.n_threads_batch;
+    threading.adaptive_threads = params.adaptive_threads;
+    threading.target_tokens_per_sec = params.target_tokens_per_sec;
+
+    LLMInference inference;
+    const int64_t t_load_start_us = ggml_time_us();
+    // recorded replies are added explicitly, generated ones are not kept
+    inference.load_model(params.model_path.c_str(), params.min_p, params.temperature, false,
+                         params.n_batch, params.n_ubatch, threading, 1, true, params.kv_cache);
+    if (!params.draft_model_path.empty() &&
+        !inference.load_draft_model(params.draft_model_path.c_str(), params.n_draft)) {
+        throw std::runtime_error("cannot use draft model " + params.draft_model_path);
+    }
+    if (params.prompt_lookup) {
+        inference.set_prompt_lookup(params.n_draft);
+    }
+    if (!params.json_schema_path.empty()) {
+        std::ifstream file(params.json_schema_path);
+        const std::string schema((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        if (!file || !inference.set_grammar(schema, true)) {
+            throw std::runtime_error("cannot use JSON schema " + params.json_schema_path);
+        }
+    }
+    inference.set_metrics(true);
+    const int64_t t_load_us = ggml_time_us() - t_load_start_us;
+
+    json turns = json::array();
+    int n_prefill_total = 0;
+    int n_decode_total = 0;
+    int64_t t_prefill_total_us = 0;
+    int64_t t_decode_total_us = 0;
+
+    for (size_t i = 0; i < transcript.size(); i++) {
+        const Message& message = transcript[i];
+        if (message.role != "user") {
+            inference.add_chat_message(message.content, message.role);
+            continue;
+        }
+
+        // as if the app had been in the background between the turns
+        int64_t t_trim_us = 0;
+        if (params.trim_level > 0 && !turns.empty()) {
+            const int64_t t_trim_start_us = ggml_time_us();
+            trim_memory(params.trim_level, std::filesystem::temp_directory_path().string());
+            t_trim_us = ggml_time_us() - t_trim_start_us;
+        }
+
+        const int64_t t_start_us = ggml_time_us();
+        inference.start_completion(message.content);
+
+        // the first completion_loop() call only samples, every later one decodes a token
+        int n_generated = 0;
+        int64_t t_first_token_us = 0;
+        int64_t t_last_token_us = 0;
+        std::string end_reason = "n_predict";
+        while (n_generated < params.n_predict) {
+            std::string piece = inference.completion_loop();
+            if (std::find(std::begin(end_markers), std::end(end_markers), piece) != std::end(end_markers)) {
+                end_reason = piece.substr(1, piece.size() - 2);
+                break;
+            }
+            t_last_token_us = ggml_time_us();
+            if (n_generated++ == 0) {
+                t_first_token_us = t_last_token_us;
+            }
+        }
+        inference.stop_completion();
+        const CompletionTimings timings = inference.last_timings();
+
+        // n_generated tokens were sampled, all but the first one after a decode
+        const int n_decoded = n_generated > 1 ? n_generated - 1 : 0;
+        const int64_t t_decode_us = t_last_token_us - t_first_token_us;
+
+        json turn;
+        turn["turn"] = turns.size();
+        turn["prompt_tokens"] = timings.n_prompt_tokens;
+        turn["reused_tokens"] = timings.n_reused_tokens;
+        turn["prefill_tokens"] = timings.n_prefill_tokens;
+        turn["generated_tokens"] = n_generated;
+        turn["end_reason"] = end_reason;
+        if (params.trim_level > 0) {
+            turn["trim_ms"] = t_trim_us / 1e3;
+        }
+        turn["template_tokenize_ms"] = timings.t_tokenize_us / 1e3;
+        turn["ttft_ms"] = n_generated > 0 ? (t_first_token_us - t_start_us) / 1e3 : 0.0;
+        turn["prefill_ms"] = timings.t_prefill_us / 1e3;
+        turn["prefill_tok_s"] = per_second(timings.n_prefill_tokens, timings.t_prefill_us);
+        turn["decode_tok_s"] = per_second(n_decoded, t_decode_us);
+        turn["sample_us_per_token"] = timings.n_sampled > 0 ? timings.t_sample_us / (double) timings.n_sampled : 0.0;
+        if (timings.t_fastest_window_us > 0) {
+            turn["decode_slowdown"] = timings.t_last_window_us / (double) timings.t_fastest_window_us;
+        }
+        turn["kv_cells"] = timings.n_kv_cells;
+        turn["n_threads"] = timings.n_threads;
+        if (!params.draft_model_path.empty() || params.prompt_lookup) {
+            turn["drafted_tokens"] = timings.n_drafted;
+            turn["accepted_tokens"] = timings.n_accepted;
+        }
+        turns.push_back(turn);
+
+        n_prefill_total += timings.n_prefill_tokens;
+        t_prefill_total_us += timings.t_prefill_us;
+        n_decode_total += n_decoded;
+        t_decode_total_us += t_decode_us;
+
+        // continue the conversation with the recorded reply when there is one
+        if (i + 1 < transcript.size() && transcript[i + 1].role == "assistant") {
+            inference.add_chat_message(transcript[i + 1].content, "assistant");
+            i++;
+        }
+    }
+
+    json result;
+    result["load_ms"] = t_load_us / 1e3;
+    result["n_ctx"] = inference.context_size();
+    result["prefill_tok_s"] = per_second(n_prefill_total, t_prefill_total_us);
+    result["decode_tok_s"] = per_second(n_decode_total, t_decode_total_us);
+    result["turns"] = turns;
+    return result;
+}
+
+}
+
+int main(int argc, char** argv) {
+    BenchParams params;
+    try {
+        params = parse_args(argc, argv);
+    } catch (const std::exception& e) {
+        fprintf(stderr, "error: %s\n", e.what());
+        print_usage(argv[0]);
+        return 1;
+    }
+    if (params.prefix_cache_mb >= 0) {
+        PrefixCache::set_byte_budget((size_t) params.prefix_cache_mb * 1024 * 1024);
+    }
+
+    json report;
+    report["model"] = params.model_path;
+    report["n_predict"] = params.n_predict;
+    report["n_batch"] = params.n_batch;
+    report["n_ubatch"] = params.n_ubatch;
+    report["n_threads"] = params.n_threads;
+    report["n_threads_batch"] = params.n_threads_batch;
+    report["adaptive_threads"] = params.adaptive_threads;
+    report["target_tok_s"] = params.target_tokens_per_sec;
+    report["n_ctx"] = params.kv_cache.n_ctx;
+    report["type_k"] = ggml_type_name(params.kv_cache.type_k);
+    report["type_v"] = ggml_type_name(params.kv_cache.type_v);
+    report["flash_attn"] = params.kv_cache.flash_attn;
+    MemoryEstimate estimate;
+    const uint32_t n_ctx_estimate = params.kv_cache.n_ctx > 0 ? params.kv_cache.n_ctx : 2048;
+    if (estimate_memory(params.model_path.c_str(), n_ctx_estimate, params.kv_cache.type_k, params.kv_cache.type_v,
+                        estimate)) {
+        report["estimated_weights_mb"] = estimate.weights_bytes / 1048576.0;
+        report["estimated_kv_cache_mb"] = estimate.kv_cache_bytes / 1048576.0;
+    }
+    if (!params.draft_model_path.empty()) {
+        report["draft_model"] = params.draft_model_path;
+    }
+    if (!params.draft_model_path.empty() || params.prompt_lookup) {
+        report["prompt_lookup"] = params.prompt_lookup;
+        report["n_draft"] = params.n_draft;
+    }
+
+    json runs = json::array();
+    std::vector<std::string> messages;
+    try {
+        for (const std::string& path : params.transcripts) {
+            const std::vector<Message> transcript = load_transcript(path);
+            for (const Message& message : transcript) {
+                messages.push_back(message.content);
+            }
+            for (int r = 0; r < params.repetitions; r++) {
+                json run = run_transcript(params, transcript);
+                run["transcript"] = path;
+                run["repetition"] = r;
+                runs.push_back(run);
+            }
+        }
+        if (!params.embed_model_path.empty()) {
+            report["embeddings"] = run_embeddings(params, messages);
+        }
+    } catch (const std::exception& e) {
+        fprintf(stderr, "error: %s\n", e.what());
+        return 1;
+    }
+    report["runs"] = runs;
+    report["peak_rss_kb"] = peak_rss_kb();
+
+    const std::string output = report.dump(2) + "\n";
+    if (params.output_path.empty()) {
+        fputs(output.c_str(), stdout);
+    } else {
+        std::ofstream file(params.output_path);
+        file << output;
+        if (!file) {
+            fprintf(stderr, "error: cannot write %s\n", params.output_path.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
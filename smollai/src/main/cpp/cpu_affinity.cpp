@@ -0,0 +1,150 @@
+#include "cpu_affinity.h"
+#include "common.h"
+#include "ggml-backend.h"
+#include "logging.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <stdexcept>
+#include <unistd.h>
+
+static long read_cpu_max_freq(int cpu) {
+    char path[96];
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/cpufreq/cpuinfo_max_freq", cpu);
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        return -1;
+    }
+    long freq = -1;
+    if (fscanf(file, "%ld", &freq) != 1) {
+        freq = -1;
+    }
+    fclose(file);
+    return freq;
+}
+
+std::vector<int> get_performance_cores() {
+    const int n_cpus = std::min((int) sysconf(_SC_NPROCESSORS_CONF), 64);
+
+    std::vector<long> max_freqs(std::max(n_cpus, 0), -1);
+    long slowest = -1;
+    for (int cpu = 0; cpu < n_cpus; cpu++) {
+        max_freqs[cpu] = read_cpu_max_freq(cpu);
+        if (max_freqs[cpu] > 0 && (slowest < 0 || max_freqs[cpu] < slowest)) {
+            slowest = max_freqs[cpu];
+        }
+    }
+
+    std::vector<int> all_cores;
+    std::vector<int> fast_cores;
+    for (int cpu = 0; cpu < n_cpus; cpu++) {
+        if (max_freqs[cpu] <= 0) {
+            continue; // offline or no cpufreq driver
+        }
+        all_cores.push_back(cpu);
+        if (max_freqs[cpu] > slowest) {
+            fast_cores.push_back(cpu);
+        }
+    }
+
+    if (all_cores.empty()) {
+        for (int cpu = 0; cpu < n_cpus; cpu++) {
+            all_cores.push_back(cpu);
+        }
+    }
+    return fast_cores.empty() ? all_cores : fast_cores;
+}
+
+ThreadingConfig resolve_threading_config(const ThreadingConfig& config) {
+    ThreadingConfig resolved = config;
+
+    if (resolved.auto_affinity && resolved.cpu_mask == 0) {
+        for (int cpu : get_performance_cores()) {
+            resolved.cpu_mask |= 1ULL << cpu;
+        }
+        LOGi("Detected performance cores: mask=0x%llx", (unsigned long long) resolved.cpu_mask);
+    }
+
+    if (resolved.n_threads <= 0) {
+        resolved.n_threads = resolved.cpu_mask != 0 ? __builtin_popcountll(resolved.cpu_mask)
+                                                    : cpu_get_num_math();
+    }
+    if (resolved.n_threads_batch <= 0) {
+        resolved.n_threads_batch = resolved.n_threads;
+    }
+
+    resolved.n_threads = std::clamp(resolved.n_threads, 1, GGML_MAX_N_THREADS);
+    resolved.n_threads_batch = std::clamp(resolved.n_threads_batch, 1, GGML_MAX_N_THREADS);
+    resolved.priority = std::clamp(resolved.priority, (int) GGML_SCHED_PRIO_LOW, (int) GGML_SCHED_PRIO_REALTIME);
+    resolved.poll = std::clamp(resolved.poll, 0, 100);
+    return resolved;
+}
+
+static ggml_threadpool_params make_threadpool_params(const ThreadingConfig& config, int n_threads) {
+    ggml_threadpool_params params = ggml_threadpool_params_default(n_threads);
+    for (int cpu = 0; cpu < 64 && cpu < GGML_MAX_N_THREADS; cpu++) {
+        params.cpumask[cpu] = (config.cpu_mask >> cpu) & 1;
+    }
+    params.prio = (ggml_sched_priority) config.priority;
+    params.poll = (uint32_t) config.poll;
+    params.strict_cpu = false; // threads may migrate within the mask
+    return params;
+}
+
+void CpuThreadpools::create(const ThreadingConfig& config) {
+    release();
+
+    // the threadpool API lives in the CPU backend, look it up the same way llama-cli does
+    ggml_backend_dev_t cpu_dev = ggml_backend_dev_by_type(GGML_BACKEND_DEVICE_TYPE_CPU);
+    if (!cpu_dev) {
+        throw std::runtime_error("no CPU backend found");
+    }
+    ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(cpu_dev);
+    auto* threadpool_new_fn = (decltype(ggml_threadpool_new)*) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new");
+    threadpool_free_fn = (decltype(ggml_threadpool_free)*) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free");
+    if (!threadpool_new_fn || !threadpool_free_fn) {
+        throw std::runtime_error("CPU backend does not expose the threadpool API");
+    }
+
+    ggml_threadpool_params params = make_threadpool_params(config, config.n_threads);
+    ggml_threadpool_params params_batch = make_threadpool_params(config, config.n_threads_batch);
+
+    if (!ggml_threadpool_params_match(&params, &params_batch)) {
+        threadpool_batch = threadpool_new_fn(&params_batch);
+        if (!threadpool_batch) {
+            throw std::runtime_error("failed to create the batch threadpool");
+        }
+        // only one of the pools runs at a time, start the decode pool paused
+        params.paused = true;
+    }
+
+    threadpool = threadpool_new_fn(&params);
+    if (!threadpool) {
+        release();
+        throw std::runtime_error("failed to create the threadpool");
+    }
+
+    LOGi("Threadpools created: n_threads=%d, n_threads_batch=%d, cpu_mask=0x%llx, priority=%d, poll=%d",
+         config.n_threads, config.n_threads_batch, (unsigned long long) config.cpu_mask, config.priority, config.poll);
+}
+
+void CpuThreadpools::attach(llama_context* ctx) const {
+    llama_attach_threadpool(ctx, threadpool, threadpool_batch);
+}
+
+void CpuThreadpools::release() {
+    if (threadpool_free_fn) {
+        if (threadpool_batch) {
+            threadpool_free_fn(threadpool_batch);
+        }
+        if (threadpool) {
+            threadpool_free_fn(threadpool);
+        }
+    }
+    threadpool = nullptr;
+    threadpool_batch = nullptr;
+}
+
+CpuThreadpools::~CpuThreadpools() {
+    release();
+}
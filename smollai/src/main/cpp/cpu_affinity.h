@@ -0,0 +1,46 @@
+#pragma once
+
+#include "llama.h"
+#include "ggml-cpu.h"
+#include <cstdint>
+#include <vector>
+
+// CPU placement requested by the app for decode and prefill threads
+struct ThreadingConfig {
+    int n_threads = 0;              // decode threads, 0 = pick automatically
+    int n_threads_batch = 0;        // prefill threads, 0 = same as n_threads
+    uint64_t cpu_mask = 0;          // bit i allows CPU i, 0 = no pinning
+    int priority = GGML_SCHED_PRIO_NORMAL;
+    int poll = 50;                  // busy-wait level between graph nodes (0 - 100)
+    bool auto_affinity = false;     // pin to the performance cores found in sysfs
+    bool adaptive_threads = false;  // use fewer decode threads while throttled, see DecodeScheduler
+    float target_tokens_per_sec = 0.0f; // paces decoding to this many steps per second, 0 = no pacing
+};
+
+// Returns the ids of the CPUs outside the slowest cluster, judged by
+// /sys/devices/system/cpu/cpuN/cpufreq/cpuinfo_max_freq. On homogeneous
+// SoCs (or when cpufreq is not readable) every online CPU is returned.
+std::vector<int> get_performance_cores();
+
+// Replaces the automatic (zero) fields of the config with concrete values
+ThreadingConfig resolve_threading_config(const ThreadingConfig& config);
+
+// Owns the ggml threadpools attached to a llama_context. The pools must
+// outlive the context, so release() is called only after llama_free().
+class CpuThreadpools {
+
+    ggml_threadpool* threadpool = nullptr;
+    ggml_threadpool* threadpool_batch = nullptr;
+    decltype(ggml_threadpool_free)* threadpool_free_fn = nullptr;
+
+    public:
+
+    void create(const ThreadingConfig& config);
+
+    void attach(llama_context* ctx) const;
+
+    void release();
+
+    ~CpuThreadpools();
+
+};
@@ -0,0 +1,82 @@
+#include "decode_scheduler.h"
+#include "logging.h"
+#include <algorithm>
+
+// a window this much slower than the fastest one at the same thread count means throttling
+static const float slowdown_threshold = 1.25f;
+// windows without a change before one more thread is tried again
+static const int n_probe_windows = 32;
+
+void DecodeScheduler::configure(const ThreadingConfig& config) {
+    adaptive = config.adaptive_threads;
+    n_threads_max = std::max(config.n_threads, 1);
+    n_threads = n_threads_max;
+    t_min_token_us = config.target_tokens_per_sec > 0.0f ? (int64_t) (1e6f / config.target_tokens_per_sec) : 0;
+    n_rounds = 0;
+    n_window_seqs = 0;
+    n_window_tokens = 0;
+    t_window_us = 0;
+    t_best_ns = 0;
+    trial = 0;
+    n_windows_since_change = 0;
+}
+
+void DecodeScheduler::on_round(int64_t t_us, int n_seqs, int n_tokens) {
+    if (!adaptive) {
+        return;
+    }
+    // a token costs less in a round shared with another chat, the window starts over when
+    // one starts or stops generating
+    if (n_seqs != n_window_seqs) {
+        n_window_seqs = n_seqs;
+        n_rounds = 0;
+        n_window_tokens = 0;
+        t_window_us = 0;
+    }
+    t_window_us += t_us;
+    n_window_tokens += n_tokens;
+    if (++n_rounds == n_window_rounds) {
+        if (n_window_tokens > 0) {
+            on_window(t_window_us * 1000 / n_window_tokens);
+        }
+        n_rounds = 0;
+        n_window_tokens = 0;
+        t_window_us = 0;
+    }
+}
+
+void DecodeScheduler::on_window(int64_t t_token_ns) {
+    if (trial != 0) {
+        // one more thread has to pay off clearly, one less only has to be faster
+        const bool better = trial < 0 ? t_token_ns < t_before_ns : t_token_ns < t_before_ns * 0.95f;
+        LOGi("Decode threads: %d %s (%.3f ms per token, %.3f ms with %d)", n_threads, better ? "kept" : "reverted",
+             t_token_ns / 1e6, t_before_ns / 1e6, n_threads - trial);
+        if (better && n_threads + trial >= 1 && n_threads + trial <= n_threads_max) {
+            // keep going the same way while it pays off
+            t_before_ns = t_token_ns;
+            n_threads += trial;
+            return;
+        }
+        if (better) {
+            t_best_ns = t_token_ns;
+        } else {
+            n_threads -= trial;
+            t_best_ns = t_before_ns;
+        }
+        trial = 0;
+        n_windows_since_change = 0;
+        return;
+    }
+
+    t_best_ns = t_best_ns > 0 ? std::min(t_best_ns, t_token_ns) : t_token_ns;
+    n_windows_since_change++;
+    if (n_threads > 1 && n_windows_since_change >= 2 && t_token_ns > t_best_ns * slowdown_threshold) {
+        trial = -1;
+    } else if (n_threads < n_threads_max && n_windows_since_change >= n_probe_windows) {
+        trial = 1;
+    } else {
+        return;
+    }
+    t_before_ns = t_token_ns;
+    n_threads += trial;
+}
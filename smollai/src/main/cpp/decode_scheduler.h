@@ -0,0 +1,61 @@
+#pragma once
+
+#include "cpu_affinity.h"
+#include <cstdint>
+
+// Adapts the number of decode threads to the measured time per generated token while
+// tokens are generated. Phones throttle their big cores after some time of sustained
+// decoding, and each graph node waits for the slowest thread: past that point fewer
+// threads are often as fast, since decoding is bound by memory bandwidth, and heat the
+// SoC less. Whenever a window of rounds gets markedly slower per token than the fastest
+// one at the current thread count, one thread less is tried and kept only if the next
+// window is faster; after a while at fewer threads, one more is tried again. Time is
+// measured per token rather than per round, since a round that verifies a speculative
+// draft generates a varying number of tokens.
+//
+// Optionally paces decoding to a target rate instead of running flat out, which keeps the
+// SoC cooler (and the battery drain lower) over a long reply.
+class DecodeScheduler {
+
+    bool adaptive = false;
+    int n_threads_max = 1;
+    int n_threads = 1;
+    int64_t t_min_token_us = 0;
+
+    // rounds of the window being measured, all for `n_window_seqs` sequences, and the
+    // tokens they generated
+    int n_rounds = 0;
+    int n_window_seqs = 0;
+    int n_window_tokens = 0;
+    int64_t t_window_us = 0;
+    // fastest window at the current thread count, in nanoseconds per token
+    int64_t t_best_ns = 0;
+    // +1 or -1 while a changed thread count is tried, with the window measured before it
+    int trial = 0;
+    int64_t t_before_ns = 0;
+    int n_windows_since_change = 0;
+
+    void on_window(int64_t t_token_ns);
+
+    public:
+
+    static const int n_window_rounds = 16;
+
+    // Starts over with all of `config.n_threads` threads
+    void configure(const ThreadingConfig& config);
+
+    // Decode threads to use for the next round
+    int threads() const { return n_threads; }
+
+    // Called after a round that only generated tokens: `n_tokens` of them for `n_seqs`
+    // sequences in `t_us`
+    void on_round(int64_t t_us, int n_seqs, int n_tokens);
+
+    // How long to wait after a round that took `t_us` to hold the target rate, when a
+    // sequence got up to `n_tokens` tokens from it
+    int64_t pacing_delay_us(int64_t t_us, int n_tokens) const {
+        const int64_t t_min_us = t_min_token_us * n_tokens;
+        return t_us < t_min_us ? t_min_us - t_us : 0;
+    }
+
+};
@@ -0,0 +1,135 @@
+#include "draft_model.h"
+#include "kv_cache.h"
+#include "model_registry.h"
+#include "speculative.h"
+#include "logging.h"
+#include <algorithm>
+#include <stdexcept>
+
+namespace {
+
+// every DraftModel, for suspend_all()
+std::mutex registry_mutex;
+std::vector<DraftModel*> draft_models;
+
+} // namespace
+
+DraftModel::DraftModel(const char* path, llama_context* target, const SharedContextParams& params) {
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap = true;
+    model_params.use_mlock = false;
+
+    model = ModelRegistry::acquire(path, model_params);
+    if (!model) {
+        LOGe("failed to load draft model from %s", path);
+        throw std::runtime_error("DraftModel() failed: could not load model file");
+    }
+
+    // the draft keeps up with the whole conversation, so it gets the same context size
+    ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = llama_n_ctx(target);
+    // the draft decodes the tokens it has not seen in one batch, all of them when its
+    // context was just created
+    ctx_params.n_batch = ctx_params.n_ctx;
+    ctx_params.n_ubatch = llama_n_ubatch(target);
+    ctx_params.n_threads = params.threading.n_threads;
+    ctx_params.n_threads_batch = params.threading.n_threads_batch;
+    ctx_params.no_perf = true;
+    ctx_params.type_k = params.type_k;
+    ctx_params.type_v = params.type_v;
+    ctx_params.flash_attn = params.flash_attn;
+
+    ctx = llama_init_from_model(model, ctx_params);
+    if (!ctx) {
+        LOGe("llama_init_from_model() returned null for the draft model");
+        ModelRegistry::release(model);
+        throw std::runtime_error("DraftModel() failed: could not create context");
+    }
+
+    if (!common_speculative_are_compatible(target, ctx)) {
+        LOGe("Draft model %s does not share the vocabulary of the chat model", path);
+        llama_free(ctx);
+        ModelRegistry::release(model);
+        throw std::runtime_error("DraftModel() failed: incompatible vocabulary");
+    }
+
+    // the draft and the chat model run in turn on the same cores: draft workers that
+    // spin after a draft (poll > 0) would hold them while the chat model verifies it
+    ThreadingConfig threading = params.threading;
+    threading.poll = 0;
+    try {
+        threadpools.create(threading);
+        threadpools.attach(ctx);
+    } catch (const std::exception& e) {
+        LOGe("Failed to set up draft threadpools, using defaults: %s", e.what());
+        threadpools.release();
+    }
+
+    spec = common_speculative_init(ctx);
+    n_bytes_per_token = context_bytes_per_token(path, model, params.type_k, params.type_v, params.flash_attn,
+                                                ctx_params.n_ubatch);
+    {
+        std::lock_guard<std::mutex> registry_lock(registry_mutex);
+        draft_models.push_back(this);
+    }
+    LOGi("Draft model loaded from %s", path);
+}
+
+DraftModel::~DraftModel() {
+    {
+        std::lock_guard<std::mutex> registry_lock(registry_mutex);
+        draft_models.erase(std::find(draft_models.begin(), draft_models.end(), this));
+    }
+    common_speculative_free(spec);
+    llama_free(ctx);
+    threadpools.release();
+    ModelRegistry::release(model);
+}
+
+bool DraftModel::create_context(uint32_t n_ctx) {
+    common_speculative_free(spec);
+    spec = nullptr;
+    llama_free(ctx);
+    ctx_params.n_ctx = n_ctx;
+    ctx_params.n_batch = n_ctx;
+    ctx = llama_init_from_model(model, ctx_params);
+    if (!ctx) {
+        LOGe("Failed to create a draft context of %u tokens", n_ctx);
+        return false;
+    }
+    threadpools.attach(ctx);
+    spec = common_speculative_init(ctx);
+    LOGi("Draft context created with %u tokens", n_ctx);
+    return true;
+}
+
+std::vector<llama_token> DraftModel::draft(const std::vector<llama_token>& prompt, llama_token last, int n_max,
+                                           uint32_t n_ctx_target) {
+    if (n_max <= 0) {
+        return {};
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if ((!ctx || llama_n_ctx(ctx) < n_ctx_target) && !create_context(n_ctx_target)) {
+        return {};
+    }
+    common_speculative_params params;
+    params.n_draft = n_max;
+    return common_speculative_gen_draft(spec, params, prompt, last);
+}
+
+int DraftModel::suspend_all() {
+    std::lock_guard<std::mutex> registry_lock(registry_mutex);
+    int n_suspended = 0;
+    for (DraftModel* draft_model : draft_models) {
+        std::unique_lock<std::mutex> lock(draft_model->mutex, std::try_to_lock);
+        if (!lock.owns_lock() || !draft_model->ctx) {
+            continue;
+        }
+        common_speculative_free(draft_model->spec);
+        draft_model->spec = nullptr;
+        llama_free(draft_model->ctx);
+        draft_model->ctx = nullptr;
+        n_suspended++;
+    }
+    return n_suspended;
+}
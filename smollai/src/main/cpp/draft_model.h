@@ -0,0 +1,57 @@
+#pragma once
+
+#include "llama.h"
+#include "shared_context.h"
+#include <mutex>
+#include <vector>
+
+struct common_speculative;
+
+// A small model sharing the vocabulary of the chat model that proposes the next few
+// tokens for speculative decoding. Decode is bound by reading the weights, so the
+// chat model verifies a whole draft in about the time it takes to generate a token;
+// every accepted draft token is one decode step saved.
+class DraftModel {
+
+    llama_model* model = nullptr;
+    llama_context* ctx = nullptr;
+    llama_context_params ctx_params;
+    CpuThreadpools threadpools;
+    common_speculative* spec = nullptr;
+    uint64_t n_bytes_per_token = 0;
+    // guards the context, which suspend_all() may free from another thread
+    std::mutex mutex;
+
+    // creates the context with room for `n_ctx` tokens, replacing a smaller one
+    bool create_context(uint32_t n_ctx);
+
+    public:
+
+    // Loads the draft model at `path` with a context created with the same parameters as
+    // `target`; it grows with the target context, see draft(). Throws std::runtime_error if it cannot be loaded or its vocabulary does
+    // not match.
+    DraftModel(const char* path, llama_context* target, const SharedContextParams& params);
+
+    ~DraftModel();
+
+    DraftModel(const DraftModel&) = delete;
+    DraftModel& operator=(const DraftModel&) = delete;
+
+    // Up to `n_max` tokens likely to follow `prompt` and `last`; stops early at the
+    // first token the draft model is not confident about. The context is recreated first
+    // if the target context has grown to more than it holds, `n_ctx_target` tokens.
+    std::vector<llama_token> draft(const std::vector<llama_token>& prompt, llama_token last, int n_max,
+                                   uint32_t n_ctx_target);
+
+    // Frees the context of every draft model, its KV cache and compute buffers, except
+    // while it is drafting; the next draft() creates it again and decodes the conversation
+    // into it. Returns the number of contexts freed.
+    static int suspend_all();
+
+    // Size of the weights, mapped like those of the chat model
+    uint64_t weights_bytes() const { return llama_model_size(model); }
+
+    // Memory one token of the draft context takes, see context_bytes_per_token()
+    uint64_t bytes_per_token() const { return n_bytes_per_token; }
+
+};
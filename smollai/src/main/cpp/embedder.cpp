@@ -0,0 +1,155 @@
+#include "embedder.h"
+#include "model_registry.h"
+#include "common.h"
+#include "logging.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// tokens decoded at once; with non-causal attention a batch is a single ubatch
+static const uint32_t n_batch_tokens = Embedder::max_text_tokens;
+// short texts are packed into a batch up to this many tokens. Every token of a batch
+// attends over all of them (masked to its own text), so packing into long batches costs
+// more attention than the larger matrix multiplications save.
+static const uint32_t n_pack_tokens = 128;
+// texts decoded together at most
+static const uint32_t n_batch_seqs = 32;
+
+Embedder::Embedder(const char* path, const ThreadingConfig& threading) {
+    // idempotent, for apps that embed before (or without) loading a chat model
+    llama_backend_init();
+
+    llama_model_params model_params = llama_model_default_params();
+    model_params.use_mmap = true;
+    model_params.use_mlock = false;
+
+    model = ModelRegistry::acquire(path, model_params);
+    if (!model) {
+        LOGe("failed to load embedding model from %s", path);
+        throw std::runtime_error("Embedder() failed: could not load model file");
+    }
+    if (llama_model_has_encoder(model) && llama_model_has_decoder(model)) {
+        LOGe("Embedding model %s is an encoder-decoder model", path);
+        ModelRegistry::release(model);
+        throw std::runtime_error("Embedder() failed: encoder-decoder models are not supported");
+    }
+
+    const ThreadingConfig resolved = resolve_threading_config(threading);
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = n_batch_tokens;
+    ctx_params.n_batch = n_batch_tokens;
+    ctx_params.n_ubatch = n_batch_tokens;
+    ctx_params.n_seq_max = n_batch_seqs;
+    ctx_params.n_threads = resolved.n_threads;
+    ctx_params.n_threads_batch = resolved.n_threads_batch;
+    ctx_params.no_perf = true;
+    ctx_params.embeddings = true;
+
+    // embedding models set their pooling in the GGUF; any other model is mean pooled
+    ctx = llama_init_from_model(model, ctx_params);
+    if (ctx && llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_NONE) {
+        llama_free(ctx);
+        ctx_params.pooling_type = LLAMA_POOLING_TYPE_MEAN;
+        ctx = llama_init_from_model(model, ctx_params);
+    }
+    if (!ctx) {
+        LOGe("llama_init_from_model() returned null for the embedding model");
+        ModelRegistry::release(model);
+        throw std::runtime_error("Embedder() failed: could not create context");
+    }
+    if (llama_pooling_type(ctx) == LLAMA_POOLING_TYPE_RANK) {
+        LOGe("%s is a reranking model", path);
+        llama_free(ctx);
+        ModelRegistry::release(model);
+        throw std::runtime_error("Embedder() failed: reranking models are not supported");
+    }
+
+    try {
+        threadpools.create(resolved);
+        threadpools.attach(ctx);
+    } catch (const std::exception& e) {
+        LOGe("Failed to set up embedding threadpools, using defaults: %s", e.what());
+        threadpools.release();
+    }
+
+    n_embd = llama_model_n_embd(model);
+    n_seq_max = llama_n_seq_max(ctx);
+    batch = llama_batch_init((int32_t) llama_n_batch(ctx), 0, 1);
+    LOGi("Embedding model loaded from %s: %d dimensions, pooling %d", path, n_embd, llama_pooling_type(ctx));
+}
+
+Embedder::~Embedder() {
+    llama_batch_free(batch);
+    llama_free(ctx);
+    threadpools.release();
+    ModelRegistry::release(model);
+}
+
+bool Embedder::decode_batch(const std::vector<size_t>& texts, float* out) {
+    llama_memory_clear(llama_get_memory(ctx), true);
+    const bool encoder_only = llama_model_has_encoder(model) && !llama_model_has_decoder(model);
+    const int32_t result = encoder_only ? llama_encode(ctx, batch) : llama_decode(ctx, batch);
+    if (result != 0) {
+        LOGe("Embedding %zu texts (%d tokens) failed with code: %d", texts.size(), batch.n_tokens, result);
+        return false;
+    }
+    for (size_t s = 0; s < texts.size(); s++) {
+        const float* embd = llama_get_embeddings_seq(ctx, (llama_seq_id) s);
+        if (!embd) {
+            LOGe("No pooled embedding for sequence %zu", s);
+            return false;
+        }
+        double norm = 0.0;
+        for (int i = 0; i < n_embd; i++) {
+            norm += (double) embd[i] * embd[i];
+        }
+        const float scale = norm > 0.0 ? (float) (1.0 / std::sqrt(norm)) : 0.0f;
+        float* dst = out + texts[s] * n_embd;
+        for (int i = 0; i < n_embd; i++) {
+            dst[i] = embd[i] * scale;
+        }
+    }
+    return true;
+}
+
+bool Embedder::embed(const std::vector<std::string>& texts, float* out) {
+    std::lock_guard<std::mutex> lock(mutex);
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    const size_t n_tokens_max = std::min<size_t>(max_text_tokens, llama_model_n_ctx_train(model));
+
+    // texts of the batch being assembled, sequence s holds texts[batch_texts[s]]
+    std::vector<size_t> batch_texts;
+    batch.n_tokens = 0;
+    for (size_t t = 0; t < texts.size(); t++) {
+        // the text is the user's, special token names in it are plain text
+        std::vector<llama_token> tokens = common_tokenize(vocab, texts[t], true, false);
+        if (tokens.size() > n_tokens_max) {
+            tokens.resize(n_tokens_max);
+        }
+        if (tokens.empty()) {
+            std::fill(out + t * n_embd, out + (t + 1) * n_embd, 0.0f);
+            continue;
+        }
+        // a text longer than n_pack_tokens goes in a batch of its own
+        if (!batch_texts.empty() &&
+            (batch.n_tokens + tokens.size() > n_pack_tokens || batch_texts.size() == n_seq_max)) {
+            if (!decode_batch(batch_texts, out)) {
+                return false;
+            }
+            batch_texts.clear();
+            batch.n_tokens = 0;
+        }
+        const auto seq_id = (llama_seq_id) batch_texts.size();
+        for (size_t i = 0; i < tokens.size(); i++) {
+            const int32_t idx = batch.n_tokens++;
+            batch.token[idx] = tokens[i];
+            batch.pos[idx] = (llama_pos) i;
+            batch.n_seq_id[idx] = 1;
+            batch.seq_id[idx][0] = seq_id;
+            // pooling reads the output of every token
+            batch.logits[idx] = true;
+        }
+        batch_texts.push_back(t);
+    }
+    return batch_texts.empty() || decode_batch(batch_texts, out);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "llama.h"
+#include "cpu_affinity.h"
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Turns texts into embedding vectors for semantic search over the chats, with an
+// embedding model (or any GGUF, whose hidden states are then mean pooled). The texts
+// are decoded together, one sequence each, as many as fit in a batch, and the pooled
+// vector of every sequence is L2-normalized so that a dot product between two of them
+// is their cosine similarity (see VectorIndex).
+class Embedder {
+
+    llama_model* model = nullptr;
+    llama_context* ctx = nullptr;
+    CpuThreadpools threadpools;
+    llama_batch batch;
+    int n_embd = 0;
+    uint32_t n_seq_max = 0;
+    // one embed() at a time, the batch and the context are reused
+    std::mutex mutex;
+
+    // decodes the sequences in `batch`, sequence s holding the tokens of text texts[s],
+    // and writes their normalized embeddings to `out`
+    bool decode_batch(const std::vector<size_t>& texts, float* out);
+
+    public:
+
+    // texts are truncated to this many tokens (or the training context, if shorter)
+    static const uint32_t max_text_tokens = 512;
+
+    // Loads the model at `path` with a context for embeddings. Throws std::runtime_error
+    // if it cannot be loaded, or if it is a reranking or encoder-decoder model.
+    Embedder(const char* path, const ThreadingConfig& threading);
+
+    ~Embedder();
+
+    Embedder(const Embedder&) = delete;
+    Embedder& operator=(const Embedder&) = delete;
+
+    // Dimensions of an embedding
+    int n_dims() const { return n_embd; }
+
+    // Writes the embedding of texts[i] to out[i * n_dims()]; returns false if a decode
+    // fails
+    bool embed(const std::vector<std::string>& texts, float* out);
+
+};
@@ -0,0 +1,67 @@
+#include "fast_sampler.h"
+#include <cmath>
+
+// independent running maxima, which compilers turn into vector max instructions
+static const int n_lanes = 16;
+
+static float max_logit(const float* logits, int32_t n) {
+    float lanes[n_lanes];
+    for (float& lane : lanes) {
+        lane = -INFINITY;
+    }
+    int32_t i = 0;
+    for (; i + n_lanes <= n; i += n_lanes) {
+        for (int j = 0; j < n_lanes; j++) {
+            lanes[j] = logits[i + j] > lanes[j] ? logits[i + j] : lanes[j];
+        }
+    }
+    float max = -INFINITY;
+    for (float lane : lanes) {
+        max = lane > max ? lane : max;
+    }
+    for (; i < n; i++) {
+        max = logits[i] > max ? logits[i] : max;
+    }
+    return max;
+}
+
+FastSampler::FastSampler(float min_p, float temperature) : min_p(min_p) {
+    if (temperature > 0.0f) {
+        llama_sampler_chain_params params = llama_sampler_chain_default_params();
+        params.no_perf = true;
+        tail = llama_sampler_chain_init(params);
+        llama_sampler_chain_add(tail, llama_sampler_init_temp(temperature));
+        llama_sampler_chain_add(tail, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    }
+}
+
+FastSampler::~FastSampler() {
+    if (tail) {
+        llama_sampler_free(tail);
+    }
+}
+
+llama_token FastSampler::sample(const float* logits, int32_t n_vocab) {
+    const float max = max_logit(logits, n_vocab);
+    if (!tail) {
+        // the first token with the highest logit, as the temperature sampler picks it
+        for (int32_t i = 0; i < n_vocab; i++) {
+            if (logits[i] == max) {
+                return i;
+            }
+        }
+        return 0;
+    }
+
+    // the tokens min-p keeps, p_i >= min_p * p_max; always at least the top one
+    const float min_logit = max + logf(min_p);
+    candidates.clear();
+    for (int32_t i = 0; i < n_vocab; i++) {
+        if (logits[i] >= min_logit) {
+            candidates.push_back({i, logits[i], 0.0f});
+        }
+    }
+    llama_token_data_array cur_p = {candidates.data(), candidates.size(), -1, false};
+    llama_sampler_apply(tail, &cur_p);
+    return cur_p.selected >= 0 ? cur_p.data[cur_p.selected].id : candidates[0].id;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include "llama.h"
+#include <vector>
+
+// Samples straight from the logits for the min-p -> temperature -> dist chain of
+// LLMInference when it does not need the whole vocabulary: temperature 0 is an argmax,
+// and with a min-p cutoff only the tokens within it go through temperature and dist.
+// The chain itself builds and filters a candidate array over all tokens every time,
+// a measurable share of the time per token of small models with large vocabularies.
+// The tokens are drawn from the same distribution as with the chain.
+class FastSampler {
+
+    // temperature and dist over the min-p candidates, null for greedy sampling
+    llama_sampler* tail = nullptr;
+    std::vector<llama_token_data> candidates;
+    float min_p;
+
+    public:
+
+    // Whether sample() can stand in for the chain with these parameters
+    static bool supports(float min_p, float temperature) { return temperature <= 0.0f || min_p > 0.0f; }
+
+    FastSampler(float min_p, float temperature);
+
+    ~FastSampler();
+
+    FastSampler(const FastSampler&) = delete;
+    FastSampler& operator=(const FastSampler&) = delete;
+
+    llama_token sample(const float* logits, int32_t n_vocab);
+
+};
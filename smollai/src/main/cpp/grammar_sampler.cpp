@@ -0,0 +1,157 @@
+#include "grammar_sampler.h"
+#include "json-schema-to-grammar.h"
+#include "logging.h"
+#include <nlohmann/json.hpp>
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+
+// a grammar rarely rejects this many likely tokens in a row
+static const size_t n_top = 64;
+
+// higher logits first, lower ids first among equal ones, as the chain resolves ties
+static bool ranks_higher(const llama_token_data& a, const llama_token_data& b) {
+    return a.logit > b.logit || (a.logit == b.logit && a.id < b.id);
+}
+
+GrammarSampler::GrammarSampler(const llama_vocab* vocab, const std::string& grammar, const std::string& trigger_pattern,
+                               float min_p, float temperature) : vocab(vocab), min_p(min_p) {
+    try {
+        if (trigger_pattern.empty()) {
+            this->grammar = llama_sampler_init_grammar(vocab, grammar.c_str(), "root");
+        } else {
+            const char* patterns[] = {trigger_pattern.c_str()};
+            this->grammar = llama_sampler_init_grammar_lazy_patterns(vocab, grammar.c_str(), "root", patterns, 1,
+                                                                     nullptr, 0);
+        }
+    } catch (const std::exception& e) {
+        // std::regex throws on an invalid trigger pattern
+        throw std::invalid_argument(std::string("invalid grammar trigger: ") + e.what());
+    }
+    if (!this->grammar) {
+        throw std::invalid_argument("the grammar cannot be parsed");
+    }
+    if (temperature > 0.0f) {
+        llama_sampler_chain_params params = llama_sampler_chain_default_params();
+        params.no_perf = true;
+        tail = llama_sampler_chain_init(params);
+        llama_sampler_chain_add(tail, llama_sampler_init_temp(temperature));
+        llama_sampler_chain_add(tail, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    }
+}
+
+GrammarSampler::~GrammarSampler() {
+    if (tail) {
+        llama_sampler_free(tail);
+    }
+    llama_sampler_free(grammar);
+}
+
+bool GrammarSampler::pick(bool whole_vocab, float min_top_logit, llama_token& token) {
+    llama_token_data_array cur_p = {candidates.data(), candidates.size(), -1, false};
+    llama_sampler_apply(grammar, &cur_p);
+
+    // the first of the highest allowed logits: in rank order for the top-k, in id order
+    // for the whole vocabulary
+    const llama_token_data* best = nullptr;
+    for (const llama_token_data& candidate : candidates) {
+        if (candidate.logit != -INFINITY && (!best || candidate.logit > best->logit)) {
+            best = &candidate;
+        }
+    }
+    if (!best) {
+        token = -1;
+        return whole_vocab;
+    }
+    if (!tail) {
+        token = best->id;
+        return true;
+    }
+
+    // min-p after the grammar: p_i >= min_p * p_max of the allowed tokens
+    const float min_logit = min_p > 0.0f ? best->logit + logf(min_p) : -INFINITY;
+    if (!whole_vocab && min_top_logit >= min_logit) {
+        return false;
+    }
+    candidates.erase(std::remove_if(candidates.begin(), candidates.end(), [min_logit](const llama_token_data& c) {
+        return c.logit == -INFINITY || c.logit < min_logit;
+    }), candidates.end());
+    cur_p = {candidates.data(), candidates.size(), -1, false};
+    llama_sampler_apply(tail, &cur_p);
+    token = cur_p.selected >= 0 ? cur_p.data[cur_p.selected].id : candidates[0].id;
+    return true;
+}
+
+llama_token GrammarSampler::sample(const float* logits, int32_t n_vocab) {
+    llama_token token = -1;
+    if (tail && min_p <= 0.0f) {
+        // without min-p every allowed token can be sampled: no top-k holds them all
+        candidates.resize(n_vocab);
+        for (int32_t i = 0; i < n_vocab; i++) {
+            candidates[i] = {i, logits[i], 0.0f};
+        }
+        pick(true, -INFINITY, token);
+        return accept(token);
+    }
+
+    // the top-k in a heap whose front is the lowest ranked of them
+    candidates.clear();
+    for (int32_t i = 0; i < n_vocab; i++) {
+        if (candidates.size() < n_top) {
+            candidates.push_back({i, logits[i], 0.0f});
+            std::push_heap(candidates.begin(), candidates.end(), ranks_higher);
+        } else if (logits[i] > candidates.front().logit) {
+            std::pop_heap(candidates.begin(), candidates.end(), ranks_higher);
+            candidates.back() = {i, logits[i], 0.0f};
+            std::push_heap(candidates.begin(), candidates.end(), ranks_higher);
+        }
+    }
+    std::sort(candidates.begin(), candidates.end(), ranks_higher);
+    const float min_top_logit = candidates.empty() ? -INFINITY : candidates.back().logit;
+
+    if (!pick((size_t) n_vocab <= n_top, min_top_logit, token)) {
+        // widen to the top n_top * 16 before the grammar goes over every token
+        for (size_t n = n_top * 16; ; n *= 16) {
+            candidates.resize(n_vocab);
+            for (int32_t i = 0; i < n_vocab; i++) {
+                candidates[i] = {i, logits[i], 0.0f};
+            }
+            if (n >= (size_t) n_vocab) {
+                pick(true, -INFINITY, token);
+                break;
+            }
+            std::partial_sort(candidates.begin(), candidates.begin() + (long) n, candidates.end(), ranks_higher);
+            candidates.resize(n);
+            if (pick(false, candidates.back().logit, token)) {
+                break;
+            }
+        }
+    }
+    return accept(token);
+}
+
+llama_token GrammarSampler::accept(llama_token token) {
+    if (token < 0) {
+        LOGe("The grammar allows no token anymore, ending the reply");
+        const llama_token eos = llama_vocab_eos(vocab);
+        return eos != LLAMA_TOKEN_NULL ? eos : llama_vocab_eot(vocab);
+    }
+    try {
+        llama_sampler_accept(grammar, token);
+    } catch (const std::exception& e) {
+        LOGe("Grammar failed to accept token %d: %s", token, e.what());
+    }
+    return token;
+}
+
+void GrammarSampler::reset() {
+    llama_sampler_reset(grammar);
+}
+
+std::string json_schema_grammar(const std::string& schema) {
+    try {
+        return json_schema_to_grammar(nlohmann::ordered_json::parse(schema));
+    } catch (const std::exception& e) {
+        throw std::invalid_argument(std::string("invalid JSON schema: ") + e.what());
+    }
+}
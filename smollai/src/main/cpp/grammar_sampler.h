@@ -0,0 +1,55 @@
+#pragma once
+
+#include "llama.h"
+#include <string>
+#include <vector>
+
+// Samples like the min-p -> temperature -> dist chain of LLMInference (an argmax at
+// temperature 0), restricted to the tokens a GBNF grammar allows next. Checking a token
+// means matching its text against every parse stack of the grammar, far too slow to do
+// for the whole vocabulary at every step: only the top-k tokens by logit are checked,
+// and the whole vocabulary only when none of them is allowed or when tokens past them
+// could still make it through min-p; without min-p, any allowed token can be drawn and the
+// whole vocabulary is always checked. The tokens are drawn as if the grammar had filtered
+// the whole vocabulary first.
+class GrammarSampler {
+
+    llama_sampler* grammar = nullptr;
+    // temperature and dist over the allowed candidates, null for greedy sampling
+    llama_sampler* tail = nullptr;
+    const llama_vocab* vocab;
+    std::vector<llama_token_data> candidates;
+    float min_p;
+
+    // applies the grammar to `candidates` and picks a token among the allowed ones into
+    // `token`, -1 if none is allowed; returns false when `candidates` are the top-k and
+    // a token past them could have been picked
+    bool pick(bool whole_vocab, float min_top_logit, llama_token& token);
+    // advances the grammar past `token`, or returns the end-of-generation token if -1
+    llama_token accept(llama_token token);
+
+    public:
+
+    // Throws std::invalid_argument if the grammar cannot be parsed. With a
+    // `trigger_pattern` (a regex), the reply is unconstrained until it matches the text so
+    // far; the grammar applies from its first capturing group on.
+    GrammarSampler(const llama_vocab* vocab, const std::string& grammar, const std::string& trigger_pattern,
+                   float min_p, float temperature);
+
+    ~GrammarSampler();
+
+    GrammarSampler(const GrammarSampler&) = delete;
+    GrammarSampler& operator=(const GrammarSampler&) = delete;
+
+    // Samples a token and advances the grammar past it. A grammar that allows no token
+    // anymore ends the reply with an end-of-generation token.
+    llama_token sample(const float* logits, int32_t n_vocab);
+
+    // Starts the grammar over for a new reply
+    void reset();
+
+};
+
+// Converts a JSON schema to a GBNF grammar matching the JSON documents it describes;
+// throws std::invalid_argument if `schema` is not a valid or supported schema
+std::string json_schema_grammar(const std::string& schema);
@@ -0,0 +1,173 @@
+#include "kv_cache.h"
+#include "gguf.h"
+#include "logging.h"
+#include <algorithm>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+namespace {
+
+const ggml_type kv_types[] = {
+    GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_BF16, GGML_TYPE_Q8_0, GGML_TYPE_Q4_0,
+    GGML_TYPE_Q4_1, GGML_TYPE_IQ4_NL, GGML_TYPE_Q5_0, GGML_TYPE_Q5_1,
+};
+
+// A hyperparameter stored either once or per layer (e.g. head counts of OpenELM);
+// empty if the key is missing
+std::vector<uint32_t> get_per_layer(const gguf_context* gguf, const std::string& key, uint32_t n_layer) {
+    const int64_t id = gguf_find_key(gguf, key.c_str());
+    if (id < 0) {
+        return {};
+    }
+    const gguf_type type = gguf_get_kv_type(gguf, id);
+    if (type == GGUF_TYPE_UINT32 || type == GGUF_TYPE_INT32) {
+        const uint32_t value = type == GGUF_TYPE_UINT32 ? gguf_get_val_u32(gguf, id) : (uint32_t) gguf_get_val_i32(gguf, id);
+        return std::vector<uint32_t>(n_layer, value);
+    }
+    const gguf_type arr_type = type == GGUF_TYPE_ARRAY ? gguf_get_arr_type(gguf, id) : GGUF_TYPE_COUNT;
+    if (arr_type != GGUF_TYPE_UINT32 && arr_type != GGUF_TYPE_INT32) {
+        return {};
+    }
+    const auto* data = static_cast<const uint32_t*>(gguf_get_arr_data(gguf, id));
+    std::vector<uint32_t> values(data, data + std::min<size_t>(gguf_get_arr_n(gguf, id), n_layer));
+    values.resize(n_layer, values.empty() ? 0 : values.back());
+    return values;
+}
+
+uint32_t get_u32(const gguf_context* gguf, const std::string& key, uint32_t fallback) {
+    const int64_t id = gguf_find_key(gguf, key.c_str());
+    return id >= 0 && gguf_get_kv_type(gguf, id) == GGUF_TYPE_UINT32 ? gguf_get_val_u32(gguf, id) : fallback;
+}
+
+// kept free beside the model and the context: the app, other apps in the background
+// and the compute buffers that do not grow with the context
+constexpr uint64_t min_margin_bytes = 384ull << 20;
+constexpr uint32_t n_ctx_step = 256;
+constexpr uint32_t n_ctx_min = 512;
+constexpr uint32_t n_ctx_fallback = 2048;
+
+// bytes of `n` values of `type`, rounded up to whole quantization blocks
+uint64_t row_bytes(ggml_type type, uint64_t n) {
+    const uint64_t block = ggml_blck_size(type);
+    return (n + block - 1) / block * ggml_type_size(type);
+}
+
+}
+
+bool is_supported_kv_type(ggml_type type) {
+    return std::find(std::begin(kv_types), std::end(kv_types), type) != std::end(kv_types);
+}
+
+ggml_type kv_type_from_name(const char* name) {
+    for (ggml_type type : kv_types) {
+        if (std::string(ggml_type_name(type)) == name) {
+            return type;
+        }
+    }
+    return GGML_TYPE_COUNT;
+}
+
+bool estimate_memory(const char* model_path, uint32_t n_ctx, ggml_type type_k, ggml_type type_v,
+                     MemoryEstimate& estimate) {
+    if (!is_supported_kv_type(type_k) || !is_supported_kv_type(type_v)) {
+        LOGe("Unsupported KV cache types: %d/%d", type_k, type_v);
+        return false;
+    }
+
+    gguf_init_params params = {/* no_alloc = */ true, /* ctx = */ nullptr};
+    gguf_context* gguf = gguf_init_from_file(model_path, params);
+    if (!gguf) {
+        LOGe("Failed to read GGUF metadata from %s", model_path);
+        return false;
+    }
+
+    estimate = {};
+    for (int64_t i = 0; i < gguf_get_n_tensors(gguf); i++) {
+        estimate.weights_bytes += gguf_get_tensor_size(gguf, i);
+    }
+
+    const int64_t arch_id = gguf_find_key(gguf, "general.architecture");
+    if (arch_id >= 0 && gguf_get_kv_type(gguf, arch_id) == GGUF_TYPE_STRING) {
+        const std::string arch = gguf_get_val_str(gguf, arch_id);
+        const uint32_t n_layer = get_u32(gguf, arch + ".block_count", 0);
+        const uint32_t n_embd = get_u32(gguf, arch + ".embedding_length", 0);
+        const std::vector<uint32_t> n_head = get_per_layer(gguf, arch + ".attention.head_count", n_layer);
+        std::vector<uint32_t> n_head_kv = get_per_layer(gguf, arch + ".attention.head_count_kv", n_layer);
+        if (n_head_kv.empty()) {
+            n_head_kv = n_head;
+        }
+
+        // one key and one value row of n_head_kv * head size per layer and cell
+        for (uint32_t il = 0; il < n_layer && !n_head.empty(); il++) {
+            if (n_head[il] == 0) {
+                continue; // no attention in this layer
+            }
+            const uint32_t head_k = get_u32(gguf, arch + ".attention.key_length", n_embd / n_head[il]);
+            const uint32_t head_v = get_u32(gguf, arch + ".attention.value_length", n_embd / n_head[il]);
+            estimate.kv_cache_bytes += n_ctx * (row_bytes(type_k, (uint64_t) n_head_kv[il] * head_k) +
+                                                row_bytes(type_v, (uint64_t) n_head_kv[il] * head_v));
+        }
+    }
+
+    gguf_free(gguf);
+    return true;
+}
+
+uint64_t available_memory_bytes() {
+    FILE* file = fopen("/proc/meminfo", "r");
+    if (!file) {
+        return 0;
+    }
+    char line[128];
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), file)) {
+        if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1) {
+            break;
+        }
+    }
+    fclose(file);
+    return (uint64_t) kb * 1024;
+}
+
+uint64_t context_bytes_per_token(const char* model_path, const llama_model* model, ggml_type type_k, ggml_type type_v,
+                                 bool flash_attn, uint32_t n_ubatch) {
+    MemoryEstimate estimate;
+    if (!estimate_memory(model_path, 1, type_k, type_v, estimate)) {
+        return 0;
+    }
+    uint64_t bytes = estimate.kv_cache_bytes;
+    if (!flash_attn) {
+        // one f32 score per head and ubatch token against every cached token
+        bytes += (uint64_t) n_ubatch * std::max(llama_model_n_head(model), 0) * sizeof(float);
+    }
+    return bytes;
+}
+
+uint64_t context_memory_budget(const llama_model* model) {
+    const uint64_t available = available_memory_bytes();
+    if (available == 0) {
+        return 0;
+    }
+
+    // the mapped weights have to stay resident, or every token pages them in again
+    const uint64_t model_bytes = llama_model_size(model);
+    const uint64_t margin = std::max(min_margin_bytes, available / 5);
+    const uint64_t budget = available > model_bytes + margin ? available - model_bytes - margin : 0;
+    LOGi("Memory available: %llu MB, model: %llu MB, for contexts: %llu MB", (unsigned long long) (available >> 20),
+         (unsigned long long) (model_bytes >> 20), (unsigned long long) (budget >> 20));
+    // 0 stands for unknown, an exhausted budget still gets the smallest context
+    return std::max<uint64_t>(budget, 1);
+}
+
+uint32_t fit_context_size(const llama_model* model, uint64_t budget, uint64_t bytes_per_token) {
+    const auto n_ctx_train = (uint32_t) std::max(llama_model_n_ctx_train(model), 1);
+    if (budget == 0 || bytes_per_token == 0) {
+        return std::min(n_ctx_fallback, n_ctx_train);
+    }
+
+    const uint64_t n_fit = budget / bytes_per_token / n_ctx_step * n_ctx_step;
+    const auto n_ctx = (uint32_t) std::min<uint64_t>(std::max<uint64_t>(n_fit, n_ctx_min), n_ctx_train);
+    LOGi("%llu bytes per context token: up to %u tokens of context", (unsigned long long) bytes_per_token, n_ctx);
+    return n_ctx;
+}
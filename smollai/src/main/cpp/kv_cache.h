@@ -0,0 +1,48 @@
+#pragma once
+
+#include "ggml.h"
+#include "llama.h"
+#include <cstdint>
+
+// KV cache size and layout requested by the app
+struct KvCacheConfig {
+    uint32_t n_ctx = 0;                     // tokens, 0 = sized from free memory, see fit_context_size()
+    ggml_type type_k = GGML_TYPE_F16;
+    ggml_type type_v = GGML_TYPE_F16;       // quantized values need flash attention
+    bool flash_attn = false;
+};
+
+// True for the types llama.cpp can store keys and values in
+bool is_supported_kv_type(ggml_type type);
+
+// The supported type named `name` ("f16", "q8_0", ...), GGML_TYPE_COUNT if there is none
+ggml_type kv_type_from_name(const char* name);
+
+struct MemoryEstimate {
+    uint64_t weights_bytes = 0;             // tensor data, memory mapped from the file
+    uint64_t kv_cache_bytes = 0;
+};
+
+// Estimates the memory a model takes with an `n_ctx` token KV cache of the given types,
+// reading only the GGUF metadata. Compute buffers (tens of MB) are not included. Returns
+// false if the file cannot be read or a type is not supported.
+bool estimate_memory(const char* model_path, uint32_t n_ctx, ggml_type type_k, ggml_type type_v,
+                     MemoryEstimate& estimate);
+
+// MemAvailable from /proc/meminfo in bytes, 0 where it cannot be read
+uint64_t available_memory_bytes();
+
+// Memory one token of context takes: its keys and values, plus the attention scores
+// computed for it per prefill ubatch when there is no flash attention
+uint64_t context_bytes_per_token(const char* model_path, const llama_model* model, ggml_type type_k, ggml_type type_v,
+                                 bool flash_attn, uint32_t n_ubatch);
+
+// Memory left for contexts next to the model in the memory available now, keeping a
+// safety margin for the app and the system; 0 without /proc/meminfo
+uint64_t context_memory_budget(const llama_model* model);
+
+// Largest context, in multiples of 256 tokens, that fits in `budget` bytes (see
+// context_memory_budget()); `bytes_per_token` includes the cache of a draft model decoding
+// along. Never above the training context, never below 512 tokens (or the training
+// context if smaller); with no budget the old fixed 2048 tokens.
+uint32_t fit_context_size(const llama_model* model, uint64_t budget, uint64_t bytes_per_token);
@@ -1,21 +1,30 @@
 #include "llm_inference.h"
+#include "model_registry.h"
+#include "fast_sampler.h"
 #include "common.h"
+#include "log.h"
+#include "logging.h"
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
 #include <cstring>
 #include <iostream>
 #include <vector>
 #include <string>
-#include <android/log.h>
 
-#define TAG "llama-android.cpp"
-#define LOGi(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
-#define LOGe(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
+// room kept for the reply, at most half of a small context
+static const int n_reply_reserve = 800;
 
-
-void LLMInference::load_model(const char *model_path, float min_p, float temperature, bool store_chats) {
+void LLMInference::load_model(const char *model_path, float min_p, float temperature, bool store_chats,
+                              int n_batch, int n_ubatch, const ThreadingConfig& threading, int n_seq_max,
+                              bool context_shift, const KvCacheConfig& kv_cache) {
     // Initialize llama backend (this is critical and often forgotten)
     static bool backend_initialized = false;
     if (!backend_initialized) {
         llama_backend_init();
+        // common/ logs to stdout, which Android discards; prompt lookup would format a
+        // message for every drafted token
+        common_log_set_verbosity_thold(-1);
         backend_initialized = true;
         LOGi("llama backend initialized");
     }
@@ -36,6 +45,26 @@ void LLMInference::load_model(const char *model_path, float min_p, float tempera
         throw std::runtime_error("load_model() failed: invalid temperature value");
     }
 
+    if (n_batch < 0 || n_ubatch < 0) {
+        LOGe("Invalid batch sizes: n_batch=%d, n_ubatch=%d", n_batch, n_ubatch);
+        throw std::runtime_error("load_model() failed: invalid batch size");
+    }
+
+    if (n_seq_max < 1 || n_seq_max > 64) {
+        LOGe("Invalid number of sequences: %d. Must be between 1 and 64", n_seq_max);
+        throw std::runtime_error("load_model() failed: invalid number of sequences");
+    }
+
+    if (!is_supported_kv_type(kv_cache.type_k) || !is_supported_kv_type(kv_cache.type_v)) {
+        LOGe("Unsupported KV cache types: %d/%d", kv_cache.type_k, kv_cache.type_v);
+        throw std::runtime_error("load_model() failed: unsupported KV cache type");
+    }
+
+    if (ggml_is_quantized(kv_cache.type_v) && !kv_cache.flash_attn) {
+        LOGe("A quantized V cache (%s) requires flash attention", ggml_type_name(kv_cache.type_v));
+        throw std::runtime_error("load_model() failed: quantized V cache requires flash attention");
+    }
+
     LOGi("Loading model from: %s", model_path);
     LOGi("Parameters: min_p=%.2f, temperature=%.2f, store_chats=%s", min_p, temperature, store_chats ? "true" : "false");
 
@@ -44,7 +73,8 @@ void LLMInference::load_model(const char *model_path, float min_p, float tempera
     model_params.use_mmap = true;     // Use memory mapping for better performance
     model_params.use_mlock = false;   // Don't lock memory (problematic on mobile)
 
-    model = llama_model_load_from_file(model_path, model_params);
+    // the weights are shared with every other instance using the same file
+    model = ModelRegistry::acquire(model_path, model_params);
 
     if (!model) {
         LOGe("failed to load model from %s", model_path);
@@ -55,7 +85,7 @@ void LLMInference::load_model(const char *model_path, float min_p, float tempera
     const struct llama_vocab * vocab = llama_model_get_vocab(model);
     if (!vocab) {
         LOGe("Failed to get model vocabulary");
-        llama_model_free(model);
+        ModelRegistry::release(model);
         model = nullptr;
         throw std::runtime_error("Failed to get model vocabulary");
     }
@@ -63,101 +93,467 @@ void LLMInference::load_model(const char *model_path, float min_p, float tempera
     int ctx_size = llama_model_n_ctx_train(model);
     LOGi("Model loaded successfully. Vocab size: %d, Training context: %d", vocab_size, ctx_size);
 
-    // create an instance of llama_context
-    llama_context_params ctx_params = llama_context_default_params();
+    // create (or join) a llama_context
+    SharedContextParams ctx_params;
+    llama_context_params defaults = llama_context_default_params();
 
-    // Use smaller context size for mobile to prevent memory issues
-    ctx_params.n_ctx = std::min(2048, ctx_size);  // Cap at 2048 or model's training context
-    ctx_params.no_perf = true;          // disable performance metrics
-    ctx_params.flash_attn = false;      // Disable flash attention on mobile
+    ctx_params.type_k = kv_cache.type_k;
+    ctx_params.type_v = kv_cache.type_v;
+    ctx_params.flash_attn = kv_cache.flash_attn;
 
-    LOGi("Creating context with size: %d", ctx_params.n_ctx);
+    // n_batch bounds a single llama_decode() call, n_ubatch is the chunk that is
+    // actually computed at once and the granularity of prefill progress reports
+    ctx_params.n_batch = n_batch > 0 ? n_batch : defaults.n_batch;
+    ctx_params.n_ubatch = n_ubatch > 0 ? n_ubatch : defaults.n_ubatch;
 
-    ctx = llama_init_from_model(model, ctx_params);
+    if (kv_cache.n_ctx > 0) {
+        ctx_params.n_ctx = std::min((int) kv_cache.n_ctx, ctx_size);  // Cap at the model's training context
+    } else {
+        // as much context as the free memory allows, allocated as the conversation needs it:
+        // the KV cache starts at 2048 tokens (fewer on low memory) and grows from there
+        context_budget = context_memory_budget(model);
+        context_token_bytes = context_bytes_per_token(model_path, model, kv_cache.type_k, kv_cache.type_v,
+                                                      kv_cache.flash_attn, ctx_params.n_ubatch);
+        ctx_params.n_ctx_max = fit_context_size(model, context_budget, context_token_bytes);
+        ctx_params.n_ctx = std::min(2048u, ctx_params.n_ctx_max);
+    }
+    ctx_params.n_batch = std::min(ctx_params.n_batch, ctx_params.n_ctx);
+    ctx_params.n_ubatch = std::min(ctx_params.n_ubatch, ctx_params.n_batch);
+
+    // other chats on the same model get their own sequence in the same context
+    ctx_params.n_seq_max = n_seq_max;
 
-    if (!ctx) {
-        LOGe("llama_init_from_model() returned null");
-        llama_model_free(model);
+    // decode is memory bound and prefill compute bound, so they get separate thread counts
+    ctx_params.threading = resolve_threading_config(threading);
+
+    try {
+        shared_ctx = SharedContext::acquire(model, ctx_params, seq_id);
+    } catch (const std::exception& e) {
+        ModelRegistry::release(model);
         model = nullptr;
-        throw std::runtime_error("llama_init_from_model() returned null");
+        throw;
     }
 
     // initialize sampler with validation
-    llama_sampler_chain_params sampler_params = llama_sampler_chain_default_params();
-    sampler_params.no_perf = true;      // disable performance metrics
-    sampler = llama_sampler_chain_init(sampler_params);
+    sampler = create_sampler(min_p, temperature);
+    n_vocab = vocab_size;
+    fast_sampler = FastSampler::supports(min_p, temperature) ? std::make_unique<FastSampler>(min_p, temperature)
+                                                             : nullptr;
+    this->min_p = min_p;
+    this->temperature = temperature;
+    grammar_sampler.reset();
+    grammar_gbnf.clear();
+    grammar_trigger.clear();
 
     if (!sampler) {
         LOGe("Failed to initialize sampler");
-        llama_free(ctx);
-        llama_model_free(model);
-        ctx = nullptr;
+        shared_ctx->release_seq(seq_id);
+        shared_ctx.reset();
+        ModelRegistry::release(model);
         model = nullptr;
         throw std::runtime_error("Failed to initialize sampler");
     }
 
-    llama_sampler_chain_add(sampler, llama_sampler_init_min_p(min_p, 1));
-    llama_sampler_chain_add(sampler, llama_sampler_init_temp(temperature));
-    llama_sampler_chain_add(sampler, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    stop_matcher = StopMatcher(chat_template_stop_strings(llama_model_chat_template(model, nullptr)));
+    stop_string_found = false;
 
-    formatted = std::vector<char>(llama_n_ctx(ctx) * 4); // Allocate more space for safety
-    messages.clear();
+    formatted = std::vector<char>(shared_ctx->n_ctx() * 4); // Allocate more space for safety
+    history.clear();
+    update_message_view();
+    rendered_history.clear();
+    n_tokenized = 0;
+    segment_cache = true;
+    pending_tokens.clear();
     this->store_chats = store_chats;
+    this->context_shift = context_shift;
+    n_keep_tokens = 0;
+    n_discarded = 0;
 
     LOGi("Model initialization completed successfully");
 }
 
-void LLMInference::add_chat_message(const char *message, const char *role) {
-    // Validate input parameters
-    if (!message || !role) {
-        LOGe("Invalid message or role parameter in add_chat_message");
+llama_sampler* LLMInference::create_sampler(float min_p, float temperature) {
+    llama_sampler_chain_params sampler_params = llama_sampler_chain_default_params();
+    sampler_params.no_perf = true;      // disable performance metrics
+    llama_sampler* chain = llama_sampler_chain_init(sampler_params);
+    if (!chain) {
+        return nullptr;
+    }
+
+    llama_sampler_chain_add(chain, llama_sampler_init_min_p(min_p, 1));
+    llama_sampler_chain_add(chain, llama_sampler_init_temp(temperature));
+    llama_sampler_chain_add(chain, llama_sampler_init_dist(LLAMA_DEFAULT_SEED));
+    return chain;
+}
+
+bool LLMInference::load_draft_model(const char* path, int n_draft) {
+    if (!model || !shared_ctx || !path || strlen(path) == 0 || n_draft < 1) {
+        LOGe("Invalid state or parameters in load_draft_model");
+        return false;
+    }
+    if (llama_model_is_recurrent(model)) {
+        // rejected draft tokens are removed from the cache, recurrent state cannot roll back
+        LOGe("Speculative decoding is not supported for recurrent models");
+        return false;
+    }
+
+    // the generation thread drafts with the current model, let it finish first
+    join_generation(TOKEN_STREAM_END);
+    draft_model.reset();
+    // the draft context is created with the sizes of the target context
+    if (!shared_ctx->resume()) {
+        LOGe("Speculative decoding disabled: the context cannot be created");
+        return false;
+    }
+    try {
+        draft_model = std::make_unique<DraftModel>(path, shared_ctx->context(), shared_ctx->context_params());
+    } catch (const std::exception& e) {
+        LOGe("Speculative decoding disabled: %s", e.what());
+        return false;
+    }
+    if (shared_ctx->context_params().n_ctx_max > 0 && context_budget > 0 && context_token_bytes > 0) {
+        // the draft's weights come out of the budget the context grows in, and its cache
+        // grows along with it
+        const uint64_t budget = context_budget - std::min(context_budget, draft_model->weights_bytes());
+        shared_ctx->limit_growth(fit_context_size(model, std::max<uint64_t>(budget, 1),
+                                                  context_token_bytes + draft_model->bytes_per_token()));
+    }
+    this->n_draft = std::min(n_draft, (int) shared_ctx->context_params().n_batch - 1);
+    LOGi("Speculative decoding enabled, up to %d draft tokens per step", this->n_draft);
+    return true;
+}
+
+void LLMInference::set_prompt_lookup(int n_draft) {
+    if (!model || !shared_ctx) {
+        LOGe("Invalid state in set_prompt_lookup");
         return;
     }
+    if (n_draft > 0 && llama_model_is_recurrent(model)) {
+        LOGe("Speculative decoding is not supported for recurrent models");
+        return;
+    }
+
+    join_generation(TOKEN_STREAM_END);
+    n_lookup = std::min(std::max(n_draft, 0), (int) shared_ctx->context_params().n_batch - 1);
+    if (n_lookup == 0) {
+        ngram_drafter.reset();
+    } else if (!ngram_drafter) {
+        ngram_drafter = std::make_unique<NgramDrafter>();
+    }
+    LOGi("Prompt lookup drafting %s, up to %d tokens per step", ngram_drafter ? "enabled" : "disabled", n_lookup);
+}
+
+void LLMInference::set_sampling_params(float min_p, float temperature) {
+    if (min_p < 0.0f || min_p > 1.0f || temperature < 0.0f || temperature > 10.0f) {
+        LOGe("Invalid sampling parameters: min_p=%f, temperature=%f", min_p, temperature);
+        throw std::runtime_error("set_sampling_params() failed: invalid parameters");
+    }
+
+    llama_sampler* new_sampler = create_sampler(min_p, temperature);
+    if (!new_sampler) {
+        throw std::runtime_error("set_sampling_params() failed: could not create sampler");
+    }
+
+    // the generation thread samples with the current chain, let it finish first
+    join_generation(TOKEN_STREAM_END);
+    if (sampler) {
+        llama_sampler_free(sampler);
+    }
+    sampler = new_sampler;
+    fast_sampler = FastSampler::supports(min_p, temperature) ? std::make_unique<FastSampler>(min_p, temperature)
+                                                             : nullptr;
+    this->min_p = min_p;
+    this->temperature = temperature;
+    if (!grammar_gbnf.empty()) {
+        // parsed before, cannot fail
+        grammar_sampler = std::make_unique<GrammarSampler>(llama_model_get_vocab(model), grammar_gbnf, grammar_trigger,
+                                                           min_p, temperature);
+    }
+    LOGi("Sampler rebuilt: min_p=%.2f, temperature=%.2f", min_p, temperature);
+}
 
-    if (strlen(message) == 0 || strlen(role) == 0) {
+bool LLMInference::set_grammar(const std::string& grammar, bool json_schema, const std::string& trigger_pattern) {
+    if (!model) {
+        LOGe("Invalid state in set_grammar");
+        return false;
+    }
+
+    std::unique_ptr<GrammarSampler> new_sampler;
+    std::string gbnf;
+    if (!grammar.empty()) {
+        try {
+            gbnf = json_schema ? json_schema_grammar(grammar) : grammar;
+            new_sampler = std::make_unique<GrammarSampler>(llama_model_get_vocab(model), gbnf, trigger_pattern,
+                                                           min_p, temperature);
+        } catch (const std::exception& e) {
+            LOGe("Grammar not set: %s", e.what());
+            return false;
+        }
+    }
+
+    // the generation thread samples with the current grammar, let it finish first
+    join_generation(TOKEN_STREAM_END);
+    grammar_sampler = std::move(new_sampler);
+    grammar_gbnf = std::move(gbnf);
+    grammar_trigger = grammar_sampler ? trigger_pattern : "";
+    return true;
+}
+
+void LLMInference::add_chat_message(std::string message, const std::string& role) {
+    if (message.empty() || role.empty()) {
         LOGe("Empty message or role string in add_chat_message");
         return;
     }
 
-    // Limit message length to prevent memory issues
-    const size_t MAX_MESSAGE_LENGTH = 8192;
-    if (strlen(message) > MAX_MESSAGE_LENGTH) {
-        LOGe("Message too long (%zu chars), truncating to %zu", strlen(message), MAX_MESSAGE_LENGTH);
-        char* truncated_message = static_cast<char*>(malloc(MAX_MESSAGE_LENGTH + 1));
-        if (!truncated_message) {
-            LOGe("Failed to allocate memory for truncated message");
-            return;
+    limit_message_length(message);
+    history.push_back({role, std::move(message), {}});
+    update_message_view();
+}
+
+void LLMInference::limit_message_length(std::string& message) const {
+    // a message that cannot fit in the context is cut; every token takes at least one
+    // byte, so only long messages need tokenizing to find out
+    const int max_tokens = model && shared_ctx ? max_prompt_tokens() : 0;
+    if (max_tokens > 0 && message.size() > (size_t) max_tokens) {
+        const llama_vocab* vocab = llama_model_get_vocab(model);
+        std::vector<llama_token> tokens = common_tokenize(vocab, message, false, false);
+        if ((int) tokens.size() > max_tokens) {
+            LOGe("Message too long (%zu tokens), truncating to %d", tokens.size(), max_tokens);
+            tokens.resize(max_tokens);
+            message = common_detokenize(vocab, tokens, false);
         }
-        strncpy(truncated_message, message, MAX_MESSAGE_LENGTH);
-        truncated_message[MAX_MESSAGE_LENGTH] = '\0';
-        messages.push_back({strdup(role), truncated_message});
+    }
+}
+
+void LLMInference::load_history(std::vector<std::string> roles, std::vector<std::string> contents, bool prefill) {
+    if (!model || !shared_ctx) {
+        LOGe("Invalid state in load_history");
+        return;
+    }
+    if (roles.size() != contents.size()) {
+        LOGe("load_history() got %zu roles for %zu messages", roles.size(), contents.size());
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(completion_mutex);
+    stop_history_prefill();
+    join_generation(TOKEN_STREAM_CANCELLED);
+
+    const int64_t t_start_us = ggml_time_us();
+    history.clear();
+    history.reserve(contents.size());
+    for (size_t i = 0; i < contents.size(); i++) {
+        if (contents[i].empty() || roles[i].empty()) {
+            continue;
+        }
+        limit_message_length(contents[i]);
+        history.push_back({std::move(roles[i]), std::move(contents[i]), {}});
+    }
+    update_message_view();
+    rendered_history.clear();
+    n_tokenized = 0;
+    n_discarded = 0;
+
+    const char* chat_template = llama_model_chat_template(model, nullptr);
+    if (history.empty() || !chat_template) {
+        return;
+    }
+
+    // the whole history is tokenized at once, which is what the segment cache would produce
+    // message by message; the tokens are kept with the last message, and only the messages
+    // added afterwards are rendered and tokenized separately
+    const int len = render_messages(history.size(), false, chat_template);
+    rendered_history.assign(formatted.data(), len);
+    std::vector<llama_token> tokens = common_tokenize(llama_model_get_vocab(model), rendered_history, true, true);
+    if (segment_cache) {
+        history.back().tokens = tokens;
+        n_tokenized = history.size();
     } else {
-        messages.push_back({strdup(role), strdup(message)});
+        rendered_history.clear();
+    }
+    LOGi("Loaded %zu messages (%zu tokens) in %.2f ms", history.size(), tokens.size(),
+         (double) (ggml_time_us() - t_start_us) / 1e3);
+
+    if (prefill) {
+        const size_t n_system = history[0].role == "system" ? count_pinned_tokens(tokens, chat_template) : 0;
+        history_prefill_stop = false;
+        history_prefill_thread = std::thread(&LLMInference::prefill_history, this, std::move(tokens), n_system);
+    }
+}
+
+void LLMInference::prefill_history(std::vector<llama_token> tokens, size_t n_system) {
+    // make room for the history and a reply first; a history that still does not fit is
+    // cut by the context window of the first completion, which decodes it then
+    shared_ctx->grow((uint32_t) tokens.size() + n_reply_reserve);
+    const int context_size = (int) shared_ctx->n_ctx();
+    if ((int) tokens.size() > context_size - std::min(n_reply_reserve, context_size / 2)) {
+        LOGi("History of %zu tokens exceeds the context window, not prefilled", tokens.size());
+        return;
+    }
+
+    const int64_t t_start_us = ggml_time_us();
+    // keep other chats and trim_memory() from evicting or spilling the sequence between
+    // chunks, which would leave the next chunk decoded after a missing prefix
+    shared_ctx->set_busy(seq_id, true);
+    // no logits needed, the query follows
+    const size_t n_past = shared_ctx->reuse_prefix(seq_id, tokens, false);
+    const int n_chunk = (int) shared_ctx->context_params().n_ubatch;
+    size_t n_done = n_past;
+    // neither restored from a snapshot nor shared with another chat: snapshot it for the next ones
+    const bool snapshot_system = n_system > 1 && n_past < n_system && n_system <= tokens.size();
+    while (n_done < tokens.size() && !history_prefill_stop) {
+        const size_t n_end = snapshot_system && n_done < n_system ? n_system : tokens.size();
+        const int n_eval = std::min(n_chunk, (int) (n_end - n_done));
+        const int decode_result = shared_ctx->decode(seq_id, tokens.data() + n_done, n_eval, LogitsCallback());
+        if (decode_result == 2) {
+            break; // the decode was cancelled
+        }
+        if (decode_result != 0) {
+            LOGe("llama_decode() failed while prefilling the history with code: %d", decode_result);
+            break;
+        }
+        n_done += n_eval;
+        if (snapshot_system && n_done == n_system) {
+            shared_ctx->snapshot_prefix(seq_id);
+        }
+    }
+    shared_ctx->set_busy(seq_id, false);
+    if (n_done > n_past) {
+        LOGi("Prefilled %zu of %zu history tokens in the background in %.2f ms", n_done - n_past,
+             tokens.size() - n_past, (double) (ggml_time_us() - t_start_us) / 1e3);
+    }
+}
+
+void LLMInference::stop_history_prefill() {
+    history_prefill_stop = true;
+    if (history_prefill_thread.joinable()) {
+        history_prefill_thread.join();
+    }
+}
+
+int LLMInference::max_prompt_tokens() const {
+    // a growable context may still get larger than it is now
+    const int n_ctx = (int) std::max(shared_ctx->n_ctx(), shared_ctx->context_params().n_ctx_max);
+    return n_ctx - std::min(n_reply_reserve, n_ctx / 2);
+}
+
+void LLMInference::update_message_view() {
+    // the strings may have moved when `history` grew
+    messages.resize(history.size());
+    for (size_t i = 0; i < history.size(); i++) {
+        messages[i] = {history[i].role.c_str(), history[i].message.c_str()};
+    }
+}
+
+void LLMInference::erase_messages(size_t begin, size_t end) {
+    history.erase(history.begin() + (long) begin, history.begin() + (long) end);
+    update_message_view();
+
+    // how a message renders can depend on its neighbours, tokenize everything again
+    for (CachedMessage& cached : history) {
+        cached.tokens.clear();
+    }
+    rendered_history.clear();
+    n_tokenized = 0;
+}
+
+int LLMInference::render_messages(size_t n_messages, bool add_ass, const char* chat_template) {
+    int len = llama_chat_apply_template(chat_template, messages.data(), n_messages, add_ass,
+                                        formatted.data(), formatted.size());
+    if (len > (int) formatted.size()) {
+        formatted.resize(len);
+        len = llama_chat_apply_template(chat_template, messages.data(), n_messages, add_ass,
+                                        formatted.data(), formatted.size());
+    }
+    if (len < 0) {
+        throw std::runtime_error("llama_chat_apply_template() in LLMInference::start_completion() failed");
+    }
+    return len;
+}
+
+std::vector<llama_token> LLMInference::tokenize_history(const char* chat_template) {
+    const llama_vocab* vocab = llama_model_get_vocab(model);
+    auto starts_with_control = [vocab](const std::vector<llama_token>& tokens) {
+        return !tokens.empty() && (llama_vocab_get_attr(vocab, tokens[0]) & LLAMA_TOKEN_ATTR_CONTROL);
+    };
+    auto extends_rendered = [this](int len) {
+        return (size_t) len >= rendered_history.size() &&
+               rendered_history.compare(0, rendered_history.size(), formatted.data(), rendered_history.size()) == 0;
+    };
+    auto disable_segment_cache = [this]() {
+        LOGi("Chat template messages do not start with a control token, tokenizing whole conversations");
+        segment_cache = false;
+        for (CachedMessage& cached : history) {
+            cached.tokens.clear();
+        }
+        rendered_history.clear();
+        n_tokenized = 0;
+    };
+
+    // each new message renders to the text it appends to the conversation
+    for (; segment_cache && n_tokenized < history.size(); n_tokenized++) {
+        const int len = render_messages(n_tokenized + 1, false, chat_template);
+        if (!extends_rendered(len)) {
+            disable_segment_cache();
+            break;
+        }
+        std::string delta(formatted.data() + rendered_history.size(), len - rendered_history.size());
+        std::vector<llama_token> tokens = common_tokenize(llama_model_get_vocab(model), delta, n_tokenized == 0, true);
+        if (n_tokenized > 0 && !starts_with_control(tokens)) {
+            disable_segment_cache();
+            break;
+        }
+        history[n_tokenized].tokens = std::move(tokens);
+        rendered_history += delta;
     }
+
+    const int len = render_messages(history.size(), true, chat_template);
+    if (segment_cache && extends_rendered(len)) {
+        // the assistant prefix is the only part rendered after the cached messages
+        std::string delta(formatted.data() + rendered_history.size(), len - rendered_history.size());
+        std::vector<llama_token> assistant_prefix = common_tokenize(llama_model_get_vocab(model), delta, history.empty(), true);
+        if (delta.empty() || starts_with_control(assistant_prefix)) {
+            std::vector<llama_token> prompt_tokens;
+            for (const CachedMessage& cached : history) {
+                prompt_tokens.insert(prompt_tokens.end(), cached.tokens.begin(), cached.tokens.end());
+            }
+            prompt_tokens.insert(prompt_tokens.end(), assistant_prefix.begin(), assistant_prefix.end());
+            return prompt_tokens;
+        }
+    }
+    if (segment_cache) {
+        disable_segment_cache();
+    }
+
+    std::string prompt(formatted.begin(), formatted.begin() + len);
+    return common_tokenize(llama_model_get_vocab(model), prompt, true, true);
 }
 
-void LLMInference::start_completion(const char *query) {
+bool LLMInference::start_completion(std::string query, const PrefillProgressCallback& on_progress) {
     // Validate input
-    if (!query || strlen(query) == 0) {
+    if (query.empty()) {
         LOGe("Invalid or empty query in start_completion");
         throw std::runtime_error("start_completion() failed: invalid query");
     }
 
     // Validate model and context state
-    if (!model || !ctx || !sampler) {
+    if (!model || !shared_ctx || !sampler) {
         LOGe("Model, context, or sampler not initialized");
         throw std::runtime_error("start_completion() failed: model not properly initialized");
     }
 
-    if (!store_chats) {
-        prev_len = 0;
-        formatted.clear();
-    }
-    add_chat_message(query, "user");
+    // stop_completion() and cancel_completion() wait for the prefill to be interrupted
+    std::lock_guard<std::mutex> lock(completion_mutex);
+    completion_active = false;
+    completion_started = true;
 
-    // Get context size and check if we need to truncate messages
-    int context_size = llama_n_ctx(ctx);
-    int max_context_tokens = context_size - 800; // Increased reserve for longer responses
+    // a previous generation that was never stopped must not touch the context anymore;
+    // the history prefilled in the background so far is reused below
+    join_generation(TOKEN_STREAM_CANCELLED);
+    stop_history_prefill();
+
+    const int64_t t_start_us = ggml_time_us();
+    add_chat_message(std::move(query), "user");
 
     // Get chat template from model
     const char* chat_template = llama_model_chat_template(model, nullptr);
@@ -166,116 +562,404 @@ void LLMInference::start_completion(const char *query) {
         throw std::runtime_error("start_completion() failed: no chat template available");
     }
 
-    // Try to apply template with all messages first
-    int new_len = llama_chat_apply_template(
-            chat_template,  // Use model's chat template
-            messages.data(),
-            messages.size(),
-            true,
-            formatted.data(),
-            formatted.size()
-    );
+    // Tokenize the conversation; the KV cache is reconciled against its tokens below
+    timings = {};
+    const int64_t t_tokenize_start_us = ggml_time_us();
+    std::vector<llama_token> prompt_tokens = tokenize_history(chat_template);
 
-    if (new_len > (int)formatted.size()) {
-        formatted.resize(new_len);
-        new_len = llama_chat_apply_template(chat_template, messages.data(), messages.size(), true, formatted.data(), formatted.size());
-    }
-
-    if (new_len < 0) {
-        throw std::runtime_error("llama_chat_apply_template() in LLMInference::start_completion() failed");
-    }
-
-    // Count tokens in the prompt
-    std::string prompt(formatted.begin() + prev_len, formatted.begin() + new_len);
-    std::vector<llama_token> prompt_tokens = common_tokenize(ctx, prompt, true, true);
+    // a context sized from free memory grows before messages are dropped; this is a no-op
+    // when it is large enough already or at its limit
+    shared_ctx->grow((uint32_t) prompt_tokens.size() + n_reply_reserve);
 
-    // If prompt is too long, truncate old messages (keep system message and recent messages)
-    if ((int)prompt_tokens.size() > max_context_tokens) {
+    // Get context size and check if we need to truncate messages
+    int context_size = (int) shared_ctx->n_ctx();
+    int max_context_tokens = context_size - std::min(n_reply_reserve, context_size / 2);
+
+    if (context_shift) {
+        // keep every message, only the window that fits is in the KV cache
+        prompt_tokens = apply_context_window(prompt_tokens, chat_template, max_context_tokens);
+    } else if ((int)prompt_tokens.size() > max_context_tokens) {
+        // If prompt is too long, truncate old messages (keep system message and recent messages)
         LOGi("Context too long (%zu tokens), truncating old messages", prompt_tokens.size());
 
         // Keep system message (index 0) and last few user/assistant pairs
         size_t messages_to_keep = 5; // System + last 2 user/assistant pairs
-        if (messages.size() > messages_to_keep) {
+        if (history.size() > messages_to_keep) {
             // Remove old messages (but keep system message if it exists)
-            size_t start_remove = 1; // Start after system message
-            size_t end_remove = messages.size() - messages_to_keep + 1;
+            erase_messages(1, history.size() - messages_to_keep + 1);
+        }
+
+        // Recalculate with truncated messages
+        prompt_tokens = tokenize_history(chat_template);
+    }
+
+    timings.t_tokenize_us = ggml_time_us() - t_tokenize_start_us;
+    n_committed = prompt_tokens.size();
+
+    // keep this chat's cache from being evicted by other chats until the reply is done
+    shared_ctx->set_busy(seq_id, true);
+    curr_token_pending = false;
+    accepted_tokens.clear();
+    stop_matcher.reset();
+    stop_string_found = false;
+    if (grammar_sampler) {
+        grammar_sampler->reset();
+    }
+
+    // reuse the cached prefix, evict the divergent tail (previous reply, truncated turns, ...)
+    const size_t n_past = shared_ctx->reuse_prefix(seq_id, prompt_tokens);
+    pending_tokens.assign(prompt_tokens.begin() + (long) n_past, prompt_tokens.end());
+    // the system prompt of a task or a chat was neither restored from a snapshot nor
+    // shared with another chat: snapshot it on the way for the next prompts using it
+    const size_t n_system = !history.empty() && history[0].role == "system"
+                            ? count_pinned_tokens(prompt_tokens, chat_template) : 0;
+    const size_t n_snapshot = n_system > 1 && n_past < n_system ? n_system - n_past : 0;
+
+    LOGi("Prompt tokens: %zu, reused from KV cache: %zu, to decode: %zu",
+         prompt_tokens.size(), n_past, pending_tokens.size());
+    timings.n_prompt_tokens = (int) prompt_tokens.size();
+    timings.n_reused_tokens = (int) n_past;
+    timings.n_prefill_tokens = (int) pending_tokens.size();
+
+    if ((int) prompt_tokens.size() > context_size) {
+        LOGe("Prompt does not fit in the context: %zu tokens, max: %d", prompt_tokens.size(), context_size);
+        shared_ctx->set_busy(seq_id, false);
+        throw std::runtime_error("start_completion() failed: prompt exceeds context size");
+    }
+
+    if (!prefill(on_progress, n_snapshot)) {
+        LOGi("Prefill interrupted");
+        return false;
+    }
+    timings.t_first_token_us = ggml_time_us() - t_start_us;
+    n_window_decoded = 0;
+    t_window_us = 0;
+    completion_active = true;
+    return true;
+}
 
-            for (size_t i = start_remove; i < end_remove && i < messages.size(); ++i) {
-                free(const_cast<void*>(static_cast<const void*>(messages[i].content)));
-                free(const_cast<void*>(static_cast<const void*>(messages[i].role)));
+bool LLMInference::prefill(const PrefillProgressCallback& on_progress, size_t n_snapshot) {
+    const int n_total = (int) pending_tokens.size();
+    const int n_chunk = (int) shared_ctx->context_params().n_ubatch;
+    const int64_t t_start_us = ggml_time_us();
+
+    // decode the prompt one ubatch at a time so that progress can be reported
+    // between chunks; the last chunk samples the first token of the reply
+    sampling_failed = false;
+    for (int i = 0; i < n_total;) {
+        // a chunk ends where the snapshot is taken
+        const int n_end = i < (int) n_snapshot ? (int) n_snapshot : n_total;
+        const int n_eval = std::min(n_chunk, n_end - i);
+        const bool last = i + n_eval == n_total;
+
+        // a cancelled decode returns 2 after the graph node it was computing
+        int decode_result = interrupt_requested ? 2 : shared_ctx->decode(seq_id, pending_tokens.data() + i, n_eval,
+                                                                         last ? sample_callback : LogitsCallback());
+        if (decode_result == 2) {
+            pending_tokens.clear();
+            return false;
+        }
+        if (decode_result != 0) {
+            LOGe("llama_decode() failed during prefill with code: %d", decode_result);
+            pending_tokens.clear();
+            shared_ctx->set_busy(seq_id, false);
+            throw std::runtime_error(decode_result == 1 ? "start_completion() failed: prompt exceeds context size"
+                                                        : "start_completion() failed: prompt decoding failed");
+        }
+
+        i += n_eval;
+        if (i == (int) n_snapshot) {
+            shared_ctx->snapshot_prefix(seq_id);
+        }
+        if (on_progress) {
+            const float elapsed_s = (float) (ggml_time_us() - t_start_us) / 1e6f;
+            if (!on_progress(i, n_total, elapsed_s > 0.0f ? (float) i / elapsed_s : 0.0f)) {
+                pending_tokens.clear();
+                return false;
             }
+        }
+    }
+
+    timings.t_prefill_us = ggml_time_us() - t_start_us;
+    if (n_total > 0) {
+        LOGi("Prefilled %d tokens in %.2f ms", n_total, (double) timings.t_prefill_us / 1e3);
+    }
+
+    pending_tokens.clear();
+    return true;
+}
+
+size_t LLMInference::count_pinned_tokens(const std::vector<llama_token>& prompt_tokens, const char* chat_template) {
+    size_t n_pinned = llama_vocab_get_add_bos(llama_model_get_vocab(model)) ? 1 : 0;
 
-            messages.erase(messages.begin() + start_remove, messages.begin() + end_remove);
+    if (!history.empty() && history[0].role == "system") {
+        // tokenize_history() has the system turn cached unless the segment cache is off
+        std::vector<llama_token> system_tokens = history[0].tokens;
+        if (system_tokens.empty()) {
+            const int len = render_messages(1, false, chat_template);
+            system_tokens = common_tokenize(llama_model_get_vocab(model), std::string(formatted.data(), len), true, true);
+        }
+        // pin as much of the rendered system turn as the full prompt starts with
+        n_pinned = 0;
+        while (n_pinned < system_tokens.size() && n_pinned < prompt_tokens.size() &&
+               system_tokens[n_pinned] == prompt_tokens[n_pinned]) {
+            n_pinned++;
         }
+    }
+    return std::min(n_pinned, prompt_tokens.size());
+}
 
-        // Recalculate with truncated messages
-        new_len = llama_chat_apply_template(
-                chat_template,  // Use chat template
-                messages.data(),
-                messages.size(),
-                true,
-                formatted.data(),
-                formatted.size()
-        );
+std::vector<llama_token> LLMInference::apply_context_window(const std::vector<llama_token>& prompt_tokens,
+                                                            const char* chat_template, int max_tokens) {
+    n_keep_tokens = count_pinned_tokens(prompt_tokens, chat_template);
+    const auto keep_end = prompt_tokens.begin() + (long) n_keep_tokens;
 
-        if (new_len < 0) {
-            throw std::runtime_error("llama_chat_apply_template() after truncation failed");
+    // the window slides forward only; a history that got shorter starts over
+    if (n_keep_tokens + n_discarded >= prompt_tokens.size()) {
+        n_discarded = 0;
+    }
+    std::vector<llama_token> window(prompt_tokens.begin(), keep_end);
+    window.insert(window.end(), keep_end + (long) n_discarded, prompt_tokens.end());
+
+    while ((int) window.size() > max_tokens) {
+        // drop at least half of the unpinned tokens so that this happens rarely
+        const size_t n_left = window.size() - n_keep_tokens;
+        const size_t n_discard = std::min(std::max(window.size() - (size_t) std::max(max_tokens, 0), n_left / 2),
+                                          n_left - 1);
+        if (n_left <= 1 || n_discard == 0) {
+            break; // the pinned tokens alone do not fit
         }
 
-        prev_len = 0; // Reset previous length after truncation
+        // the cached window usually matches, shifting it spares prefilling it again
+        if (shared_ctx->shift_tokens(seq_id, n_keep_tokens, n_discard)) {
+            LOGi("Context shift: dropped %zu cached tokens after the first %zu", n_discard, n_keep_tokens);
+        }
+        window.erase(window.begin() + (long) n_keep_tokens, window.begin() + (long) (n_keep_tokens + n_discard));
+        n_discarded += n_discard;
     }
+    return window;
+}
 
-    std::string final_prompt(formatted.begin() + prev_len, formatted.begin() + new_len);
-    std::vector<llama_token> final_tokens = common_tokenize(ctx, final_prompt, true, true);
+bool LLMInference::shift_context() {
+    std::vector<llama_token> cached = shared_ctx->tokens(seq_id);
+    const size_t n_keep = std::min(n_keep_tokens, cached.size());
+    const size_t n_discard = (cached.size() - n_keep) / 2;
+    if (n_discard == 0) {
+        return false;
+    }
+
+    if (shared_ctx->shift_tokens(seq_id, n_keep, n_discard)) {
+        LOGi("Context shift: dropped %zu tokens after the first %zu, %zu left", n_discard, n_keep,
+             cached.size() - n_discard);
+    } else {
+        // the memory cannot shift positions: recompute the kept tokens instead
+        const int64_t t_start_us = ggml_time_us();
+        cached.erase(cached.begin() + (long) n_keep, cached.begin() + (long) (n_keep + n_discard));
+        const size_t n_past = shared_ctx->reuse_prefix(seq_id, cached);
+        const int decode_result = shared_ctx->decode(seq_id, cached.data() + n_past, (int) (cached.size() - n_past),
+                                                     LogitsCallback());
+        if (decode_result != 0) {
+            LOGe("llama_decode() failed while recomputing the context window with code: %d", decode_result);
+            return false;
+        }
+        LOGi("Context shift: recomputed %zu tokens in %.2f ms", cached.size() - n_past,
+             (double) (ggml_time_us() - t_start_us) / 1e3);
+    }
+    n_discarded += n_discard;
+    // the dropped tokens are the prompt's up to where the reply starts
+    if (n_committed > n_keep) {
+        n_committed = n_committed > n_keep + n_discard ? n_committed - n_discard : n_keep;
+    }
+    return true;
+}
+
+bool LLMInference::sample_token(int32_t batch_idx) {
+    // runs on the decode thread while the logits of this batch are still valid
+    if (!llama_get_logits_ith(shared_ctx->context(), batch_idx)) {
+        sampling_failed = true;
+        return false;
+    }
+    curr_token = sample(batch_idx);
+    sampling_failed = false;
+    return true;
+}
+
+llama_token LLMInference::sample(int32_t batch_idx) {
+    const int64_t t_start_us = collect_metrics ? ggml_time_us() : 0;
+    const float* logits = llama_get_logits_ith(shared_ctx->context(), batch_idx);
+    llama_token token = grammar_sampler ? grammar_sampler->sample(logits, n_vocab)
+                      : fast_sampler ? fast_sampler->sample(logits, n_vocab)
+                                     : llama_sampler_sample(sampler, shared_ctx->context(), batch_idx);
+    if (collect_metrics) {
+        timings.t_sample_us += ggml_time_us() - t_start_us;
+        timings.n_sampled++;
+    }
+    return token;
+}
+
+void LLMInference::record_decode(int64_t t_us, int n_tokens) {
+    timings.n_decoded += n_tokens;
+    timings.t_decode_us += t_us;
+    n_window_decoded += n_tokens;
+    t_window_us += t_us;
+    if (n_window_decoded >= CompletionTimings::n_window_tokens) {
+        // scaled to whole windows, a speculative decode can overshoot one
+        const int64_t t_us_window = t_window_us * CompletionTimings::n_window_tokens / n_window_decoded;
+        timings.t_last_window_us = t_us_window;
+        if (timings.t_fastest_window_us == 0 || t_us_window < timings.t_fastest_window_us) {
+            timings.t_fastest_window_us = t_us_window;
+        }
+        n_window_decoded = 0;
+        t_window_us = 0;
+    }
+}
 
-    LOGi("Final prompt tokens: %zu", final_tokens.size());
+bool LLMInference::verify_token(int32_t batch_idx) {
+    // draft_batch[i + 1] is accepted when it equals verified_tokens[i]; everything
+    // after the first mismatch is rejected without sampling
+    const size_t n = verified_tokens.size();
+    if (sampling_failed || (n > 0 && verified_tokens[n - 1] != draft_batch[n])) {
+        return false;
+    }
+    if (!llama_get_logits_ith(shared_ctx->context(), batch_idx)) {
+        sampling_failed = true;
+        return false;
+    }
+    verified_tokens.push_back(sample(batch_idx));
+    return true;
+}
 
-    // create a llama_batch containing a single sequence
-    batch = llama_batch_get_one(final_tokens.data(), final_tokens.size());
+std::vector<llama_token> LLMInference::draft_tokens(int n_max) {
+    std::vector<llama_token> draft;
+    if (!ngram_drafter && !draft_model) {
+        return draft;
+    }
+    std::vector<llama_token> cached = shared_ctx->tokens(seq_id);
+    if (ngram_drafter) {
+        cached.push_back(curr_token);
+        draft = ngram_drafter->draft(cached, std::min(n_lookup, n_max));
+        cached.pop_back();
+    }
+    if (draft.empty() && draft_model) {
+        draft = draft_model->draft(cached, curr_token, std::min(n_draft, n_max), shared_ctx->n_ctx());
+    }
+    return draft;
 }
 
+int LLMInference::decode_draft(const std::vector<llama_token>& draft) {
+    const size_t n_past = shared_ctx->n_tokens(seq_id);
+    draft_batch.assign(1, curr_token);
+    draft_batch.insert(draft_batch.end(), draft.begin(), draft.end());
+    verified_tokens.clear();
+    sampling_failed = false;
+
+    const int n_batch = (int) draft_batch.size();
+    const int decode_result = shared_ctx->decode(seq_id, draft_batch.data(), n_batch, verify_callback, n_batch);
+    if (decode_result != 0) {
+        // a batch split over two rounds may have been cached in part
+        shared_ctx->truncate(seq_id, n_past);
+        return decode_result;
+    }
+    if (sampling_failed || verified_tokens.empty()) {
+        sampling_failed = true;
+        return 0;
+    }
+
+    // verified_tokens holds the accepted draft tokens followed by the model's own next
+    // token; curr_token and the accepted tokens stay in the cache, the rest is dropped
+    const size_t n_accepted = verified_tokens.size() - 1;
+    if (!shared_ctx->truncate(seq_id, n_past + 1 + n_accepted)) {
+        LOGe("Failed to remove rejected draft tokens from the KV cache");
+        return -1;
+    }
+    timings.n_drafted += (int) draft.size();
+    timings.n_accepted += (int) n_accepted;
+
+    curr_token = verified_tokens[0];
+    accepted_tokens.assign(verified_tokens.begin() + 1, verified_tokens.end());
+    return 0;
+}
 
 std::string LLMInference::completion_loop() {
     // Validate state before proceeding
-    if (!ctx || !model || !sampler) {
-        LOGe("Invalid state: ctx=%p, model=%p, sampler=%p", ctx, model, sampler);
+    if (!shared_ctx || !model || !sampler) {
+        LOGe("Invalid state: ctx=%p, model=%p, sampler=%p", shared_ctx.get(), model, sampler);
         return "[INVALID_STATE]";
     }
-
-    // check if the length of the inputs to the model
-    // have exceeded the context size of the model
-    int context_size = llama_n_ctx(ctx);
-
-    // Use more conservative buffer for longer mathematical responses
-    if (batch.n_tokens > context_size - 300) { // Increased buffer for longer responses
-        LOGe("Context size exceeded: %d tokens, max: %d", batch.n_tokens, context_size);
-        return "[CONTEXT_EXCEEDED]";
+    if (interrupt_requested) {
+        return "[CANCELLED]";
     }
 
-    // Additional safety check for batch validity
-    if (!batch.token || batch.n_tokens <= 0) {
-        LOGe("Invalid batch: tokens=%p, n_tokens=%d", batch.token, batch.n_tokens);
-        return "[INVALID_BATCH]";
+    if (stop_string_found) {
+        return "[EOG]";
     }
 
-    // run the model with error checking
-    int decode_result = llama_decode(ctx, batch);
-    if (decode_result < 0) {
-        LOGe("llama_decode() failed with code: %d", decode_result);
-        return "[DECODE_ERROR]";
+    // prefill() samples the first token; afterwards the token sampled in the
+    // previous iteration is decoded here, together with the tokens of other
+    // chats generating at the same time, and the next one is sampled
+    if (curr_token_pending && !accepted_tokens.empty()) {
+        // verified by the last speculative decode, already in the KV cache
+        curr_token = accepted_tokens.front();
+        accepted_tokens.pop_front();
+    } else if (curr_token_pending) {
+        // check if the length of the inputs to the model
+        // have exceeded the context size of the model
+        size_t n_cached = shared_ctx->n_tokens(seq_id);
+        if (n_cached + 1 > shared_ctx->n_ctx()) {
+            shared_ctx->grow((uint32_t) n_cached + 1);
+        }
+        int context_size = (int) shared_ctx->n_ctx();
+
+        if ((int) n_cached + 1 > context_size && !(context_shift && shift_context())) {
+            LOGe("Context size exceeded: %zu cached + 1 new token, max: %d", n_cached, context_size);
+            return "[CONTEXT_EXCEEDED]";
+        }
+
+        // draft as many tokens as fit in the context after curr_token
+        std::vector<llama_token> draft = draft_tokens(context_size - (int) n_cached - 1);
+        const int64_t t_decode_start_us = collect_metrics ? ggml_time_us() : 0;
+
+        // run the model with error checking
+        int decode_result = draft.empty() ? shared_ctx->decode(seq_id, &curr_token, 1, sample_callback)
+                                          : decode_draft(draft);
+        if (decode_result == 1 && !draft.empty()) {
+            // the other chats left too few KV cells for the draft, go on without it
+            decode_result = shared_ctx->decode(seq_id, &curr_token, 1, sample_callback);
+        }
+        if (decode_result == 1 && shared_ctx->grow((uint32_t) context_size + 1)) {
+            // the other chats fill the cells this one would need
+            decode_result = shared_ctx->decode(seq_id, &curr_token, 1, sample_callback);
+        }
+        if (decode_result == 1 && context_shift && shift_context()) {
+            decode_result = shared_ctx->decode(seq_id, &curr_token, 1, sample_callback);
+        }
+        if (decode_result == 2) {
+            return "[CANCELLED]";
+        }
+        if (decode_result == 1) {
+            // the KV cells are taken by the other chats' generations
+            LOGe("No KV cache space left for the next token");
+            return "[CONTEXT_EXCEEDED]";
+        }
+        if (decode_result != 0) {
+            LOGe("llama_decode() failed with code: %d", decode_result);
+            return "[DECODE_ERROR]";
+        }
+        if (collect_metrics) {
+            record_decode(ggml_time_us() - t_decode_start_us, 1 + (int) accepted_tokens.size());
+        }
+        curr_token_pending = false;
     }
 
-    // sample a token and check if it is an EOG (end of generation token)
+    // check the sampled token and whether it is an EOG (end of generation token)
     // convert the integer token to its correspond word-piece
 
-    // Ensure we have valid logits before sampling
-    float * logits = llama_get_logits_ith(ctx, -1);
-    if (!logits) {
+    // Ensure we had valid logits to sample from
+    if (sampling_failed) {
         LOGe("Failed to get logits from context");
         return "[LOGITS_ERROR]";
     }
 
-    curr_token = llama_sampler_sample(sampler, ctx, -1);
     const struct llama_vocab * vocab = llama_model_get_vocab(model);
 
     // Additional safety check for vocab
@@ -285,6 +969,14 @@ std::string LLMInference::completion_loop() {
     }
 
     if (llama_vocab_is_eog(vocab, curr_token)) { // Use correct modern API
+        // text held back by the stop matcher turned out to be part of the reply; the
+        // next call finds the same token and ends the generation
+        std::string held = stop_matcher.flush();
+        if (!held.empty()) {
+            response += held;
+            curr_token_pending = false;
+            return held;
+        }
         return "[EOG]";
     }
 
@@ -301,168 +993,292 @@ std::string LLMInference::completion_loop() {
         return "[TOKEN_OUT_OF_RANGE]";
     }
 
-    std::string piece = common_token_to_piece(ctx, curr_token, true);
-
-    // Filter out chat format tokens that shouldn't be shown to user
-    if (piece == "<|im_end|>" || piece == "<|im_start|>assistant" ||
-        piece == "<|im_start|>" || piece == "assistant" ||
-        piece.find("<|im_") != std::string::npos) {
-        // Skip these tokens but continue generation
-        batch = llama_batch_get_one(&curr_token, 1);
-        return ""; // Return empty string instead of the format token
+    std::string piece = common_token_to_piece(vocab, curr_token, true);
+    std::string released;
+    if (llama_vocab_get_attr(vocab, curr_token) & LLAMA_TOKEN_ATTR_CONTROL) {
+        // control tokens are not shown; one starting a turn marker (<|im_start|>,
+        // <|user|>) ends the reply
+        stop_string_found = stop_matcher.is_prefix(piece);
+        if (stop_string_found) {
+            released = stop_matcher.flush();
+        }
+    } else {
+        stop_string_found = stop_matcher.feed(piece, released);
+    }
+    if (stop_string_found && released.empty()) {
+        return "[EOG]";
     }
 
-    response += piece;
-
-    LOGi("Generated piece: %s", piece.c_str());
+    response += released;
 
-    // re-init the batch with the newly predicted token
+    // the newly predicted token is decoded in the next iteration;
     // key, value pairs of all previous tokens have been cached
     // in the KV cache
-    batch = llama_batch_get_one(&curr_token, 1);
-    return piece;
+    curr_token_pending = true;
+    return released;
+}
+
+void LLMInference::start_generation(int flush_tokens, int flush_interval_ms) {
+    std::lock_guard<std::mutex> lock(completion_mutex);
+    join_generation(TOKEN_STREAM_CANCELLED);
+    token_stream.reset(flush_tokens, flush_interval_ms);
+    if (!completion_active) {
+        // stopped or cancelled since start_completion(), there is nothing to generate
+        token_stream.close(TOKEN_STREAM_CANCELLED);
+        return;
+    }
+    generation_stop_requested = false;
+    generation_thread = std::thread(&LLMInference::generation_loop, this);
+}
+
+void LLMInference::generation_loop() {
+    // markers returned by completion_loop() when generation cannot continue
+    static const char* const error_markers[] = {
+        "[INVALID_STATE]", "[DECODE_ERROR]", "[LOGITS_ERROR]",
+        "[VOCAB_ERROR]", "[INVALID_TOKEN]", "[TOKEN_OUT_OF_RANGE]"
+    };
+
+    int status = TOKEN_STREAM_END;
+    try {
+        while (!generation_stop_requested.load(std::memory_order_relaxed)) {
+            std::string piece = completion_loop();
+            if (piece == "[EOG]" || piece == "[CONTEXT_EXCEEDED]" || piece == "[CANCELLED]") {
+                break;
+            }
+            if (std::find(std::begin(error_markers), std::end(error_markers), piece) != std::end(error_markers)) {
+                LOGe("Generation stopped: %s", piece.c_str());
+                status = TOKEN_STREAM_ERROR;
+                break;
+            }
+            if (!piece.empty() && !token_stream.write_piece(piece)) {
+                break; // closed by the consumer
+            }
+        }
+    } catch (const std::exception& e) {
+        LOGe("Exception in generation loop: %s", e.what());
+        status = TOKEN_STREAM_ERROR;
+    }
+    token_stream.finish(status);
 }
 
+void LLMInference::join_generation(int close_status) {
+    generation_stop_requested = true;
+    token_stream.close(close_status);
+    if (generation_thread.joinable()) {
+        generation_thread.join();
+    }
+}
+
+void LLMInference::interrupt() {
+    interrupt_requested = true;
+    generation_stop_requested = true;
+    shared_ctx->cancel(seq_id);
+}
 
 void LLMInference::stop_completion() {
     // Validate state
-    if (!model || !ctx) {
-        LOGe("Invalid state in stop_completion: model=%p, ctx=%p", model, ctx);
+    if (!model || !shared_ctx) {
+        LOGe("Invalid state in stop_completion: model=%p, ctx=%p", model, shared_ctx.get());
+        return;
+    }
+    // already stopped: interrupting would cancel another decode of the sequence
+    if (!completion_started) {
         return;
     }
 
-    // Clean up any remaining format tokens from the response
-    std::string cleaned_response = response;
-    size_t pos = 0;
+    // returns within a graph node even in the middle of a long prefill
+    interrupt();
+    std::lock_guard<std::mutex> lock(completion_mutex);
 
-    // Remove common chat format tokens
-    std::vector<std::string> tokens_to_remove = {
-        "<|im_end|>", "<|im_start|>assistant", "<|im_start|>",
-        "<|end|>", "<|assistant|>", "<|user|>", "<|system|>"
-    };
+    // stopping early keeps the partial response; a finished stream is left as it is
+    join_generation(TOKEN_STREAM_END);
 
-    for (const std::string& token : tokens_to_remove) {
-        while ((pos = cleaned_response.find(token)) != std::string::npos) {
-            cleaned_response.erase(pos, token.length());
-        }
-    }
+    // completion_loop() keeps the chat markers out of the response
+    std::string cleaned_response = std::move(response);
 
     // Trim whitespace from beginning and end
     cleaned_response.erase(0, cleaned_response.find_first_not_of(" \t\n\r"));
     cleaned_response.erase(cleaned_response.find_last_not_of(" \t\n\r") + 1);
 
     if (store_chats && !cleaned_response.empty()) {
-        // Use const char* directly instead of strdup since we're not storing it long-term
-        add_chat_message(cleaned_response.c_str(), "assistant");
+        add_chat_message(std::move(cleaned_response), "assistant");
     }
     response.clear();
+    pending_tokens.clear();
+    curr_token_pending = false;
+    accepted_tokens.clear();
+    if (timings.n_drafted > 0) {
+        LOGi("Speculative decoding accepted %d of %d draft tokens", timings.n_accepted, timings.n_drafted);
+    }
+    timings.n_kv_cells = (int) shared_ctx->n_tokens(seq_id);
+    timings.n_ctx = shared_ctx->n_ctx();
+    timings.n_threads = shared_ctx->n_threads();
+    timings.n_threads_batch = shared_ctx->context_params().threading.n_threads_batch;
+
+    // The KV cache keeps the generated reply; the next start_completion() diffs
+    // the re-rendered history against the cached tokens and evicts what differs.
+    if (completion_active) {
+        save_session();
+    }
+    shared_ctx->set_busy(seq_id, false);
+    completion_active = false;
+    completion_started = false;
+    interrupt_requested = false;
+}
 
-    // Safely calculate previous length
-    try {
-        const char* chat_template = llama_model_chat_template(model, nullptr);
-        if (chat_template) {
-            prev_len = llama_chat_apply_template(
-                    chat_template,  // Use chat template
-                    messages.data(),
-                    messages.size(),
-                    false,
-                    nullptr,
-                    0
-            );
-            if (prev_len < 0) {
-                LOGe("llama_chat_apply_template() returned negative length: %d", prev_len);
-                prev_len = 0;  // Reset to safe value
-            }
-        } else {
-            LOGe("No chat template available in stop_completion");
-            prev_len = 0;
-        }
-    } catch (const std::exception& e) {
-        LOGe("Exception in stop_completion: %s", e.what());
-        prev_len = 0;
+static uint64_t fnv1a_hash(uint64_t hash, const void* data, size_t size) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+uint64_t LLMInference::session_key_hash() const {
+    // hashing the whole GGUF file would take seconds, the model description, size and
+    // parameter count identify it well enough; a mismatching state fails to load anyway
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    char desc[256] = {0};
+    llama_model_desc(model, desc, sizeof(desc));
+    hash = fnv1a_hash(hash, desc, strlen(desc));
+
+    const uint64_t model_size = llama_model_size(model);
+    const uint64_t n_params = llama_model_n_params(model);
+    hash = fnv1a_hash(hash, &model_size, sizeof(model_size));
+    hash = fnv1a_hash(hash, &n_params, sizeof(n_params));
+
+    const char* chat_template = llama_model_chat_template(model, nullptr);
+    if (chat_template) {
+        hash = fnv1a_hash(hash, chat_template, strlen(chat_template));
+    }
+
+    // a state saved with another KV cache type cannot be restored
+    const SharedContextParams& params = shared_ctx->context_params();
+    const int32_t kv_types[2] = {params.type_k, params.type_v};
+    hash = fnv1a_hash(hash, kv_types, sizeof(kv_types));
+    return hash;
+}
+
+bool LLMInference::set_session_file(const char* session_dir, int64_t chat_id) {
+    if (!model || !shared_ctx || !session_dir || strlen(session_dir) == 0) {
+        LOGe("Invalid state or session directory in set_session_file");
+        return false;
+    }
+
+    char file_name[64];
+    snprintf(file_name, sizeof(file_name), "/chat-%" PRId64 "-%016" PRIx64 ".kv", chat_id, session_key_hash());
+    session_path = std::string(session_dir) + file_name;
+
+    // the restored state replaces the cache a background prefill would be appending to
+    stop_history_prefill();
+
+    // the file holds this chat's sequence only, other chats in the context are not touched
+    n_discarded = 0;
+    const int64_t t_start_us = ggml_time_us();
+    if (!shared_ctx->load_seq_file(seq_id, session_path)) {
+        LOGi("No saved state restored from %s", session_path.c_str());
+        return false;
+    }
+
+    LOGi("Restored %zu tokens from %s in %.2f ms", shared_ctx->n_tokens(seq_id), session_path.c_str(),
+         (double) (ggml_time_us() - t_start_us) / 1e3);
+    return true;
+}
+
+void LLMInference::save_session() {
+    if (session_path.empty()) {
+        return;
+    }
+
+    // write to a temporary file first so that a crash never leaves a truncated state behind
+    const std::string tmp_path = session_path + ".tmp";
+    const int64_t t_start_us = ggml_time_us();
+    size_t n_written = shared_ctx->save_seq_file(seq_id, tmp_path);
+    if (n_written == 0) {
+        return; // nothing cached
+    }
+    if (std::rename(tmp_path.c_str(), session_path.c_str()) != 0) {
+        LOGe("Failed to save the session state to %s", session_path.c_str());
+        std::remove(tmp_path.c_str());
+        return;
     }
+    LOGi("Saved %zu tokens (%zu bytes) to %s in %.2f ms", shared_ctx->n_tokens(seq_id), n_written, session_path.c_str(),
+         (double) (ggml_time_us() - t_start_us) / 1e3);
 }
 
 void LLMInference::cancel_completion() {
     // Validate state
-    if (!model || !ctx) {
-        LOGe("Invalid state in cancel_completion: model=%p, ctx=%p", model, ctx);
+    if (!model || !shared_ctx) {
+        LOGe("Invalid state in cancel_completion: model=%p, ctx=%p", model, shared_ctx.get());
+        return;
+    }
+    if (!completion_started) {
         return;
     }
 
     LOGi("Cancelling completion, discarding partial response");
 
-    // Simply clear the response without saving it
-    response.clear();
+    interrupt();
+    std::lock_guard<std::mutex> lock(completion_mutex);
+    join_generation(TOKEN_STREAM_CANCELLED);
 
-    // Reset the previous length calculation without saving the assistant message
-    try {
-        const char* chat_template = llama_model_chat_template(model, nullptr);
-        if (chat_template) {
-            prev_len = llama_chat_apply_template(
-                    chat_template,  // Use chat template
-                    messages.data(),
-                    messages.size(),
-                    false,
-                    nullptr,
-                    0
-            );
-            if (prev_len < 0) {
-                LOGe("llama_chat_apply_template() returned negative length: %d", prev_len);
-                prev_len = 0;  // Reset to safe value
-            }
-        } else {
-            LOGe("No chat template available in cancel_completion");
-            prev_len = 0;
-        }
-    } catch (const std::exception& e) {
-        LOGe("Exception in cancel_completion: %s", e.what());
-        prev_len = 0;
+    // the partial reply leaves the KV cache too, the prompt before it stays cached
+    if (completion_active && !shared_ctx->truncate(seq_id, n_committed)) {
+        LOGe("Failed to remove the partial response from the KV cache");
     }
-}
 
+    // Simply clear the response without saving it
+    response.clear();
+    pending_tokens.clear();
+    curr_token_pending = false;
+    accepted_tokens.clear();
+    shared_ctx->set_busy(seq_id, false);
+    completion_active = false;
+    completion_started = false;
+    interrupt_requested = false;
+}
 
 LLMInference::~LLMInference() {
     LOGi("Starting cleanup of LLMInference");
 
-    // free memory held by the message text in messages
-    // (as we had used strdup() to create a malloc'ed copy)
-    for (llama_chat_message &message: messages) {
-        if (message.content) {
-            free(const_cast<void*>(static_cast<const void*>(message.content)));
-            message.content = nullptr;
-        }
-        if (message.role) {
-            free(const_cast<void*>(static_cast<const void*>(message.role)));
-            message.role = nullptr;
-        }
-    }
+    // the generation and prefill threads use the context, stop them before anything is freed
+    join_generation(TOKEN_STREAM_CANCELLED);
+    stop_history_prefill();
+
     messages.clear();
+    history.clear();
 
     // Clean up sampler first
+    grammar_sampler.reset();
+    fast_sampler.reset();
     if (sampler) {
         llama_sampler_free(sampler);
         sampler = nullptr;
         LOGi("Sampler freed");
     }
 
-    // Clean up context
-    if (ctx) {
-        llama_free(ctx);
-        ctx = nullptr;
-        LOGi("Context freed");
+    // holds its own reference to the draft weights
+    draft_model.reset();
+    ngram_drafter.reset();
+
+    // Give the sequence back; the context is freed with its last user
+    if (shared_ctx) {
+        shared_ctx->release_seq(seq_id);
+        shared_ctx.reset();
     }
 
-    // Clean up model last
+    // Release model last, the registry frees it once no other instance uses it
     if (model) {
-        llama_model_free(model);
+        ModelRegistry::release(model);
         model = nullptr;
-        LOGi("Model freed");
+        LOGi("Model released");
     }
 
     // Clear other resources
     formatted.clear();
     response.clear();
+    pending_tokens.clear();
 
     // Note: We don't call llama_backend_free() here because it's global
     // and may be used by other instances
@@ -1,41 +1,308 @@
 #include "llama.h"
+#include "cpu_affinity.h"
+#include "draft_model.h"
+#include "fast_sampler.h"
+#include "grammar_sampler.h"
+#include "ngram_drafter.h"
+#include "shared_context.h"
+#include "stop_matcher.h"
+#include "token_stream.h"
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <functional>
-#include <jni.h>
+
+// Invoked after every prefill chunk with the number of prompt tokens decoded so far,
+// the total to decode and the prefill throughput measured since the first chunk;
+// returning false stops the prefill as if it had been interrupted
+using PrefillProgressCallback = std::function<bool(int n_done, int n_total, float tokens_per_sec)>;
+
+// Measurements of the last completion: start_completion() and the reply generated after it
+struct CompletionTimings {
+    int n_prompt_tokens = 0;        // tokens of the conversation in the context window
+    int n_reused_tokens = 0;        // taken from the KV cache
+    int n_prefill_tokens = 0;       // decoded by the prefill
+    int64_t t_tokenize_us = 0;      // chat template rendering and tokenization
+    int64_t t_prefill_us = 0;
+    int n_drafted = 0;              // speculative tokens verified while generating the reply
+    int n_accepted = 0;             // drafted tokens the model agreed with
+    int64_t t_first_token_us = 0;   // start_completion() until the first token of the reply was sampled
+    int n_threads = 0;              // threads generating the reply
+    int n_threads_batch = 0;        // threads processing the prompt
+    int n_kv_cells = 0;             // KV cells this chat holds once the reply is done
+    uint32_t n_ctx = 0;             // cells of the context shared by all chats on the model
+
+    // per token measurements, collected only after set_metrics(true)
+    int n_decoded = 0;              // reply tokens that came out of a decode
+    int64_t t_decode_us = 0;        // time in decodes while generating, sampling included
+    int n_sampled = 0;              // tokens sampled, the first one and rejected drafts included
+    int64_t t_sample_us = 0;
+    // decode time of the fastest and of the latest window of `n_window_tokens` reply
+    // tokens; a latest window much slower than the fastest one means the device slowed
+    // down while generating, usually from thermal throttling
+    int64_t t_fastest_window_us = 0;
+    int64_t t_last_window_us = 0;
+
+    static const int n_window_tokens = 16;
+};
 
 class LLMInference {
 
     struct CachedMessage {
         std::string role;
         std::string message;
+        // tokens of this message's part of the rendered conversation, empty until tokenized
         std::vector<llama_token> tokens;
     };
 
-    llama_context* ctx;
-    llama_model* model;
-    llama_sampler* sampler;
-    llama_batch batch;
+    // context shared with the other instances on the same model; this chat
+    // owns sequence `seq_id` in it
+    std::shared_ptr<SharedContext> shared_ctx;
+    llama_seq_id seq_id = 0;
+    llama_model* model = nullptr;
+    // memory the context was fitted to and what a token of it takes, for fitting it again
+    // with a draft model; 0 when its size is fixed
+    uint64_t context_budget = 0;
+    uint64_t context_token_bytes = 0;
+    llama_sampler* sampler = nullptr;
+    // samples without the sampler chain when its parameters allow it
+    std::unique_ptr<FastSampler> fast_sampler;
+    int32_t n_vocab = 0;
+    float min_p = 0.0f;
+    float temperature = 0.0f;
+    // constrains the replies, see set_grammar(); samples in place of the two above
+    std::unique_ptr<GrammarSampler> grammar_sampler;
+    std::string grammar_gbnf;
+    std::string grammar_trigger;
     std::string response;
+
+    // the conversation; `messages` points into its strings for llama_chat_apply_template()
+    std::vector<CachedMessage> history;
     std::vector<llama_chat_message> messages;
+    // rendered text of the first `n_tokenized` messages of `history`
+    std::string rendered_history;
+    size_t n_tokenized = 0;
+    // cleared when the chat template does not start every message with a control token;
+    // separately tokenized messages would then differ from the whole prompt tokenized
+    // at once, so every turn tokenizes the full conversation instead
+    bool segment_cache = true;
     llama_token curr_token;
+    // curr_token has been sampled but is not in the KV cache yet
+    bool curr_token_pending = false;
+    // set by sample_token() when the logits could not be read
+    bool sampling_failed = false;
+    // ends the reply at the chat template's turn markers when the model writes them as
+    // text, holding back pieces that may be the start of one
+    StopMatcher stop_matcher;
+    // a turn marker was generated, the next completion_loop() reports the end
+    bool stop_string_found = false;
+    LogitsCallback sample_callback = [this](int32_t batch_idx) { return sample_token(batch_idx); };
+
+    // speculative decoding: `draft_model` proposes up to `n_draft` tokens after curr_token,
+    // or `ngram_drafter` up to `n_lookup` tokens found in the conversation, which are
+    // verified together with curr_token in a single decode
+    std::unique_ptr<DraftModel> draft_model;
+    int n_draft = 0;
+    std::unique_ptr<NgramDrafter> ngram_drafter;
+    int n_lookup = 0;
+    std::vector<llama_token> draft_batch;
+    // tokens sampled from the logits of draft_batch, up to and including the first mismatch
+    std::vector<llama_token> verified_tokens;
+    LogitsCallback verify_callback = [this](int32_t batch_idx) { return verify_token(batch_idx); };
+    // verified tokens not returned by completion_loop() yet; all but the last one are
+    // in the KV cache already and need no decode
+    std::deque<llama_token> accepted_tokens;
+
+    // prompt tokens not yet decoded
+    std::vector<llama_token> pending_tokens;
 
     std::vector<char> formatted;
-    int prev_len = 0;
     bool store_chats;
+    CompletionTimings timings;
+    bool collect_metrics = false;
+    // reply tokens and decode time of the decode speed window being measured
+    int n_window_decoded = 0;
+    int64_t t_window_us = 0;
+
+    // infinite chat: once the context is full the oldest turns are dropped from
+    // the KV cache (shifting the rest) instead of deleting messages
+    bool context_shift = true;
+    // tokens at the start of the prompt that are never dropped (BOS, system prompt)
+    size_t n_keep_tokens = 0;
+    // prompt tokens after the pinned ones that are no longer in the context window
+    size_t n_discarded = 0;
+
+    // file the sequence state is persisted to after every completion, empty = disabled
+    std::string session_path;
+
+    // decodes a history passed to load_history() while the app waits for the first query
+    std::thread history_prefill_thread;
+    std::atomic<bool> history_prefill_stop{false};
+
+    // generated text handed to the app; written by generation_thread
+    TokenStream token_stream;
+    std::thread generation_thread;
+    std::atomic<bool> generation_stop_requested{false};
+
+    // held by start_completion() and by stop/cancel while they clean up, which may be
+    // called from another thread to interrupt a running prefill
+    std::mutex completion_mutex;
+    std::atomic<bool> interrupt_requested{false};
+    // start_completion() ran and neither stop nor cancel has ended it yet; both return
+    // right away otherwise, as the app and getResponse() each stop every reply
+    std::atomic<bool> completion_started{false};
+    // a prompt has been prefilled and the reply is being generated
+    bool completion_active = false;
+    // tokens of the prompt of the current completion, less those a context shift dropped;
+    // cancel_completion() rolls the KV cache back to them, dropping the partial reply
+    size_t n_committed = 0;
+
+    // Decodes `pending_tokens`; once the first `n_snapshot` of them are decoded, the
+    // sequence is saved to the PrefixCache for later prompts starting the same way.
+    // Returns false when interrupted or when `on_progress` returned false.
+    bool prefill(const PrefillProgressCallback& on_progress, size_t n_snapshot = 0);
+
+    // Renders the first `n_messages` messages into `formatted`, returns the length
+    int render_messages(size_t n_messages, bool add_ass, const char* chat_template);
+
+    // Tokens of the whole conversation followed by the assistant prefix; only messages
+    // added since the last call are rendered into text deltas and tokenized
+    std::vector<llama_token> tokenize_history(const char* chat_template);
+
+    void erase_messages(size_t begin, size_t end);
+
+    void update_message_view();
+
+    // Most tokens of context this chat can get, less the room kept for a reply
+    int max_prompt_tokens() const;
+
+    // Cuts a message longer than max_prompt_tokens() at a token boundary
+    void limit_message_length(std::string& message) const;
+
+    // Runs on history_prefill_thread: caches `tokens` in ubatch-sized chunks until
+    // history_prefill_stop is set. The first `n_system` tokens (the system prompt) are
+    // saved as a prefix snapshot for other chats when they had to be decoded.
+    void prefill_history(std::vector<llama_token> tokens, size_t n_system);
+
+    // Stops the background prefill after its current chunk; what it decoded stays cached
+    void stop_history_prefill();
+
+    size_t count_pinned_tokens(const std::vector<llama_token>& prompt_tokens, const char* chat_template);
+
+    // Cuts the rendered history down to the pinned tokens plus the newest ones that fit
+    // in `max_tokens`, shifting the cached window along with it
+    std::vector<llama_token> apply_context_window(const std::vector<llama_token>& prompt_tokens,
+                                                  const char* chat_template, int max_tokens);
+
+    // Drops the older half of the unpinned tokens from the KV cache during generation
+    bool shift_context();
+
+    // sampling callback passed to SharedContext::decode(), sets curr_token
+    bool sample_token(int32_t batch_idx);
+
+    // Samples from the logits of `batch_idx`, with the grammar or the fast sampler when
+    // there is one
+    llama_token sample(int32_t batch_idx);
+
+    // Adds a decode that took `t_us` and produced `n_tokens` reply tokens to the timings
+    void record_decode(int64_t t_us, int n_tokens);
+
+    // Tokens to verify after curr_token, at most `n_max`; empty when speculation is off
+    std::vector<llama_token> draft_tokens(int n_max);
+
+    // Decodes curr_token followed by a draft and keeps the longest prefix of the draft that
+    // matches what the model samples itself; returns the llama_decode() result
+    int decode_draft(const std::vector<llama_token>& draft);
+
+    // sampling callback for decode_draft(), called for curr_token and every drafted token;
+    // false once the rest of the draft is rejected
+    bool verify_token(int32_t batch_idx);
+
+    void generation_loop();
+
+    void join_generation(int close_status);
+
+    // Aborts the decode in progress for this chat and keeps prefill and generation from
+    // starting another one, until stop_completion() or cancel_completion() is done
+    void interrupt();
+
+    static llama_sampler* create_sampler(float min_p, float temperature);
+
+    uint64_t session_key_hash() const;
+
+    void save_session();
 
     public:
 
-    void load_model(const char* model_path, float min_p, float temperature, bool store_chats);
+    void load_model(const char* model_path, float min_p, float temperature, bool store_chats,
+                    int n_batch = 0, int n_ubatch = 0, const ThreadingConfig& threading = {},
+                    int n_seq_max = 1, bool context_shift = true, const KvCacheConfig& kv_cache = {});
 
-    void add_chat_message(const char* message, const char* role);
+    // Enables speculative decoding with the draft model at `path`, which must share the
+    // chat model's vocabulary; up to `n_draft` tokens are verified per decode. Returns
+    // false, leaving speculation off, when the draft model cannot be used.
+    bool load_draft_model(const char* path, int n_draft);
 
-    void start_completion(const char* query);
+    // Enables prompt-lookup drafting of up to `n_draft` tokens from the chat's own tokens,
+    // no second model needed; 0 disables it. With a draft model loaded as well, lookup
+    // drafts are tried first and the draft model fills in when there is none.
+    void set_prompt_lookup(int n_draft);
+
+    // Rebuilds the sampler chain; the model, context and KV cache are kept
+    void set_sampling_params(float min_p, float temperature);
+
+    // Constrains the following replies to `grammar`, in GBNF with a `root` rule, or with
+    // `json_schema` to JSON documents matching the JSON schema in `grammar`; an empty
+    // `grammar` lifts the constraint. With a `trigger_pattern`, a regex matched against the
+    // whole reply so far, the reply is free until it matches, and constrained from its first
+    // capturing group on. Returns false, keeping the previous constraint, if the grammar,
+    // schema or pattern is invalid.
+    bool set_grammar(const std::string& grammar, bool json_schema = false, const std::string& trigger_pattern = "");
+
+    // Appends a message to the conversation, taking over the string. Messages longer than
+    // the context can hold, less the room kept for a reply, are cut at a token boundary.
+    void add_chat_message(std::string message, const std::string& role);
+
+    // Replaces the conversation with `contents[i]` sent by `roles[i]`, rendering the chat
+    // template and tokenizing once for all of them. With `prefill`, the history is decoded
+    // into the KV cache on a background thread, so the first start_completion() only has
+    // to process the query; a start_completion() before it is done takes over from it.
+    // The system prompt is decoded first and kept as a snapshot, which later chats with
+    // the same system prompt and model copy instead of decoding it again.
+    void load_history(std::vector<std::string> roles, std::vector<std::string> contents, bool prefill);
+
+    // Adds `query` and prefills the prompt. Returns false when stop_completion() or
+    // cancel_completion() interrupted it from another thread, or when `on_progress`
+    // returned false; either of them still has to end the completion then.
+    bool start_completion(std::string query, const PrefillProgressCallback& on_progress = nullptr);
+
+    const CompletionTimings& last_timings() const { return timings; }
+
+    // Enables the per token measurements of CompletionTimings, a few clock reads per token
+    void set_metrics(bool enabled) { collect_metrics = enabled; }
+
+    // Tokens the context holds now; grows during the conversation when it is sized automatically
+    uint32_t context_size() const { return shared_ctx ? shared_ctx->n_ctx() : 0; }
 
     std::string completion_loop();
 
+    // Runs completion_loop() on a native thread, streaming pieces into token_stream
+    // in batches of `flush_tokens` pieces or every `flush_interval_ms`
+    void start_generation(int flush_tokens, int flush_interval_ms);
+
+    TokenStream& stream() { return token_stream; }
+
     void stop_completion();
 
+    // Persists the KV cache of this chat in `session_dir`, keyed by the chat id, the model
+    // and its chat template. Restores a previously saved state if there is a matching one.
+    // Returns true when a saved state was restored.
+    bool set_session_file(const char* session_dir, int64_t chat_id);
+
     void cancel_completion();
 
     ~LLMInference();
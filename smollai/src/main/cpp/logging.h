@@ -0,0 +1,16 @@
+#pragma once
+
+// Logging for the native sources: logcat on Android, stderr everywhere else so
+// that the core library also builds and runs on a desktop host (see bench/)
+
+#define TAG "llama-android.cpp"
+
+#ifdef __ANDROID__
+#include <android/log.h>
+#define LOGi(...) __android_log_print(ANDROID_LOG_INFO, TAG, __VA_ARGS__)
+#define LOGe(...) __android_log_print(ANDROID_LOG_ERROR, TAG, __VA_ARGS__)
+#else
+#include <cstdio>
+#define LOGi(...) (fprintf(stderr, "I/" TAG ": " __VA_ARGS__), fputc('\n', stderr))
+#define LOGe(...) (fprintf(stderr, "E/" TAG ": " __VA_ARGS__), fputc('\n', stderr))
+#endif
@@ -0,0 +1,26 @@
+#include "memory_pressure.h"
+#include "draft_model.h"
+#include "logging.h"
+#include "model_registry.h"
+#include "prefix_cache.h"
+#include "shared_context.h"
+
+void trim_memory(int level, const std::string& spill_dir) {
+    LOGi("Trimming memory, level %d", level);
+    if (level >= TRIM_MEMORY_RUNNING_MODERATE) {
+        const size_t n_bytes = PrefixCache::clear();
+        LOGi("Dropped %zu bytes of prefix snapshots", n_bytes);
+    }
+    if (level >= TRIM_MEMORY_RUNNING_LOW) {
+        ModelRegistry::free_idle();
+    }
+    // UI_HIDDEN alone is no memory pressure, the user may come back any moment
+    if ((level == TRIM_MEMORY_RUNNING_CRITICAL || level >= TRIM_MEMORY_BACKGROUND) && !spill_dir.empty()) {
+        const int n_suspended = SharedContext::suspend_all(spill_dir);
+        const int n_drafts = DraftModel::suspend_all();
+        LOGi("Suspended %d contexts and %d draft contexts", n_suspended, n_drafts);
+    }
+    if (level >= TRIM_MEMORY_BACKGROUND) {
+        ModelRegistry::release_weight_pages();
+    }
+}
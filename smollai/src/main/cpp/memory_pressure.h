@@ -0,0 +1,25 @@
+#pragma once
+
+#include <string>
+
+// Levels of ComponentCallbacks2.onTrimMemory()
+enum TrimMemoryLevel {
+    TRIM_MEMORY_RUNNING_MODERATE = 5,
+    TRIM_MEMORY_RUNNING_LOW = 10,
+    TRIM_MEMORY_RUNNING_CRITICAL = 15,
+    TRIM_MEMORY_UI_HIDDEN = 20,
+    TRIM_MEMORY_BACKGROUND = 40,
+    TRIM_MEMORY_MODERATE = 60,
+    TRIM_MEMORY_COMPLETE = 80,
+};
+
+// Gives memory back when Android asks for it, so that the low memory killer picks other
+// processes first and the app survives being in the background with a model loaded:
+// - from RUNNING_MODERATE, the prefix snapshots are dropped (decoded again when needed)
+// - from RUNNING_LOW, models no chat uses anymore are freed
+// - at RUNNING_CRITICAL and from BACKGROUND, the KV cache of every context that is not
+//   generating is spilled to `spill_dir` and the context freed (SharedContext::suspend()),
+//   and the contexts of draft models are freed (DraftModel::suspend_all())
+// - from BACKGROUND, the resident pages of the mapped weights are dropped as well
+// Everything comes back on its own the next time a chat needs it.
+void trim_memory(int level, const std::string& spill_dir);
@@ -0,0 +1,130 @@
+#include "model_registry.h"
+#include "logging.h"
+#include "prefix_cache.h"
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sys/mman.h>
+
+namespace {
+
+struct ModelEntry {
+    llama_model* model;
+    int n_refs;
+};
+
+std::mutex registry_mutex;
+std::map<std::string, ModelEntry> models;
+
+// frees idle models except `keep`; registry_mutex must be held
+void free_idle_locked(const llama_model* keep) {
+    for (auto it = models.begin(); it != models.end();) {
+        if (it->second.n_refs == 0 && it->second.model != keep) {
+            LOGi("Freeing idle model %s", it->first.c_str());
+            PrefixCache::forget_model(it->second.model);
+            llama_model_free(it->second.model);
+            it = models.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+}
+
+llama_model* ModelRegistry::acquire(const std::string& path, const llama_model_params& params) {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+
+    auto it = models.find(path);
+    if (it != models.end()) {
+        it->second.n_refs++;
+        LOGi("Reusing loaded model %s (%d users)", path.c_str(), it->second.n_refs);
+        return it->second.model;
+    }
+
+    // make room before mapping another model
+    free_idle_locked(nullptr);
+
+    llama_model* model = llama_model_load_from_file(path.c_str(), params);
+    if (!model) {
+        LOGe("failed to load model from %s", path.c_str());
+        return nullptr;
+    }
+    models[path] = {model, 1};
+    return model;
+}
+
+void ModelRegistry::release(llama_model* model) {
+    if (!model) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    for (auto& [path, entry] : models) {
+        if (entry.model == model) {
+            entry.n_refs--;
+            // keep only the model that was released last around
+            if (entry.n_refs == 0) {
+                free_idle_locked(model);
+            }
+            return;
+        }
+    }
+    LOGe("Releasing a model that is not in the registry");
+}
+
+void ModelRegistry::free_idle() {
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    free_idle_locked(nullptr);
+}
+
+size_t ModelRegistry::release_weight_pages() {
+    // held throughout: a model freed in the meantime would leave its address range to
+    // other mappings, whose contents MADV_DONTNEED would discard
+    std::lock_guard<std::mutex> lock(registry_mutex);
+    std::set<std::string> files;
+    for (const auto& [path, entry] : models) {
+        char resolved[PATH_MAX];
+        if (realpath(path.c_str(), resolved)) {
+            files.insert(resolved);
+        }
+    }
+    if (files.empty()) {
+        return 0;
+    }
+
+    // llama.cpp maps each GGUF file once; the mappings are found by file name, parts of
+    // them that were unmapped after loading are not listed anymore
+    FILE* maps = fopen("/proc/self/maps", "r");
+    if (!maps) {
+        return 0;
+    }
+    size_t n_bytes = 0;
+    char line[PATH_MAX + 128];
+    while (fgets(line, sizeof(line), maps)) {
+        unsigned long begin = 0;
+        unsigned long end = 0;
+        int path_offset = 0;
+        if (sscanf(line, "%lx-%lx %*s %*s %*s %*s %n", &begin, &end, &path_offset) != 2 || path_offset == 0) {
+            continue;
+        }
+        std::string file(line + path_offset);
+        file.erase(file.find_last_not_of(" \n") + 1);
+        if (files.count(file) == 0) {
+            continue;
+        }
+        // POSIX_MADV_DONTNEED is only a hint that Linux ignores, MADV_DONTNEED drops the pages
+        if (madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED) == 0) {
+            n_bytes += end - begin;
+        } else {
+            LOGe("madvise() failed for %s: %s", file.c_str(), strerror(errno));
+        }
+    }
+    fclose(maps);
+    LOGi("Released the pages of %zu bytes of mapped weights", n_bytes);
+    return n_bytes;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "llama.h"
+#include <string>
+
+// Process-wide cache of loaded models, shared by all LLMInference instances.
+// Models are refcounted by path; the most recently released one stays loaded
+// while idle, so closing a chat and opening another one on the same model
+// only creates a new context instead of mapping the weights again.
+class ModelRegistry {
+
+    public:
+
+    // Returns the model loaded from `path`, loading it on first use; nullptr on failure
+    static llama_model* acquire(const std::string& path, const llama_model_params& params);
+
+    static void release(llama_model* model);
+
+    // Frees every model that no instance uses anymore
+    static void free_idle();
+
+    // Drops the resident pages of the memory mapped weights of every loaded model and
+    // returns the bytes of mappings advised. The pages are clean, so nothing is written:
+    // they are read back from the file on the next decode, which is slower only for the
+    // first tokens after the app comes back to the foreground.
+    static size_t release_weight_pages();
+
+};
@@ -0,0 +1,44 @@
+#include "ngram_drafter.h"
+
+void NgramDrafter::forget(size_t n_keep) {
+    for (size_t i = n_keep; i < tokens.size(); i++) {
+        for (int n = LLAMA_NGRAM_MIN; n <= LLAMA_NGRAM_MAX && (size_t) n <= i; n++) {
+            auto part = context_cache.find(common_ngram(&tokens[i - n], n));
+            if (part == context_cache.end()) {
+                continue;
+            }
+            auto count = part->second.find(tokens[i]);
+            if (count != part->second.end() && --count->second <= 0) {
+                part->second.erase(count);
+            }
+            if (part->second.empty()) {
+                context_cache.erase(part);
+            }
+        }
+    }
+    tokens.resize(n_keep);
+}
+
+std::vector<llama_token> NgramDrafter::draft(const std::vector<llama_token>& sequence, int n_max) {
+    size_t n_common = 0;
+    while (n_common < tokens.size() && n_common < sequence.size() && tokens[n_common] == sequence[n_common]) {
+        n_common++;
+    }
+    // a new turn usually replaces the tail of the last reply, a context shift the middle
+    if (n_common < tokens.size()) {
+        forget(n_common);
+    }
+    const size_t n_new = sequence.size() - n_common;
+    if (n_new > 0) {
+        tokens.insert(tokens.end(), sequence.begin() + (long) n_common, sequence.end());
+        common_ngram_cache_update(context_cache, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, tokens, (int) n_new, false);
+    }
+
+    if (tokens.empty() || n_max <= 0) {
+        return {};
+    }
+    std::vector<llama_token> draft = {tokens.back()};
+    common_ngram_cache_draft(tokens, draft, n_max, LLAMA_NGRAM_MIN, LLAMA_NGRAM_MAX, context_cache,
+                             dynamic_cache, static_cache);
+    return std::vector<llama_token>(draft.begin() + 1, draft.end());
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "llama.h"
+#include "ngram-cache.h"
+#include <vector>
+
+// Prompt-lookup drafting: proposes the continuation that followed the last few tokens
+// earlier in the conversation, using n-gram statistics of the chat's own tokens. Costs
+// no model and almost no memory, and pays off when replies quote or rewrite earlier
+// messages or code.
+class NgramDrafter {
+
+    // tokens the statistics were collected from, a copy of the sequence being drafted for
+    std::vector<llama_token> tokens;
+    common_ngram_cache context_cache;
+    // always empty: the drafts come from this conversation only
+    common_ngram_cache dynamic_cache;
+    common_ngram_cache static_cache;
+
+    // removes the n-grams ending after the first `n_keep` tokens from the statistics
+    void forget(size_t n_keep);
+
+    public:
+
+    // Up to `n_max` tokens likely to follow `sequence`, which ends with the last sampled
+    // token. The statistics follow `sequence` incrementally as long as it mostly grows.
+    std::vector<llama_token> draft(const std::vector<llama_token>& sequence, int n_max);
+
+};
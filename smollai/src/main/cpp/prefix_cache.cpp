@@ -0,0 +1,233 @@
+#include "prefix_cache.h"
+#include "logging.h"
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+namespace {
+
+struct Node {
+    // tokens from the parent to this node, empty for the root
+    std::vector<llama_token> edge;
+    Node* parent = nullptr;
+    // keyed by the first token of their edge
+    std::map<llama_token, std::unique_ptr<Node>> children;
+    std::shared_ptr<const PrefixSnapshot> snapshot;
+    uint64_t last_used = 0;
+};
+
+// snapshots of one model and KV cache layout
+struct Tree {
+    const llama_model* model;
+    ggml_type type_k;
+    ggml_type type_v;
+    bool flash_attn;
+    std::unique_ptr<Node> root;
+};
+
+std::mutex cache_mutex;
+std::vector<Tree> trees;
+size_t n_bytes = 0;
+size_t byte_budget = PrefixCache::default_byte_budget;
+uint64_t use_counter = 0;
+
+size_t snapshot_bytes(const PrefixSnapshot& snapshot) {
+    return snapshot.state.size() + snapshot.tokens.size() * sizeof(llama_token);
+}
+
+Tree* find_tree(const llama_model* model, ggml_type type_k, ggml_type type_v, bool flash_attn) {
+    for (Tree& tree : trees) {
+        if (tree.model == model && tree.type_k == type_k && tree.type_v == type_v && tree.flash_attn == flash_attn) {
+            return &tree;
+        }
+    }
+    return nullptr;
+}
+
+void collect_snapshots(Node* node, std::vector<Node*>& nodes) {
+    if (node->snapshot) {
+        nodes.push_back(node);
+    }
+    for (auto& [token, child] : node->children) {
+        collect_snapshots(child.get(), nodes);
+    }
+}
+
+// drops the snapshot of `node` and the nodes that are no longer needed without it: a
+// node without a snapshot only stays as a branching point of two or more edges
+void remove_snapshot(Node* node) {
+    n_bytes -= snapshot_bytes(*node->snapshot);
+    node->snapshot.reset();
+    while (node->parent && !node->snapshot && node->children.empty()) {
+        Node* parent = node->parent;
+        parent->children.erase(node->edge[0]);
+        node = parent;
+    }
+    if (node->parent && !node->snapshot && node->children.size() == 1) {
+        // the edges on either side of the node become one
+        std::unique_ptr<Node> child = std::move(node->children.begin()->second);
+        node->edge.insert(node->edge.end(), child->edge.begin(), child->edge.end());
+        node->children = std::move(child->children);
+        for (auto& [token, grandchild] : node->children) {
+            grandchild->parent = node;
+        }
+        node->snapshot = std::move(child->snapshot);
+        node->last_used = child->last_used;
+    }
+}
+
+// evicts the least recently used snapshots other than `keep` until they fit the budget
+void evict_to_budget(const PrefixSnapshot* keep) {
+    while (n_bytes > byte_budget) {
+        std::vector<Node*> nodes;
+        for (Tree& tree : trees) {
+            collect_snapshots(tree.root.get(), nodes);
+        }
+        Node* victim = nullptr;
+        for (Node* node : nodes) {
+            if (node->snapshot.get() != keep && (!victim || node->last_used < victim->last_used)) {
+                victim = node;
+            }
+        }
+        if (!victim) {
+            break;
+        }
+        LOGi("Dropping the prefix snapshot of %zu tokens (%zu bytes)", victim->snapshot->tokens.size(),
+             victim->snapshot->state.size());
+        remove_snapshot(victim);
+    }
+    trees.erase(std::remove_if(trees.begin(), trees.end(), [](const Tree& tree) {
+        return tree.root->children.empty() && !tree.root->snapshot;
+    }), trees.end());
+}
+
+}
+
+void PrefixCache::put(const llama_model* model, ggml_type type_k, ggml_type type_v, bool flash_attn,
+                      std::vector<llama_token> tokens, std::vector<uint8_t> state) {
+    if (tokens.empty()) {
+        return;
+    }
+    auto snapshot = std::make_shared<PrefixSnapshot>();
+    snapshot->tokens = std::move(tokens);
+    snapshot->state = std::move(state);
+    const size_t size = snapshot_bytes(*snapshot);
+
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    if (size > byte_budget) {
+        LOGi("Not keeping a snapshot of %zu prefix tokens: %zu bytes exceed the budget of %zu",
+             snapshot->tokens.size(), size, byte_budget);
+        return;
+    }
+    Tree* tree = find_tree(model, type_k, type_v, flash_attn);
+    if (!tree) {
+        trees.push_back({model, type_k, type_v, flash_attn, std::make_unique<Node>()});
+        tree = &trees.back();
+    }
+
+    const std::vector<llama_token>& path = snapshot->tokens;
+    Node* node = tree->root.get();
+    size_t depth = 0;
+    while (depth < path.size()) {
+        auto it = node->children.find(path[depth]);
+        if (it == node->children.end()) {
+            auto leaf = std::make_unique<Node>();
+            leaf->edge.assign(path.begin() + (long) depth, path.end());
+            leaf->parent = node;
+            node = node->children.emplace(path[depth], std::move(leaf)).first->second.get();
+            break;
+        }
+        Node* child = it->second.get();
+        size_t n = 1;
+        while (n < child->edge.size() && depth + n < path.size() && child->edge[n] == path[depth + n]) {
+            n++;
+        }
+        if (n < child->edge.size()) {
+            // the tokens leave the edge half way: split it there
+            auto middle = std::make_unique<Node>();
+            middle->edge.assign(child->edge.begin(), child->edge.begin() + (long) n);
+            middle->parent = node;
+            child->edge.erase(child->edge.begin(), child->edge.begin() + (long) n);
+            child->parent = middle.get();
+            middle->children.emplace(child->edge[0], std::move(it->second));
+            it->second = std::move(middle);
+            child = it->second.get();
+        }
+        node = child;
+        depth += n;
+    }
+
+    if (node->snapshot) {
+        n_bytes -= snapshot_bytes(*node->snapshot);
+    }
+    LOGi("Saved a snapshot of %zu prefix tokens (%zu bytes)", snapshot->tokens.size(), snapshot->state.size());
+    node->snapshot = snapshot;
+    node->last_used = ++use_counter;
+    n_bytes += size;
+    evict_to_budget(snapshot.get());
+}
+
+std::shared_ptr<const PrefixSnapshot> PrefixCache::find(const llama_model* model, ggml_type type_k, ggml_type type_v,
+                                                        bool flash_attn, const std::vector<llama_token>& prompt,
+                                                        size_t min_tokens, size_t max_tokens) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    Tree* tree = find_tree(model, type_k, type_v, flash_attn);
+    if (!tree) {
+        return nullptr;
+    }
+
+    const size_t n_max = std::min(prompt.size(), max_tokens);
+    Node* node = tree->root.get();
+    Node* best = nullptr;
+    size_t depth = 0;
+    while (depth < n_max) {
+        auto it = node->children.find(prompt[depth]);
+        if (it == node->children.end()) {
+            break;
+        }
+        node = it->second.get();
+        if (depth + node->edge.size() > n_max ||
+            !std::equal(node->edge.begin(), node->edge.end(), prompt.begin() + (long) depth)) {
+            break;
+        }
+        depth += node->edge.size();
+        if (node->snapshot && depth > min_tokens) {
+            best = node;
+        }
+    }
+    if (!best) {
+        return nullptr;
+    }
+    best->last_used = ++use_counter;
+    return best->snapshot;
+}
+
+void PrefixCache::forget_model(const llama_model* model) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    for (Tree& tree : trees) {
+        if (tree.model != model) {
+            continue;
+        }
+        std::vector<Node*> nodes;
+        collect_snapshots(tree.root.get(), nodes);
+        for (Node* node : nodes) {
+            n_bytes -= snapshot_bytes(*node->snapshot);
+        }
+    }
+    trees.erase(std::remove_if(trees.begin(), trees.end(), [model](const Tree& tree) { return tree.model == model; }),
+                trees.end());
+}
+
+size_t PrefixCache::clear() {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    const size_t n_freed = n_bytes;
+    trees.clear();
+    n_bytes = 0;
+    return n_freed;
+}
+
+void PrefixCache::set_byte_budget(size_t n_max_bytes) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    byte_budget = n_max_bytes;
+    evict_to_budget(nullptr);
+}
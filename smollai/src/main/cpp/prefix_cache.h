@@ -0,0 +1,51 @@
+#pragma once
+
+#include "llama.h"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// KV cache state of a token prefix (a system prompt) saved with llama_state_seq_get_data()
+struct PrefixSnapshot {
+    std::vector<llama_token> tokens;
+    std::vector<uint8_t> state;
+};
+
+// Process-wide store of prefix snapshots, so that a new chat with a system prompt that
+// was decoded before - by a chat in another context, or one closed since - copies its
+// KV cells instead of decoding it again. Snapshots only restore into contexts on the
+// same model with the same KV cache layout.
+//
+// The snapshots of each layout hang off a radix tree of their tokens: prompts built from
+// the same template share their leading edges, and the longest snapshot a prompt starts
+// with is found in one walk down the tree, however many are stored. The least recently
+// used snapshots are dropped once their states take more than the byte budget.
+class PrefixCache {
+
+    public:
+
+    static const size_t default_byte_budget = 64 * 1024 * 1024;
+
+    // Stores the state of `tokens`, replacing a snapshot of the same tokens. A state larger
+    // than the whole budget is not stored.
+    static void put(const llama_model* model, ggml_type type_k, ggml_type type_v, bool flash_attn,
+                    std::vector<llama_token> tokens, std::vector<uint8_t> state);
+
+    // Returns the longest snapshot of more than `min_tokens` and at most `max_tokens`
+    // tokens that `prompt` starts with, nullptr if there is none
+    static std::shared_ptr<const PrefixSnapshot> find(const llama_model* model, ggml_type type_k, ggml_type type_v,
+                                                      bool flash_attn, const std::vector<llama_token>& prompt,
+                                                      size_t min_tokens, size_t max_tokens);
+
+    // Drops the snapshots of a model that is being freed
+    static void forget_model(const llama_model* model);
+
+    // Drops every snapshot and returns the bytes of state they held; chats holding on to a
+    // snapshot they are restoring keep it until they are done
+    static size_t clear();
+
+    // Sets the most bytes of state kept, evicting snapshots beyond it right away
+    static void set_byte_budget(size_t n_max_bytes);
+
+};
@@ -0,0 +1,741 @@
+#include "shared_context.h"
+#include "logging.h"
+#include "prefix_cache.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <stdexcept>
+
+namespace {
+
+std::mutex registry_mutex;
+std::vector<std::weak_ptr<SharedContext>> contexts;
+
+bool same_params(const SharedContextParams& a, const SharedContextParams& b) {
+    const bool same_size = a.n_ctx_max > 0 ? b.n_ctx_max > 0 : a.n_ctx == b.n_ctx && b.n_ctx_max == 0;
+    return same_size && a.n_batch == b.n_batch && a.n_ubatch == b.n_ubatch &&
+           a.n_seq_max == b.n_seq_max &&
+           a.type_k == b.type_k && a.type_v == b.type_v && a.flash_attn == b.flash_attn &&
+           a.threading.n_threads == b.threading.n_threads &&
+           a.threading.n_threads_batch == b.threading.n_threads_batch &&
+           a.threading.cpu_mask == b.threading.cpu_mask &&
+           a.threading.priority == b.threading.priority &&
+           a.threading.poll == b.threading.poll &&
+           a.threading.adaptive_threads == b.threading.adaptive_threads &&
+           a.threading.target_tokens_per_sec == b.threading.target_tokens_per_sec;
+}
+
+size_t common_prefix(const std::vector<llama_token>& a, const std::vector<llama_token>& b) {
+    size_t n = 0;
+    while (n < a.size() && n < b.size() && a[n] == b[n]) {
+        n++;
+    }
+    return n;
+}
+
+}
+
+SharedContext::SharedContext(llama_model* model, const SharedContextParams& params)
+        : model(model), params(params) {
+    this->params.n_ctx_max = params.n_ctx_max > 0 ? std::max(params.n_ctx_max, params.n_ctx) : 0;
+
+    scheduler.configure(params.threading);
+    try {
+        threadpools.create(params.threading);
+    } catch (const std::exception& e) {
+        // the context still works with its internal threadpool, just without pinning
+        LOGe("Failed to set up threadpools, using defaults: %s", e.what());
+        threadpools.release();
+    }
+
+    if (!create_context()) {
+        threadpools.release();
+        LOGe("llama_init_from_model() returned null");
+        throw std::runtime_error("llama_init_from_model() returned null");
+    }
+
+    batch = llama_batch_init((int32_t) llama_n_batch(ctx), 0, 1);
+    seq_tokens.resize(params.n_seq_max);
+    seq_in_use.resize(params.n_seq_max, false);
+    seq_busy.resize(params.n_seq_max, false);
+    seq_last_used.resize(params.n_seq_max, 0);
+    spill_files.resize(params.n_seq_max);
+
+    decode_thread = std::thread(&SharedContext::decode_loop, this);
+}
+
+bool SharedContext::create_context() {
+    llama_context_params ctx_params = llama_context_default_params();
+    ctx_params.n_ctx = params.n_ctx;
+    ctx_params.n_batch = params.n_batch;
+    ctx_params.n_ubatch = params.n_ubatch;
+    // the KV cache is unified: all sequences draw cells from the same n_ctx pool
+    ctx_params.n_seq_max = params.n_seq_max;
+    // recreated by grow(): keep the thread count the scheduler settled on
+    ctx_params.n_threads = scheduler.threads();
+    ctx_params.n_threads_batch = params.threading.n_threads_batch;
+    ctx_params.no_perf = true;          // disable performance metrics
+    // a quantized cache halves (q8_0) or quarters (q4_0) the KV memory and the bytes
+    // read per generated token; values can only be quantized with flash attention
+    ctx_params.type_k = params.type_k;
+    ctx_params.type_v = params.type_v;
+    ctx_params.flash_attn = params.flash_attn;
+
+    LOGi("Creating context with size: %u, n_batch: %u, n_ubatch: %u, sequences: %u, KV cache: %s/%s, flash attention: %s",
+         ctx_params.n_ctx, ctx_params.n_batch, ctx_params.n_ubatch, ctx_params.n_seq_max,
+         ggml_type_name(ctx_params.type_k), ggml_type_name(ctx_params.type_v), ctx_params.flash_attn ? "on" : "off");
+
+    ctx = llama_init_from_model(model, ctx_params);
+    if (!ctx) {
+        return false;
+    }
+
+    // without threadpools (released after a failure) the context uses its own
+    threadpools.attach(ctx);
+    llama_set_abort_callback(ctx, abort_callback, this);
+    return true;
+}
+
+bool SharedContext::suspend(const std::string& spill_dir) {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    if (!ctx) {
+        return true;
+    }
+    if (std::any_of(seq_busy.begin(), seq_busy.end(), [](bool busy) { return busy; })) {
+        return false;
+    }
+
+    size_t n_bytes = 0;
+    for (size_t s = 0; s < seq_tokens.size(); s++) {
+        if (seq_tokens[s].empty()) {
+            continue;
+        }
+        char name[64];
+        snprintf(name, sizeof(name), "/smollai-spill-%p-%zu.bin", (void*) this, s);
+        const std::string path = spill_dir + name;
+        const size_t n_written = llama_state_seq_save_file(ctx, path.c_str(), (llama_seq_id) s,
+                                                           seq_tokens[s].data(), seq_tokens[s].size());
+        if (n_written == 0) {
+            LOGe("Failed to spill %zu tokens of sequence %zu to %s, dropping them", seq_tokens[s].size(), s, path.c_str());
+            std::remove(path.c_str());
+            seq_tokens[s].clear();
+            continue;
+        }
+        spill_files[s] = path;
+        n_bytes += n_written;
+    }
+
+    // the threadpools and the batch are small and stay; the KV buffer and the compute
+    // buffers are what is worth freeing
+    llama_free(ctx);
+    ctx = nullptr;
+    LOGi("Context suspended, %zu bytes of KV cache spilled to %s", n_bytes, spill_dir.c_str());
+    return true;
+}
+
+bool SharedContext::ensure_context() {
+    if (ctx) {
+        return true;
+    }
+    const int64_t t_start_us = ggml_time_us();
+    if (!create_context()) {
+        LOGe("Failed to create the context again after it was suspended");
+        return false;
+    }
+
+    llama_memory_t mem = llama_get_memory(ctx);
+    for (size_t s = 0; s < seq_tokens.size(); s++) {
+        if (spill_files[s].empty()) {
+            continue;
+        }
+        const auto seq_id = (llama_seq_id) s;
+        std::vector<llama_token> tokens(seq_tokens[s].size());
+        size_t n_tokens = 0;
+        if (llama_state_seq_load_file(ctx, spill_files[s].c_str(), seq_id, tokens.data(), tokens.size(), &n_tokens) == 0 ||
+            n_tokens != tokens.size() || tokens != seq_tokens[s] ||
+            llama_memory_seq_pos_max(mem, seq_id) + 1 != (llama_pos) n_tokens) {
+            LOGe("Could not restore %zu spilled tokens of sequence %d, dropping them", seq_tokens[s].size(), seq_id);
+            llama_memory_seq_rm(mem, seq_id, -1, -1);
+            seq_tokens[s].clear();
+        }
+        std::remove(spill_files[s].c_str());
+        spill_files[s].clear();
+    }
+
+    LOGi("Context resumed in %.2f ms", (double) (ggml_time_us() - t_start_us) / 1e3);
+    return true;
+}
+
+bool SharedContext::resume() {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    return ensure_context();
+}
+
+int SharedContext::suspend_all(const std::string& spill_dir) {
+    std::vector<std::shared_ptr<SharedContext>> live;
+    {
+        std::lock_guard<std::mutex> registry_lock(registry_mutex);
+        for (const auto& weak : contexts) {
+            if (auto shared = weak.lock()) {
+                live.push_back(std::move(shared));
+            }
+        }
+    }
+    int n_suspended = 0;
+    for (const auto& shared : live) {
+        n_suspended += shared->suspend(spill_dir) ? 1 : 0;
+    }
+    return n_suspended;
+}
+
+int SharedContext::n_threads() {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    return scheduler.threads();
+}
+
+SharedContext::~SharedContext() {
+    {
+        std::lock_guard<std::mutex> lock(queue_mutex);
+        stopping = true;
+    }
+    queue_cv.notify_all();
+    if (decode_thread.joinable()) {
+        decode_thread.join();
+    }
+
+    llama_batch_free(batch);
+    llama_free(ctx);
+    ctx = nullptr;
+    for (const std::string& path : spill_files) {
+        if (!path.empty()) {
+            std::remove(path.c_str());
+        }
+    }
+    // the threadpools may only go away once no context uses them
+    threadpools.release();
+    LOGi("Context freed");
+}
+
+std::shared_ptr<SharedContext> SharedContext::acquire(llama_model* model, const SharedContextParams& params,
+                                                      llama_seq_id& seq_id) {
+    std::lock_guard<std::mutex> registry_lock(registry_mutex);
+
+    contexts.erase(std::remove_if(contexts.begin(), contexts.end(),
+                                  [](const std::weak_ptr<SharedContext>& c) { return c.expired(); }),
+                   contexts.end());
+
+    for (const auto& weak : contexts) {
+        std::shared_ptr<SharedContext> shared = weak.lock();
+        if (!shared || shared->model != model || !same_params(shared->params, params)) {
+            continue;
+        }
+        std::lock_guard<std::mutex> lock(shared->ctx_mutex);
+        for (size_t s = 0; s < shared->seq_in_use.size(); s++) {
+            if (!shared->seq_in_use[s]) {
+                shared->seq_in_use[s] = true;
+                shared->seq_last_used[s] = ++shared->use_counter;
+                seq_id = (llama_seq_id) s;
+                LOGi("Sharing context, using sequence %d", seq_id);
+                return shared;
+            }
+        }
+    }
+
+    auto shared = std::make_shared<SharedContext>(model, params);
+    shared->seq_in_use[0] = true;
+    seq_id = 0;
+    contexts.push_back(shared);
+    return shared;
+}
+
+void SharedContext::release_seq(llama_seq_id seq_id) {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    if (ctx) {
+        llama_memory_seq_rm(llama_get_memory(ctx), seq_id, -1, -1);
+    } else if (!spill_files[seq_id].empty()) {
+        std::remove(spill_files[seq_id].c_str());
+        spill_files[seq_id].clear();
+    }
+    seq_tokens[seq_id].clear();
+    seq_in_use[seq_id] = false;
+    seq_busy[seq_id] = false;
+}
+
+uint32_t SharedContext::n_ctx() {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    return params.n_ctx;
+}
+
+bool SharedContext::grow(uint32_t n_ctx_min) {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    const uint32_t n_ctx_old = params.n_ctx;
+    if (n_ctx_min <= n_ctx_old || n_ctx_old >= params.n_ctx_max) {
+        return n_ctx_min <= n_ctx_old;
+    }
+    if (!ensure_context()) {
+        return false;
+    }
+    // doubling keeps the number of (slow) recreations logarithmic in the conversation length
+    const uint32_t n_ctx_new = std::min(params.n_ctx_max, std::max((n_ctx_min + 255) / 256 * 256, n_ctx_old * 2));
+    const int64_t t_start_us = ggml_time_us();
+
+    // copy the caches out first: the old and the new KV buffer would not fit at once
+    std::vector<std::vector<uint8_t>> states(seq_tokens.size());
+    for (size_t s = 0; s < seq_tokens.size(); s++) {
+        if (seq_tokens[s].empty()) {
+            continue;
+        }
+        states[s].resize(llama_state_seq_get_size(ctx, (llama_seq_id) s));
+        if (llama_state_seq_get_data(ctx, states[s].data(), states[s].size(), (llama_seq_id) s) != states[s].size()) {
+            LOGe("Failed to save the state of sequence %zu, dropping it", s);
+            states[s].clear();
+        }
+    }
+
+    llama_free(ctx);
+    params.n_ctx = n_ctx_new;
+    if (!create_context()) {
+        LOGe("Failed to create a context of %u tokens, keeping %u", n_ctx_new, n_ctx_old);
+        params.n_ctx = n_ctx_old;
+        if (!create_context()) {
+            throw std::runtime_error("grow() failed: the context cannot be recreated");
+        }
+    }
+
+    // busy sequences first, then the most recently used ones, in case not all fit anymore
+    std::vector<size_t> order;
+    for (size_t s = 0; s < seq_tokens.size(); s++) {
+        order.push_back(s);
+    }
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        return seq_busy[a] != seq_busy[b] ? (bool) seq_busy[a] : seq_last_used[a] > seq_last_used[b];
+    });
+
+    llama_memory_t mem = llama_get_memory(ctx);
+    for (size_t s : order) {
+        const auto seq_id = (llama_seq_id) s;
+        if (seq_tokens[s].empty()) {
+            continue;
+        }
+        if (states[s].empty() ||
+            llama_state_seq_set_data(ctx, states[s].data(), states[s].size(), seq_id) != states[s].size() ||
+            llama_memory_seq_pos_max(mem, seq_id) + 1 != (llama_pos) seq_tokens[s].size()) {
+            LOGe("Could not restore %zu tokens of sequence %d, dropping them", seq_tokens[s].size(), seq_id);
+            llama_memory_seq_rm(mem, seq_id, -1, -1);
+            seq_tokens[s].clear();
+        }
+    }
+
+    LOGi("Context resized from %u to %u tokens in %.2f ms", n_ctx_old, params.n_ctx,
+         (double) (ggml_time_us() - t_start_us) / 1e3);
+    return n_ctx_min <= params.n_ctx;
+}
+
+void SharedContext::limit_growth(uint32_t n_ctx_max) {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    if (params.n_ctx_max > 0 && n_ctx_max < params.n_ctx_max) {
+        params.n_ctx_max = std::max(params.n_ctx, n_ctx_max);
+        LOGi("Context limited to %u tokens", params.n_ctx_max);
+    }
+}
+
+size_t SharedContext::n_tokens(llama_seq_id seq_id) {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    return seq_tokens[seq_id].size();
+}
+
+std::vector<llama_token> SharedContext::tokens(llama_seq_id seq_id) {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    return seq_tokens[seq_id];
+}
+
+void SharedContext::set_busy(llama_seq_id seq_id, bool busy) {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    seq_busy[seq_id] = busy;
+}
+
+size_t SharedContext::reuse_prefix(llama_seq_id seq_id, const std::vector<llama_token>& prompt, bool keep_last) {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    if (!ensure_context()) {
+        seq_tokens[seq_id].clear();
+        return 0;
+    }
+    llama_memory_t mem = llama_get_memory(ctx);
+    // at least one token has to be decoded to produce logits for sampling
+    const size_t n_max = prompt.empty() || !keep_last ? prompt.size() : prompt.size() - 1;
+
+    size_t n_past = std::min(common_prefix(seq_tokens[seq_id], prompt), n_max);
+
+    // another chat may have the same system prompt (and more) cached already
+    llama_seq_id source = -1;
+    size_t n_source = n_past;
+    for (size_t s = 0; s < seq_tokens.size(); s++) {
+        if ((llama_seq_id) s == seq_id) {
+            continue;
+        }
+        size_t n = std::min(common_prefix(seq_tokens[s], prompt), n_max);
+        if (n > n_source) {
+            source = (llama_seq_id) s;
+            n_source = n;
+        }
+    }
+
+    // a snapshot is copied into cells of its own, only worth it for a longer prefix
+    auto snapshot = PrefixCache::find(model, params.type_k, params.type_v, params.flash_attn, prompt, n_source, n_max);
+    if (snapshot) {
+        llama_memory_seq_rm(mem, seq_id, -1, -1);
+        seq_tokens[seq_id].clear();
+        n_past = 0;
+        if (llama_state_seq_set_data(ctx, snapshot->state.data(), snapshot->state.size(), seq_id) ==
+                snapshot->state.size() &&
+            llama_memory_seq_pos_max(mem, seq_id) + 1 == (llama_pos) snapshot->tokens.size()) {
+            LOGi("Sequence %d restored %zu prompt tokens from a prefix snapshot", seq_id, snapshot->tokens.size());
+            seq_tokens[seq_id] = snapshot->tokens;
+            n_past = snapshot->tokens.size();
+            source = -1;
+        } else {
+            LOGe("Failed to restore a prefix snapshot of %zu tokens", snapshot->tokens.size());
+            llama_memory_seq_rm(mem, seq_id, -1, -1);
+        }
+    }
+
+    if (source >= 0) {
+        // the copy only tags the source cells with this sequence id, nothing is recomputed
+        llama_memory_seq_rm(mem, seq_id, -1, -1);
+        llama_memory_seq_cp(mem, source, seq_id, 0, (llama_pos) n_source);
+        seq_tokens[seq_id].assign(prompt.begin(), prompt.begin() + (long) n_source);
+        LOGi("Sequence %d shares %zu prompt tokens with sequence %d", seq_id, n_source, source);
+        n_past = n_source;
+    } else if (!llama_memory_seq_rm(mem, seq_id, (llama_pos) n_past, -1)) {
+        // partial removal is not supported by every memory type (e.g. recurrent models)
+        LOGi("Partial KV cache removal failed, clearing sequence");
+        llama_memory_seq_rm(mem, seq_id, -1, -1);
+        n_past = 0;
+    }
+
+    seq_tokens[seq_id].resize(n_past);
+    seq_last_used[seq_id] = ++use_counter;
+    return n_past;
+}
+
+bool SharedContext::snapshot_prefix(llama_seq_id seq_id) {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    if (seq_tokens[seq_id].empty() || !ensure_context()) {
+        return false;
+    }
+    std::vector<uint8_t> state(llama_state_seq_get_size(ctx, seq_id));
+    if (llama_state_seq_get_data(ctx, state.data(), state.size(), seq_id) != state.size()) {
+        LOGe("Failed to read the state of sequence %d", seq_id);
+        return false;
+    }
+    PrefixCache::put(model, params.type_k, params.type_v, params.flash_attn, seq_tokens[seq_id], std::move(state));
+    return true;
+}
+
+bool SharedContext::shift_tokens(llama_seq_id seq_id, size_t n_keep, size_t n_discard) {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    std::vector<llama_token>& cached = seq_tokens[seq_id];
+    if (n_discard == 0 || n_keep + n_discard > cached.size() || !ensure_context()) {
+        return false;
+    }
+
+    llama_memory_t mem = llama_get_memory(ctx);
+    if (!llama_memory_can_shift(mem)) {
+        return false;
+    }
+    // a cell copied with llama_memory_seq_cp() has one position for every sequence
+    // holding it; shared cells are always part of a common token prefix
+    for (size_t s = 0; s < seq_tokens.size(); s++) {
+        if ((llama_seq_id) s != seq_id && common_prefix(seq_tokens[s], cached) > n_keep) {
+            return false;
+        }
+    }
+
+    const auto p_keep = (llama_pos) n_keep;
+    const auto p_discard = (llama_pos) n_discard;
+    if (!llama_memory_seq_rm(mem, seq_id, p_keep, p_keep + p_discard)) {
+        return false;
+    }
+    llama_memory_seq_add(mem, seq_id, p_keep + p_discard, -1, -p_discard);
+    cached.erase(cached.begin() + (long) n_keep, cached.begin() + (long) (n_keep + n_discard));
+    return true;
+}
+
+bool SharedContext::truncate(llama_seq_id seq_id, size_t n_tokens) {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    std::vector<llama_token>& cached = seq_tokens[seq_id];
+    if (n_tokens >= cached.size()) {
+        return true;
+    }
+    if (!ensure_context()) {
+        return false;
+    }
+    if (!llama_memory_seq_rm(llama_get_memory(ctx), seq_id, (llama_pos) n_tokens, -1)) {
+        return false;
+    }
+    cached.resize(n_tokens);
+    return true;
+}
+
+bool SharedContext::load_seq_file(llama_seq_id seq_id, const std::string& path) {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    if (!ensure_context()) {
+        return false;
+    }
+    llama_memory_t mem = llama_get_memory(ctx);
+    llama_memory_seq_rm(mem, seq_id, -1, -1);
+    seq_tokens[seq_id].clear();
+
+    std::vector<llama_token> tokens(llama_n_ctx(ctx));
+    size_t n_tokens = 0;
+    if (llama_state_seq_load_file(ctx, path.c_str(), seq_id, tokens.data(), tokens.size(), &n_tokens) == 0) {
+        llama_memory_seq_rm(mem, seq_id, -1, -1);
+        return false;
+    }
+    tokens.resize(n_tokens);
+
+    // the cache has to hold exactly the saved tokens at positions 0..n-1
+    const int n_vocab = llama_vocab_n_tokens(llama_model_get_vocab(model));
+    bool valid = n_tokens > 0 && llama_memory_seq_pos_min(mem, seq_id) <= 0 &&
+                 llama_memory_seq_pos_max(mem, seq_id) + 1 == (llama_pos) n_tokens;
+    for (size_t i = 0; valid && i < n_tokens; i++) {
+        valid = tokens[i] >= 0 && tokens[i] < n_vocab;
+    }
+    if (!valid) {
+        LOGe("Discarding saved state in %s: token list does not match the cache", path.c_str());
+        llama_memory_seq_rm(mem, seq_id, -1, -1);
+        return false;
+    }
+
+    seq_tokens[seq_id] = std::move(tokens);
+    seq_last_used[seq_id] = ++use_counter;
+    return true;
+}
+
+size_t SharedContext::save_seq_file(llama_seq_id seq_id, const std::string& path) {
+    std::lock_guard<std::mutex> lock(ctx_mutex);
+    const std::vector<llama_token>& tokens = seq_tokens[seq_id];
+    if (tokens.empty() || !ensure_context()) {
+        return 0;
+    }
+    return llama_state_seq_save_file(ctx, path.c_str(), seq_id, tokens.data(), tokens.size());
+}
+
+int SharedContext::decode(llama_seq_id seq_id, const llama_token* tokens, int n_tokens, const LogitsCallback& on_logits,
+                          int n_logits) {
+    if (n_tokens <= 0) {
+        return 0;
+    }
+
+    DecodeRequest request{seq_id, tokens, n_tokens, 0, on_logits ? &on_logits : nullptr,
+                          std::max(1, std::min(n_logits, n_tokens)), 0, false, false, false};
+
+    std::unique_lock<std::mutex> lock(queue_mutex);
+    queue.push_back(&request);
+    queue_cv.notify_one();
+    done_cv.wait(lock, [&] { return request.done; });
+    return request.result;
+}
+
+void SharedContext::cancel(llama_seq_id seq_id) {
+    std::lock_guard<std::mutex> lock(queue_mutex);
+    for (DecodeRequest* request : queue) {
+        if (request->seq_id != seq_id || request->done) {
+            continue;
+        }
+        request->cancelled = true;
+        if (request->in_round) {
+            abort_round = true;
+        }
+    }
+}
+
+bool SharedContext::abort_callback(void* data) {
+    return static_cast<SharedContext*>(data)->abort_round.load(std::memory_order_relaxed);
+}
+
+void SharedContext::decode_loop() {
+    std::vector<DecodeRequest*> requests;
+    auto finish_cancelled = [this]() {
+        bool finished = false;
+        for (DecodeRequest* request : queue) {
+            if (request->cancelled && !request->done) {
+                request->result = 2;
+                request->done = true;
+                finished = true;
+            }
+        }
+        queue.erase(std::remove_if(queue.begin(), queue.end(), [](const DecodeRequest* r) { return r->done; }),
+                    queue.end());
+        return finished;
+    };
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [&] { return stopping || !queue.empty(); });
+            if (finish_cancelled()) {
+                done_cv.notify_all();
+            }
+            if (queue.empty()) {
+                if (stopping) {
+                    return;
+                }
+                continue;
+            }
+            requests.assign(queue.begin(), queue.end());
+            for (DecodeRequest* request : requests) {
+                request->in_round = true;
+            }
+        }
+
+        // rounds that only generate tokens tell the scheduler how fast decoding is; a
+        // prompt being processed or a round that is aborted would skew that
+        const bool generating = std::all_of(requests.begin(), requests.end(), [](const DecodeRequest* r) {
+            return r->on_logits && r->n_logits == r->n_tokens;
+        });
+        int64_t t_pacing_us = 0;
+        {
+            std::lock_guard<std::mutex> lock(ctx_mutex);
+            const int64_t t_start_us = ggml_time_us();
+            if (decode_round(requests) == 0 && generating) {
+                const int64_t t_round_us = ggml_time_us() - t_start_us;
+                scheduler.on_round(t_round_us, (int) requests.size(), n_round_generated);
+                t_pacing_us = scheduler.pacing_delay_us(t_round_us, n_round_generated_max);
+                if (scheduler.threads() != (int) llama_n_threads(ctx)) {
+                    llama_set_n_threads(ctx, scheduler.threads(), (int32_t) llama_n_threads_batch(ctx));
+                }
+            }
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            for (DecodeRequest* request : requests) {
+                request->in_round = false;
+            }
+            abort_round = false;
+            finish_cancelled();
+        }
+        done_cv.notify_all();
+
+        if (t_pacing_us > 0) {
+            std::this_thread::sleep_for(std::chrono::microseconds(t_pacing_us));
+        }
+    }
+}
+
+int SharedContext::decode_round(std::vector<DecodeRequest*>& requests) {
+    if (!ensure_context()) {
+        for (DecodeRequest* request : requests) {
+            request->result = -1;
+            request->done = true;
+        }
+        return -1;
+    }
+
+    // single generated tokens go first so that a long prefill does not stall other chats
+    std::stable_sort(requests.begin(), requests.end(), [](const DecodeRequest* a, const DecodeRequest* b) {
+        return a->n_tokens - a->n_done < b->n_tokens - b->n_done;
+    });
+
+    struct Part {
+        DecodeRequest* request;
+        int n_tokens;
+        int32_t logits_begin;           // batch index of the first token with logits
+        int n_logits;
+    };
+    std::vector<Part> parts;
+
+    const int n_batch = (int) llama_n_batch(ctx);
+    batch.n_tokens = 0;
+    for (DecodeRequest* request : requests) {
+        const int n_eval = std::min(n_batch - batch.n_tokens, request->n_tokens - request->n_done);
+        if (n_eval <= 0) {
+            break;
+        }
+        const llama_pos pos = (llama_pos) seq_tokens[request->seq_id].size();
+        // the trailing tokens with logits may be split over two rounds as well
+        const int first_logits = request->on_logits ? request->n_tokens - request->n_logits : request->n_tokens;
+        Part part{request, n_eval, -1, 0};
+        for (int i = 0; i < n_eval; i++) {
+            const int32_t idx = batch.n_tokens++;
+            const bool logits = request->n_done + i >= first_logits;
+            batch.token[idx] = request->tokens[request->n_done + i];
+            batch.pos[idx] = pos + i;
+            batch.n_seq_id[idx] = 1;
+            batch.seq_id[idx][0] = request->seq_id;
+            batch.logits[idx] = logits;
+            if (logits && part.n_logits++ == 0) {
+                part.logits_begin = idx;
+            }
+        }
+        parts.push_back(part);
+    }
+
+    int decode_result = llama_decode(ctx, batch);
+    // out of KV cells: make room by dropping chats that are not generating right now
+    while (decode_result == 1 && evict_idle_sequence(requests)) {
+        decode_result = llama_decode(ctx, batch);
+    }
+
+    n_round_generated = 0;
+    n_round_generated_max = 0;
+    llama_memory_t mem = llama_get_memory(ctx);
+    for (const Part& part : parts) {
+        DecodeRequest* request = part.request;
+        std::vector<llama_token>& cached = seq_tokens[request->seq_id];
+
+        if (decode_result != 0) {
+            // drop whatever part of the batch made it into the KV cache
+            llama_memory_seq_rm(mem, request->seq_id, (llama_pos) cached.size(), -1);
+            if (decode_result != 2) {
+                request->result = decode_result;
+                request->done = true;
+            }
+            continue;
+        }
+
+        const llama_token* begin = request->tokens + request->n_done;
+        cached.insert(cached.end(), begin, begin + part.n_tokens);
+        request->n_done += part.n_tokens;
+        seq_last_used[request->seq_id] = ++use_counter;
+
+        int n_generated = 0;
+        for (int i = 0; i < part.n_logits; i++) {
+            n_generated += (*request->on_logits)(part.logits_begin + i) ? 1 : 0;
+        }
+        n_round_generated += n_generated;
+        n_round_generated_max = std::max(n_round_generated_max, n_generated);
+        if (request->n_done == request->n_tokens) {
+            request->done = true;
+        }
+    }
+
+    if (decode_result == 2) {
+        LOGi("llama_decode() aborted, %d tokens of %zu sequences", batch.n_tokens, parts.size());
+    } else if (decode_result != 0) {
+        LOGe("llama_decode() failed with code: %d (%d tokens, %zu sequences)", decode_result, batch.n_tokens, parts.size());
+    }
+    return decode_result;
+}
+
+bool SharedContext::evict_idle_sequence(const std::vector<DecodeRequest*>& requests) {
+    llama_seq_id victim = -1;
+    for (size_t s = 0; s < seq_tokens.size(); s++) {
+        auto is_queued = [&](const DecodeRequest* r) { return r->seq_id == (llama_seq_id) s; };
+        if (seq_busy[s] || seq_tokens[s].empty() || std::any_of(requests.begin(), requests.end(), is_queued)) {
+            continue;
+        }
+        if (victim < 0 || seq_last_used[s] < seq_last_used[victim]) {
+            victim = (llama_seq_id) s;
+        }
+    }
+    if (victim < 0) {
+        return false;
+    }
+
+    LOGi("KV cache full, evicting %zu tokens of idle sequence %d", seq_tokens[victim].size(), victim);
+    llama_memory_seq_rm(llama_get_memory(ctx), victim, -1, -1);
+    seq_tokens[victim].clear();
+    return true;
+}
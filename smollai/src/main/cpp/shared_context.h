@@ -0,0 +1,223 @@
+#pragma once
+
+#include "llama.h"
+#include "cpu_affinity.h"
+#include "decode_scheduler.h"
+#include "kv_cache.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Called on the decode thread, with the context locked, once for every token of a
+// decode request that outputs logits, in order; `batch_idx` is the token's index for
+// llama_get_logits_ith(). Returns true if a token was generated from the logits (false
+// for the rejected part of a speculative draft), which paces generation and tells the
+// DecodeScheduler how fast it is.
+using LogitsCallback = std::function<bool(int32_t batch_idx)>;
+
+// Parameters that have to match for two instances to share a context
+struct SharedContextParams {
+    uint32_t n_ctx = 0;
+    // grow() recreates the context up to this size, 0 = fixed at n_ctx. Growable contexts
+    // are shared whatever their current size.
+    uint32_t n_ctx_max = 0;
+    uint32_t n_batch = 0;
+    uint32_t n_ubatch = 0;
+    uint32_t n_seq_max = 1;
+    ggml_type type_k = GGML_TYPE_F16;
+    ggml_type type_v = GGML_TYPE_F16;
+    bool flash_attn = false;
+    ThreadingConfig threading;          // resolved, see resolve_threading_config()
+};
+
+// One llama_context whose KV cache is split between several chats by sequence id.
+// Every LLMInference on the same model (and context parameters) gets its own
+// sequence in it, so one set of mapped weights and one KV buffer serve all open
+// chats. Decode requests from concurrent generations are merged into a single
+// llama_batch by a decode thread, which reads the weights once per step for all of
+// them. The KV cells are shared, not split per sequence: when they run out, the
+// cache of the least recently used idle sequence is evicted.
+class SharedContext {
+
+    struct DecodeRequest {
+        llama_seq_id seq_id;
+        const llama_token* tokens;
+        int n_tokens;
+        int n_done = 0;                 // tokens already submitted in earlier rounds
+        const LogitsCallback* on_logits;
+        int n_logits = 1;               // trailing tokens that output logits
+        int result = 0;
+        bool done = false;
+        // guarded by queue_mutex
+        bool in_round = false;          // taken by the decode thread for the current round
+        bool cancelled = false;
+    };
+
+    llama_model* model;
+    llama_context* ctx = nullptr;
+    SharedContextParams params;
+    CpuThreadpools threadpools;
+    // decode thread count and pacing while generating, guarded by ctx_mutex
+    DecodeScheduler scheduler;
+    llama_batch batch;
+
+    // guards the context and the per-sequence state below
+    std::mutex ctx_mutex;
+    // tokens whose key/value pairs are held in the KV cache, per sequence
+    std::vector<std::vector<llama_token>> seq_tokens;
+    std::vector<bool> seq_in_use;
+    // sequences in the middle of a completion, never evicted
+    std::vector<bool> seq_busy;
+    std::vector<uint64_t> seq_last_used;
+    uint64_t use_counter = 0;
+    // while suspended (ctx is null): the file each sequence's cache was spilled to, empty
+    // for sequences that held no tokens
+    std::vector<std::string> spill_files;
+
+    // pending decode requests, guarded by queue_mutex
+    std::mutex queue_mutex;
+    std::condition_variable queue_cv;
+    std::condition_variable done_cv;
+    std::deque<DecodeRequest*> queue;
+    bool stopping = false;
+    std::thread decode_thread;
+    // polled by llama_decode() between graph nodes; set when a request of the round
+    // being computed is cancelled
+    std::atomic<bool> abort_round{false};
+
+    static bool abort_callback(void* data);
+
+    // creates `ctx` with params.n_ctx cells and attaches the threadpools and the abort
+    // callback; returns false if llama_init_from_model() fails
+    bool create_context();
+
+    // recreates a context freed by suspend() and loads the spilled caches back; ctx_mutex
+    // must be held. Returns false if the context cannot be created.
+    bool ensure_context();
+
+    void decode_loop();
+
+    // decodes the next batch assembled from `requests` and returns the llama_decode()
+    // result; ctx_mutex must be held. When the round is aborted, the requests that were
+    // not cancelled are left to be retried.
+    int decode_round(std::vector<DecodeRequest*>& requests);
+
+    // tokens the LogitsCallbacks of the last round generated: in total, and for the
+    // sequence that got the most
+    int n_round_generated = 0;
+    int n_round_generated_max = 0;
+
+    // evicts the least recently used sequence that is neither busy nor in `requests`;
+    // ctx_mutex must be held
+    bool evict_idle_sequence(const std::vector<DecodeRequest*>& requests);
+
+    public:
+
+    SharedContext(llama_model* model, const SharedContextParams& params);
+
+    ~SharedContext();
+
+    SharedContext(const SharedContext&) = delete;
+    SharedContext& operator=(const SharedContext&) = delete;
+
+    // Returns a context for `model` with a free sequence, creating one if every matching
+    // context is full. Throws std::runtime_error if the context cannot be created.
+    static std::shared_ptr<SharedContext> acquire(llama_model* model, const SharedContextParams& params,
+                                                  llama_seq_id& seq_id);
+
+    // Clears the KV cache of `seq_id` and makes it available to another instance
+    void release_seq(llama_seq_id seq_id);
+
+    // Saves the cache of every sequence to a file in `spill_dir` and frees the context,
+    // its KV buffer and compute buffers, keeping only the token lists. The next call that
+    // needs the context creates it again and loads the caches back, so the chats carry on
+    // without processing their prompts again. Returns false, leaving the context as it is,
+    // while a sequence is in the middle of a completion. A cache that cannot be written is
+    // dropped as if evicted.
+    bool suspend(const std::string& spill_dir);
+
+    // Creates the context again after suspend(); returns false if it cannot be allocated
+    bool resume();
+
+    // Suspends every idle context and returns the number of contexts freed
+    static int suspend_all(const std::string& spill_dir);
+
+    // The context is replaced by grow() and freed by suspend(); only use it on the decode
+    // thread (in a LogitsCallback) or, after resume(), to set up something that keeps no
+    // reference to it
+    llama_context* context() const { return ctx; }
+
+    const SharedContextParams& context_params() const { return params; }
+
+    // Decode threads currently used for generation, see DecodeScheduler
+    int n_threads();
+
+    // Current number of KV cells
+    uint32_t n_ctx();
+
+    // Recreates the context with room for at least `n_ctx_min` tokens, at least doubling
+    // it and at most params.n_ctx_max, and moves the cache of every sequence over.
+    // Returns true if the context holds `n_ctx_min` tokens now. A sequence whose state no
+    // longer fits (copied prefixes are no longer shared) is dropped as if evicted. Throws
+    // std::runtime_error if neither the new nor the old size can be allocated anymore.
+    bool grow(uint32_t n_ctx_min);
+
+    // Lowers params.n_ctx_max to `n_ctx_max` (never below the current size) when part of
+    // the memory it was fitted to is taken, e.g. by a draft model
+    void limit_growth(uint32_t n_ctx_max);
+
+    size_t n_tokens(llama_seq_id seq_id);
+
+    // Tokens currently cached for `seq_id`
+    std::vector<llama_token> tokens(llama_seq_id seq_id);
+
+    // Marks a sequence as in the middle of a completion, which keeps its cache from
+    // being evicted when another sequence runs out of KV cells
+    void set_busy(llama_seq_id seq_id, bool busy);
+
+    // Reuses as much of `prompt` as is cached, for this sequence or - through
+    // llama_memory_seq_cp() - another one sharing a longer prefix (usually the same
+    // system prompt), or restores a longer one from the PrefixCache, and evicts the rest
+    // of the sequence. With `keep_last`, at least one token is left to decode for its logits.
+    // Returns the number of reused tokens.
+    size_t reuse_prefix(llama_seq_id seq_id, const std::vector<llama_token>& prompt, bool keep_last = true);
+
+    // Saves the tokens cached for the sequence in the PrefixCache, for other chats
+    // starting with them; returns false if the state cannot be read
+    bool snapshot_prefix(llama_seq_id seq_id);
+
+    // Drops `n_discard` tokens after the first `n_keep` and shifts the rest back in place
+    // (K-shift), so nothing is recomputed. Returns false, leaving the cache unchanged, when
+    // the memory cannot shift or the tokens to shift are shared with another sequence.
+    bool shift_tokens(llama_seq_id seq_id, size_t n_keep, size_t n_discard);
+
+    // Removes every cached token of the sequence after the first `n_tokens`
+    bool truncate(llama_seq_id seq_id, size_t n_tokens);
+
+    // Replaces the cache of the sequence with a state saved by save_seq_file()
+    bool load_seq_file(llama_seq_id seq_id, const std::string& path);
+
+    // Returns the number of bytes written, 0 on failure
+    size_t save_seq_file(llama_seq_id seq_id, const std::string& path);
+
+    // Appends `n_tokens` tokens to the sequence, batched with the requests of other
+    // sequences, and calls `on_logits` for each of the last `n_logits` ones (speculative
+    // decoding verifies all drafted tokens at once). Blocks until done and returns the
+    // llama_decode() result; 1 means the KV cache is full.
+    int decode(llama_seq_id seq_id, const llama_token* tokens, int n_tokens, const LogitsCallback& on_logits,
+               int n_logits = 1);
+
+    // Makes the pending decode() calls of `seq_id` return 2 (aborted). A llama_decode()
+    // already computing one of them is interrupted after the current graph node; the
+    // other sequences in its batch are decoded again in the next round. Tokens decoded
+    // before the cancellation stay cached.
+    void cancel(llama_seq_id seq_id);
+
+};
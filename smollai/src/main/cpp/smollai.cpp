@@ -1,16 +1,54 @@
 #include "llama.h"
 #include "common.h"
+#include "embedder.h"
 #include "llm_inference.h"
+#include "memory_pressure.h"
+#include "vector_index.h"
 #include <jni.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+namespace {
+
+// Copies UTF-8 text from a Java byte array straight into the string that keeps it.
+// GetStringUTFChars() would convert to modified UTF-8 (emoji as surrogate pairs) in a
+// temporary copy first.
+std::string utf8_from_bytes(JNIEnv *env, jbyteArray bytes) {
+    std::string text(static_cast<size_t>(env->GetArrayLength(bytes)), '\0');
+    env->GetByteArrayRegion(bytes, 0, static_cast<jsize>(text.size()), reinterpret_cast<jbyte *>(&text[0]));
+    return text;
+}
+
+}
 
 extern "C" {
 
-JNIEXPORT jlong JNICALL Java_io_smollai_smollai_SmollAI_loadModel(JNIEnv *env, jobject thiz, jstring model_path, jfloat min_p, jfloat temperature, jboolean store_chats) {
+JNIEXPORT jlong JNICALL Java_io_smollai_smollai_SmollAI_loadModel(JNIEnv *env, jobject thiz, jstring model_path, jfloat min_p, jfloat temperature, jboolean store_chats, jint n_batch, jint n_ubatch,
+                                                                  jint n_threads, jint n_threads_batch, jlong cpu_mask, jint priority, jint poll, jboolean auto_affinity,
+                                                                  jint max_sequences, jboolean context_shift, jint n_ctx, jint type_k, jint type_v,
+                                                                  jboolean flash_attn, jboolean adaptive_threads, jfloat target_tokens_per_sec) {
     const char *path = env->GetStringUTFChars(model_path, nullptr);
 
+    ThreadingConfig threading;
+    threading.n_threads = n_threads;
+    threading.n_threads_batch = n_threads_batch;
+    threading.cpu_mask = static_cast<uint64_t>(cpu_mask);
+    threading.priority = priority;
+    threading.poll = poll;
+    threading.auto_affinity = auto_affinity;
+    threading.adaptive_threads = adaptive_threads;
+    threading.target_tokens_per_sec = target_tokens_per_sec;
+
+    KvCacheConfig kv_cache;
+    kv_cache.n_ctx = n_ctx > 0 ? static_cast<uint32_t>(n_ctx) : 0;
+    kv_cache.type_k = static_cast<ggml_type>(type_k);
+    kv_cache.type_v = static_cast<ggml_type>(type_v);
+    kv_cache.flash_attn = flash_attn;
+
     try {
         auto *inference = new LLMInference();
-        inference->load_model(path, min_p, temperature, store_chats);
+        inference->load_model(path, min_p, temperature, store_chats, n_batch, n_ubatch, threading, max_sequences, context_shift, kv_cache);
         env->ReleaseStringUTFChars(model_path, path);
         return reinterpret_cast<jlong>(inference);
     } catch (const std::exception &e) {
@@ -19,33 +57,183 @@ JNIEXPORT jlong JNICALL Java_io_smollai_smollai_SmollAI_loadModel(JNIEnv *env, j
     }
 }
 
-JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_addChatMessage(JNIEnv *env, jobject thiz, jlong instance_ptr, jstring message, jstring role) {
+JNIEXPORT jlongArray JNICALL Java_io_smollai_smollai_SmollAI_estimateMemory(JNIEnv *env, jobject thiz, jstring model_path, jint n_ctx, jint type_k, jint type_v) {
+    const char *path = env->GetStringUTFChars(model_path, nullptr);
+    MemoryEstimate estimate;
+    bool ok = estimate_memory(path, n_ctx > 0 ? static_cast<uint32_t>(n_ctx) : 2048, static_cast<ggml_type>(type_k),
+                              static_cast<ggml_type>(type_v), estimate);
+    env->ReleaseStringUTFChars(model_path, path);
+    if (!ok) {
+        return nullptr;
+    }
+
+    const jlong values[2] = {static_cast<jlong>(estimate.weights_bytes), static_cast<jlong>(estimate.kv_cache_bytes)};
+    jlongArray result = env->NewLongArray(2);
+    env->SetLongArrayRegion(result, 0, 2, values);
+    return result;
+}
+
+JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_trimMemory(JNIEnv *env, jobject thiz, jint level, jstring spill_dir) {
+    const char *dir = env->GetStringUTFChars(spill_dir, nullptr);
+    trim_memory(level, dir);
+    env->ReleaseStringUTFChars(spill_dir, dir);
+}
+
+JNIEXPORT jboolean JNICALL Java_io_smollai_smollai_SmollAI_loadDraftModel(JNIEnv *env, jobject thiz, jlong instance_ptr, jstring draft_model_path, jint n_draft) {
+    if (instance_ptr != 0) {
+        auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
+        const char *path = env->GetStringUTFChars(draft_model_path, nullptr);
+        bool loaded = inference->load_draft_model(path, n_draft);
+        env->ReleaseStringUTFChars(draft_model_path, path);
+        return loaded;
+    }
+    return false;
+}
+
+JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_setPromptLookup(JNIEnv *env, jobject thiz, jlong instance_ptr, jint n_draft) {
+    if (instance_ptr != 0) {
+        auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
+        inference->set_prompt_lookup(n_draft);
+    }
+}
+
+JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_setSamplingParams(JNIEnv *env, jobject thiz, jlong instance_ptr, jfloat min_p, jfloat temperature) {
+    if (instance_ptr != 0) {
+        auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
+        try {
+            inference->set_sampling_params(min_p, temperature);
+        } catch (const std::exception &e) {
+            env->ThrowNew(env->FindClass("java/lang/IllegalArgumentException"), e.what());
+        }
+    }
+}
+
+JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_setMetricsEnabled(JNIEnv *env, jobject thiz, jlong instance_ptr, jboolean enabled) {
+    if (instance_ptr != 0) {
+        auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
+        inference->set_metrics(enabled);
+    }
+}
+
+JNIEXPORT jlongArray JNICALL Java_io_smollai_smollai_SmollAI_getCompletionMetrics(JNIEnv *env, jobject thiz, jlong instance_ptr) {
+    if (instance_ptr == 0) {
+        return nullptr;
+    }
+    auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
+    const CompletionTimings &timings = inference->last_timings();
+
+    // same order as the constructor parameters of SmollAI.CompletionMetrics
+    const jlong values[] = {
+        timings.n_prompt_tokens, timings.n_reused_tokens, timings.n_prefill_tokens, timings.t_tokenize_us,
+        timings.t_prefill_us, timings.t_first_token_us, timings.n_decoded, timings.t_decode_us,
+        timings.n_sampled, timings.t_sample_us, timings.t_fastest_window_us, timings.t_last_window_us,
+        timings.n_drafted, timings.n_accepted, timings.n_kv_cells, timings.n_ctx,
+        timings.n_threads, timings.n_threads_batch
+    };
+    const jsize n_values = sizeof(values) / sizeof(values[0]);
+    jlongArray result = env->NewLongArray(n_values);
+    env->SetLongArrayRegion(result, 0, n_values, values);
+    return result;
+}
+
+JNIEXPORT jboolean JNICALL Java_io_smollai_smollai_SmollAI_setGrammar(JNIEnv *env, jobject thiz, jlong instance_ptr, jstring grammar, jboolean json_schema, jstring trigger_pattern) {
+    if (instance_ptr != 0) {
+        auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
+        const char *grammar_chars = env->GetStringUTFChars(grammar, nullptr);
+        const char *trigger_chars = env->GetStringUTFChars(trigger_pattern, nullptr);
+        bool set = inference->set_grammar(grammar_chars, json_schema, trigger_chars);
+        env->ReleaseStringUTFChars(trigger_pattern, trigger_chars);
+        env->ReleaseStringUTFChars(grammar, grammar_chars);
+        return set;
+    }
+    return false;
+}
+
+JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_addChatMessage(JNIEnv *env, jobject thiz, jlong instance_ptr, jbyteArray message, jstring role) {
     if (instance_ptr != 0) {
         auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
-        const char *msg = env->GetStringUTFChars(message, nullptr);
         const char *r = env->GetStringUTFChars(role, nullptr);
-        inference->add_chat_message(msg, r);
-        env->ReleaseStringUTFChars(message, msg);
+        inference->add_chat_message(utf8_from_bytes(env, message), r);
         env->ReleaseStringUTFChars(role, r);
     }
 }
 
-JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_startCompletion(JNIEnv *env, jobject thiz, jlong instance_ptr, jstring query) {
+JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_loadHistory(JNIEnv *env, jobject thiz, jlong instance_ptr, jobjectArray roles, jobjectArray contents, jboolean prefill) {
+    if (instance_ptr != 0) {
+        auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
+        const jsize n_messages = std::min(env->GetArrayLength(roles), env->GetArrayLength(contents));
+        std::vector<std::string> role_list(n_messages);
+        std::vector<std::string> content_list(n_messages);
+        for (jsize i = 0; i < n_messages; i++) {
+            auto role = static_cast<jstring>(env->GetObjectArrayElement(roles, i));
+            const char *r = env->GetStringUTFChars(role, nullptr);
+            role_list[i] = r;
+            env->ReleaseStringUTFChars(role, r);
+            env->DeleteLocalRef(role);
+
+            auto content = static_cast<jbyteArray>(env->GetObjectArrayElement(contents, i));
+            content_list[i] = utf8_from_bytes(env, content);
+            env->DeleteLocalRef(content);
+        }
+        inference->load_history(std::move(role_list), std::move(content_list), prefill);
+    }
+}
+
+JNIEXPORT jboolean JNICALL Java_io_smollai_smollai_SmollAI_startCompletion(JNIEnv *env, jobject thiz, jlong instance_ptr, jbyteArray query, jobject progress_listener) {
+    if (instance_ptr != 0) {
+        auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
+
+        PrefillProgressCallback on_progress = nullptr;
+        if (progress_listener != nullptr) {
+            jclass listener_class = env->GetObjectClass(progress_listener);
+            jmethodID on_progress_method = env->GetMethodID(listener_class, "onProgress", "(IIF)V");
+            env->DeleteLocalRef(listener_class);
+            on_progress = [env, progress_listener, on_progress_method](int n_done, int n_total, float tokens_per_sec) {
+                env->CallVoidMethod(progress_listener, on_progress_method, n_done, n_total, tokens_per_sec);
+                // no more JNI calls with the listener's exception pending: end the prefill
+                return !env->ExceptionCheck();
+            };
+        }
+
+        bool started = false;
+        try {
+            started = inference->start_completion(utf8_from_bytes(env, query), on_progress);
+        } catch (const std::exception &e) {
+            env->ThrowNew(env->FindClass("java/lang/IllegalStateException"), e.what());
+            return false;
+        }
+        if (env->ExceptionCheck()) {
+            // the listener threw: the exception reaches the caller, without a reply to stop
+            inference->cancel_completion();
+            return false;
+        }
+        return started;
+    }
+    return false;
+}
+
+JNIEXPORT jobject JNICALL Java_io_smollai_smollai_SmollAI_getStreamBuffer(JNIEnv *env, jobject thiz, jlong instance_ptr) {
+    if (instance_ptr != 0) {
+        auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
+        TokenStream &stream = inference->stream();
+        return env->NewDirectByteBuffer(stream.data(), static_cast<jlong>(stream.capacity()));
+    }
+    return nullptr;
+}
+
+JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_startGeneration(JNIEnv *env, jobject thiz, jlong instance_ptr, jint flush_tokens, jint flush_interval_ms) {
     if (instance_ptr != 0) {
         auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
-        const char *q = env->GetStringUTFChars(query, nullptr);
-        inference->start_completion(q);
-        env->ReleaseStringUTFChars(query, q);
+        inference->start_generation(flush_tokens, flush_interval_ms);
     }
 }
 
-JNIEXPORT jstring JNICALL Java_io_smollai_smollai_SmollAI_completionLoop(JNIEnv *env, jobject thiz, jlong instance_ptr) {
+JNIEXPORT jlong JNICALL Java_io_smollai_smollai_SmollAI_readTokens(JNIEnv *env, jobject thiz, jlong instance_ptr, jint consumed_bytes) {
     if (instance_ptr != 0) {
         auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
-        std::string result = inference->completion_loop();
-        return env->NewStringUTF(result.c_str());
+        return inference->stream().read(static_cast<size_t>(consumed_bytes));
     }
-    return env->NewStringUTF("[ERROR]");
+    return TOKEN_STREAM_ERROR;
 }
 
 JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_stopCompletion(JNIEnv *env, jobject thiz, jlong instance_ptr) {
@@ -62,6 +250,17 @@ JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_stopCompletionInternal(JN
     }
 }
 
+JNIEXPORT jboolean JNICALL Java_io_smollai_smollai_SmollAI_setSessionFile(JNIEnv *env, jobject thiz, jlong instance_ptr, jstring session_dir, jlong chat_id) {
+    if (instance_ptr != 0) {
+        auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
+        const char *dir = env->GetStringUTFChars(session_dir, nullptr);
+        bool restored = inference->set_session_file(dir, chat_id);
+        env->ReleaseStringUTFChars(session_dir, dir);
+        return restored;
+    }
+    return false;
+}
+
 JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_cancelCompletion(JNIEnv *env, jobject thiz, jlong instance_ptr) {
     if (instance_ptr != 0) {
         auto *inference = reinterpret_cast<LLMInference *>(instance_ptr);
@@ -83,4 +282,161 @@ JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_close(JNIEnv *env, jobjec
     }
 }
 
+JNIEXPORT jlong JNICALL Java_io_smollai_smollai_SmollAI_loadEmbeddingModel(JNIEnv *env, jobject thiz, jstring model_path, jint n_threads, jint n_threads_batch, jlong cpu_mask,
+                                                                           jint priority, jint poll, jboolean auto_affinity) {
+    const char *path = env->GetStringUTFChars(model_path, nullptr);
+
+    ThreadingConfig threading;
+    threading.n_threads = n_threads;
+    threading.n_threads_batch = n_threads_batch;
+    threading.cpu_mask = static_cast<uint64_t>(cpu_mask);
+    threading.priority = priority;
+    threading.poll = poll;
+    threading.auto_affinity = auto_affinity;
+
+    try {
+        auto *embedder = new Embedder(path, threading);
+        env->ReleaseStringUTFChars(model_path, path);
+        return reinterpret_cast<jlong>(embedder);
+    } catch (const std::exception &e) {
+        env->ReleaseStringUTFChars(model_path, path);
+        return 0;
+    }
+}
+
+JNIEXPORT jint JNICALL Java_io_smollai_smollai_SmollAI_getEmbeddingDims(JNIEnv *env, jobject thiz, jlong embedder_ptr) {
+    if (embedder_ptr != 0) {
+        auto *embedder = reinterpret_cast<Embedder *>(embedder_ptr);
+        return embedder->n_dims();
+    }
+    return 0;
+}
+
+JNIEXPORT jboolean JNICALL Java_io_smollai_smollai_SmollAI_embed(JNIEnv *env, jobject thiz, jlong embedder_ptr, jobjectArray texts, jobject out) {
+    if (embedder_ptr != 0) {
+        auto *embedder = reinterpret_cast<Embedder *>(embedder_ptr);
+        const jsize n_texts = env->GetArrayLength(texts);
+        std::vector<std::string> text_list(n_texts);
+        for (jsize i = 0; i < n_texts; i++) {
+            auto text = static_cast<jbyteArray>(env->GetObjectArrayElement(texts, i));
+            text_list[i] = utf8_from_bytes(env, text);
+            env->DeleteLocalRef(text);
+        }
+        // the embeddings are written straight into the direct buffer Kotlin reads them from
+        auto *data = static_cast<float *>(env->GetDirectBufferAddress(out));
+        const size_t n_floats = static_cast<size_t>(n_texts) * embedder->n_dims();
+        if (!data || static_cast<size_t>(env->GetDirectBufferCapacity(out)) < n_floats * sizeof(float)) {
+            return false;
+        }
+        return embedder->embed(text_list, data);
+    }
+    return false;
+}
+
+JNIEXPORT void JNICALL Java_io_smollai_smollai_SmollAI_closeEmbeddingModel(JNIEnv *env, jobject thiz, jlong embedder_ptr) {
+    if (embedder_ptr != 0) {
+        auto *embedder = reinterpret_cast<Embedder *>(embedder_ptr);
+        delete embedder;
+    }
+}
+
+JNIEXPORT jlong JNICALL Java_io_smollai_smollai_VectorIndex_openIndex(JNIEnv *env, jobject thiz, jstring index_path, jint dims) {
+    if (dims <= 0) {
+        return 0;
+    }
+    const char *path = env->GetStringUTFChars(index_path, nullptr);
+    try {
+        auto *index = new VectorIndex(path, static_cast<uint32_t>(dims));
+        env->ReleaseStringUTFChars(index_path, path);
+        return reinterpret_cast<jlong>(index);
+    } catch (const std::exception &e) {
+        env->ReleaseStringUTFChars(index_path, path);
+        return 0;
+    }
+}
+
+JNIEXPORT jint JNICALL Java_io_smollai_smollai_VectorIndex_size(JNIEnv *env, jobject thiz, jlong index_ptr) {
+    if (index_ptr != 0) {
+        auto *index = reinterpret_cast<VectorIndex *>(index_ptr);
+        return static_cast<jint>(index->size());
+    }
+    return 0;
+}
+
+JNIEXPORT jboolean JNICALL Java_io_smollai_smollai_VectorIndex_add(JNIEnv *env, jobject thiz, jlong index_ptr, jlongArray ids, jfloatArray vectors) {
+    if (index_ptr != 0) {
+        auto *index = reinterpret_cast<VectorIndex *>(index_ptr);
+        const jsize n_ids = env->GetArrayLength(ids);
+        if (static_cast<size_t>(env->GetArrayLength(vectors)) != static_cast<size_t>(n_ids) * index->n_dims()) {
+            return false;
+        }
+        std::vector<jlong> id_list(n_ids);
+        env->GetLongArrayRegion(ids, 0, n_ids, id_list.data());
+        std::vector<float> vector_list(static_cast<size_t>(n_ids) * index->n_dims());
+        env->GetFloatArrayRegion(vectors, 0, static_cast<jsize>(vector_list.size()), vector_list.data());
+        for (jsize i = 0; i < n_ids; i++) {
+            if (!index->add(id_list[i], vector_list.data() + static_cast<size_t>(i) * index->n_dims())) {
+                return false;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+JNIEXPORT jboolean JNICALL Java_io_smollai_smollai_VectorIndex_remove(JNIEnv *env, jobject thiz, jlong index_ptr, jlong id) {
+    if (index_ptr != 0) {
+        auto *index = reinterpret_cast<VectorIndex *>(index_ptr);
+        return index->remove(id);
+    }
+    return false;
+}
+
+JNIEXPORT jint JNICALL Java_io_smollai_smollai_VectorIndex_search(JNIEnv *env, jobject thiz, jlong index_ptr, jfloatArray query, jint n_probe, jlongArray ids, jfloatArray scores) {
+    if (index_ptr != 0) {
+        auto *index = reinterpret_cast<VectorIndex *>(index_ptr);
+        if (static_cast<uint32_t>(env->GetArrayLength(query)) != index->n_dims()) {
+            return 0;
+        }
+        std::vector<float> query_vector(index->n_dims());
+        env->GetFloatArrayRegion(query, 0, static_cast<jsize>(query_vector.size()), query_vector.data());
+
+        // k is the size of the arrays the matches are returned in
+        const std::vector<VectorIndex::Result> results = index->search(query_vector.data(), env->GetArrayLength(ids), n_probe);
+        const auto n_results = static_cast<jsize>(results.size());
+        std::vector<jlong> result_ids(n_results);
+        std::vector<jfloat> result_scores(n_results);
+        for (jsize i = 0; i < n_results; i++) {
+            result_ids[i] = results[i].id;
+            result_scores[i] = results[i].score;
+        }
+        env->SetLongArrayRegion(ids, 0, n_results, result_ids.data());
+        env->SetFloatArrayRegion(scores, 0, n_results, result_scores.data());
+        return n_results;
+    }
+    return 0;
+}
+
+JNIEXPORT jboolean JNICALL Java_io_smollai_smollai_VectorIndex_rebuild(JNIEnv *env, jobject thiz, jlong index_ptr, jint n_lists) {
+    if (index_ptr != 0) {
+        auto *index = reinterpret_cast<VectorIndex *>(index_ptr);
+        return index->rebuild(n_lists);
+    }
+    return false;
+}
+
+JNIEXPORT void JNICALL Java_io_smollai_smollai_VectorIndex_flush(JNIEnv *env, jobject thiz, jlong index_ptr) {
+    if (index_ptr != 0) {
+        auto *index = reinterpret_cast<VectorIndex *>(index_ptr);
+        index->flush();
+    }
+}
+
+JNIEXPORT void JNICALL Java_io_smollai_smollai_VectorIndex_close(JNIEnv *env, jobject thiz, jlong index_ptr) {
+    if (index_ptr != 0) {
+        auto *index = reinterpret_cast<VectorIndex *>(index_ptr);
+        delete index;
+    }
+}
+
 }
@@ -0,0 +1,171 @@
+#include "stop_matcher.h"
+#include "llama.h"
+#include <algorithm>
+#include <cstring>
+#include <deque>
+
+StopMatcher::StopMatcher(const std::vector<std::string>& stop_strings) : nodes(1) {
+    // trie of the stop strings
+    for (const std::string& stop : stop_strings) {
+        if (stop.empty()) {
+            continue;
+        }
+        int32_t node = 0;
+        for (char c : stop) {
+            const auto byte = (uint8_t) c;
+            int32_t next_node = child(node, byte);
+            if (next_node < 0) {
+                next_node = (int32_t) nodes.size();
+                nodes.emplace_back();
+                nodes[next_node].depth = nodes[node].depth + 1;
+                auto& children = nodes[node].children;
+                children.insert(std::upper_bound(children.begin(), children.end(), std::make_pair(byte, INT32_MIN)),
+                                {byte, next_node});
+            }
+            node = next_node;
+        }
+        nodes[node].match = (int32_t) stop.size();
+    }
+
+    // failure links in breadth-first order, a node's link is never deeper than the node
+    std::deque<int32_t> queue;
+    for (const auto& [byte, node] : nodes[0].children) {
+        queue.push_back(node);
+    }
+    while (!queue.empty()) {
+        const int32_t node = queue.front();
+        queue.pop_front();
+        for (const auto& [byte, next_node] : nodes[node].children) {
+            int32_t fail = nodes[node].fail;
+            while (fail > 0 && child(fail, byte) < 0) {
+                fail = nodes[fail].fail;
+            }
+            const int32_t fail_child = child(fail, byte);
+            nodes[next_node].fail = fail_child >= 0 ? fail_child : 0;
+            // a shorter stop string may end inside a longer one
+            nodes[next_node].match = std::max(nodes[next_node].match, nodes[nodes[next_node].fail].match);
+            queue.push_back(next_node);
+        }
+    }
+}
+
+int32_t StopMatcher::child(int32_t node, uint8_t byte) const {
+    const auto& children = nodes[node].children;
+    auto it = std::lower_bound(children.begin(), children.end(), std::make_pair(byte, INT32_MIN));
+    return it != children.end() && it->first == byte ? it->second : -1;
+}
+
+int32_t StopMatcher::next(int32_t node, uint8_t byte) const {
+    while (true) {
+        const int32_t next_node = child(node, byte);
+        if (next_node >= 0) {
+            return next_node;
+        }
+        if (node == 0) {
+            return 0;
+        }
+        node = nodes[node].fail;
+    }
+}
+
+bool StopMatcher::feed(const std::string& piece, std::string& released) {
+    if (empty()) {
+        released += piece;
+        return false;
+    }
+    for (char c : piece) {
+        state = next(state, (uint8_t) c);
+        held += c;
+        const Node& node = nodes[state];
+        if (node.match > 0) {
+            released.append(held, 0, held.size() - node.match);
+            reset();
+            return true;
+        }
+        // only the last `depth` bytes can still become a stop string
+        if (held.size() > (size_t) node.depth) {
+            const size_t n_release = held.size() - node.depth;
+            released.append(held, 0, n_release);
+            held.erase(0, n_release);
+        }
+    }
+    return false;
+}
+
+bool StopMatcher::is_prefix(const std::string& text) const {
+    if (text.empty() || empty()) {
+        return false;
+    }
+    int32_t node = 0;
+    for (char c : text) {
+        node = child(node, (uint8_t) c);
+        if (node < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string StopMatcher::flush() {
+    std::string text = std::move(held);
+    reset();
+    return text;
+}
+
+void StopMatcher::reset() {
+    state = 0;
+    held.clear();
+}
+
+static std::string render_template(const char* chat_template, const std::vector<llama_chat_message>& messages, bool add_ass) {
+    std::vector<char> buffer(256);
+    int32_t n = llama_chat_apply_template(chat_template, messages.data(), messages.size(), add_ass,
+                                          buffer.data(), (int32_t) buffer.size());
+    if (n > (int32_t) buffer.size()) {
+        buffer.resize(n);
+        n = llama_chat_apply_template(chat_template, messages.data(), messages.size(), add_ass,
+                                      buffer.data(), (int32_t) buffer.size());
+    }
+    return n > 0 ? std::string(buffer.data(), n) : std::string();
+}
+
+static std::string trim(const std::string& text) {
+    const size_t begin = text.find_first_not_of(" \t\n\r");
+    if (begin == std::string::npos) {
+        return "";
+    }
+    return text.substr(begin, text.find_last_not_of(" \t\n\r") + 1 - begin);
+}
+
+std::vector<std::string> chat_template_stop_strings(const char* chat_template) {
+    std::vector<std::string> stop_strings;
+    if (!chat_template) {
+        return stop_strings;
+    }
+
+    static const char* const query = "SMOLLAI_QUERY";
+    static const char* const reply = "SMOLLAI_REPLY";
+    static const char* const next_query = "SMOLLAI_NEXT";
+    const std::vector<llama_chat_message> conversation = {
+        {"user", query}, {"assistant", reply}, {"user", next_query}
+    };
+    const std::string with_reply = render_template(chat_template, {conversation.begin(), conversation.begin() + 2}, false);
+    const std::string with_next = render_template(chat_template, conversation, false);
+
+    const size_t reply_end = with_reply.find(reply);
+    const size_t next_begin = with_next.find(next_query);
+    if (reply_end == std::string::npos || next_begin == std::string::npos ||
+        with_next.compare(0, with_reply.size(), with_reply) != 0 || next_begin < with_reply.size()) {
+        return stop_strings;
+    }
+
+    // "<|im_end|>\n" after the reply, "<|im_start|>user\n" before the next message
+    const std::string end_of_turn = trim(with_reply.substr(reply_end + strlen(reply)));
+    const std::string next_turn = trim(with_next.substr(with_reply.size(), next_begin - with_reply.size()));
+    for (const std::string& stop : {end_of_turn, next_turn}) {
+        if (!stop.empty() && std::find(stop_strings.begin(), stop_strings.end(), stop) == stop_strings.end()) {
+            stop_strings.push_back(stop);
+        }
+    }
+    return stop_strings;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Streaming matcher for stop strings (Aho-Corasick over bytes). Generated pieces are
+// fed as they come; bytes that may still turn out to be the start of a stop string are
+// held back, everything before them is released at once. Each byte is examined a
+// constant number of times on average, however many stop strings there are.
+class StopMatcher {
+
+    struct Node {
+        // sorted by byte; stop strings share few prefixes, so nodes have few children
+        std::vector<std::pair<uint8_t, int32_t>> children;
+        int32_t fail = 0;
+        // bytes from the root, which is how much text is held back in this state
+        int32_t depth = 0;
+        // length of the longest stop string ending here, 0 if none
+        int32_t match = 0;
+    };
+
+    std::vector<Node> nodes;
+    int32_t state = 0;
+    std::string held;
+
+    int32_t child(int32_t node, uint8_t byte) const;
+
+    int32_t next(int32_t node, uint8_t byte) const;
+
+    public:
+
+    explicit StopMatcher(const std::vector<std::string>& stop_strings = {});
+
+    bool empty() const { return nodes.size() <= 1; }
+
+    // Appends `piece` to the stream and adds the text that can no longer be part of a
+    // stop string to `released`. Returns true when a stop string is complete; `released`
+    // then ends where the stop string starts and the matcher is reset.
+    bool feed(const std::string& piece, std::string& released);
+
+    // Whether `text` is a stop string or the start of one
+    bool is_prefix(const std::string& text) const;
+
+    // Returns the held back text and starts over
+    std::string flush();
+
+    void reset();
+
+};
+
+// Strings that end the assistant's turn in `chat_template`, found by rendering a sample
+// conversation: the end of turn marker after a reply and the marker starting the next
+// user message, without surrounding whitespace. Models sometimes write them as plain
+// text instead of the control tokens they normally are.
+std::vector<std::string> chat_template_stop_strings(const char* chat_template);
@@ -0,0 +1,209 @@
+// Host test for VectorIndex: replacing and removing vectors, reopening the file,
+// rejecting files it cannot use, and searching inverted lists. Run by ctest, or
+// directly; exits non-zero if a check fails.
+
+#include "vector_index.h"
+#include <cmath>
+#include <cstdio>
+#include <filesystem>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace {
+
+int n_failed = 0;
+
+#define CHECK(cond)                                                           \
+    do {                                                                      \
+        if (!(cond)) {                                                        \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            n_failed++;                                                       \
+        }                                                                     \
+    } while (0)
+
+const uint32_t n_dims = 48;
+
+// normalized random vectors, as the embeddings the index holds
+std::vector<float> random_vectors(std::mt19937& rng, size_t n) {
+    std::normal_distribution<float> dist;
+    std::vector<float> vectors(n * n_dims);
+    for (size_t i = 0; i < n; i++) {
+        float* v = vectors.data() + i * n_dims;
+        double norm = 0.0;
+        for (uint32_t d = 0; d < n_dims; d++) {
+            v[d] = dist(rng);
+            norm += (double) v[d] * v[d];
+        }
+        for (uint32_t d = 0; d < n_dims; d++) {
+            v[d] = (float) (v[d] / std::sqrt(norm));
+        }
+    }
+    return vectors;
+}
+
+bool same_results(const std::vector<VectorIndex::Result>& a, const std::vector<VectorIndex::Result>& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].id != b[i].id || a[i].score != b[i].score) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool opens(const fs::path& path, uint32_t dim) {
+    try {
+        VectorIndex index(path.string(), dim);
+        return true;
+    } catch (const std::runtime_error&) {
+        return false;
+    }
+}
+
+void test_replace_remove(const fs::path& dir) {
+    std::mt19937 rng(1);
+    const std::vector<float> v = random_vectors(rng, 2);
+    VectorIndex index((dir / "replace.idx").string(), n_dims);
+
+    CHECK(index.add(7, v.data()));
+    CHECK(index.add(7, v.data() + n_dims));
+    CHECK(index.size() == 1);
+    std::vector<VectorIndex::Result> found = index.search(v.data() + n_dims, 5);
+    CHECK(found.size() == 1 && found[0].id == 7 && std::fabs(found[0].score - 1.0f) < 1e-5f);
+
+    CHECK(index.remove(7));
+    CHECK(!index.remove(7));
+    CHECK(index.size() == 0);
+    CHECK(index.search(v.data(), 5).empty());
+
+    CHECK(index.add(7, v.data()));
+    CHECK(index.size() == 1);
+    found = index.search(v.data(), 5);
+    CHECK(found.size() == 1 && found[0].id == 7 && std::fabs(found[0].score - 1.0f) < 1e-5f);
+}
+
+void test_reopen(const fs::path& dir) {
+    std::mt19937 rng(2);
+    const size_t n = 1000;
+    const std::vector<float> vectors = random_vectors(rng, n);
+    const std::vector<float> queries = random_vectors(rng, 8);
+    const fs::path path = dir / "reopen.idx";
+
+    std::vector<std::vector<VectorIndex::Result>> expected;
+    {
+        VectorIndex index(path.string(), n_dims);
+        for (size_t i = 0; i < n; i++) {
+            CHECK(index.add((int64_t) i, vectors.data() + i * n_dims));
+        }
+        for (size_t i = 0; i < n; i += 7) {
+            CHECK(index.remove((int64_t) i));
+        }
+        for (size_t q = 0; q < 8; q++) {
+            expected.push_back(index.search(queries.data() + q * n_dims, 10));
+        }
+    }
+    {
+        VectorIndex index(path.string(), n_dims);
+        CHECK(index.size() == n - (n + 6) / 7);
+        for (size_t q = 0; q < 8; q++) {
+            CHECK(same_results(index.search(queries.data() + q * n_dims, 10), expected[q]));
+        }
+        CHECK(index.rebuild(16));
+        expected.clear();
+        for (size_t q = 0; q < 8; q++) {
+            expected.push_back(index.search(queries.data() + q * n_dims, 10, 4));
+        }
+    }
+    VectorIndex index(path.string(), n_dims);
+    for (size_t q = 0; q < 8; q++) {
+        CHECK(same_results(index.search(queries.data() + q * n_dims, 10, 4), expected[q]));
+    }
+}
+
+void test_reject(const fs::path& dir) {
+    std::mt19937 rng(3);
+    const size_t n = 500;
+    const std::vector<float> vectors = random_vectors(rng, n);
+    const fs::path path = dir / "reject.idx";
+    {
+        VectorIndex index(path.string(), n_dims);
+        for (size_t i = 0; i < n; i++) {
+            CHECK(index.add((int64_t) i, vectors.data() + i * n_dims));
+        }
+        CHECK(index.rebuild(8));
+    }
+    CHECK(!opens(path, n_dims + 1));
+
+    // records missing from the end
+    const fs::path truncated = dir / "truncated.idx";
+    fs::copy_file(path, truncated);
+    fs::resize_file(truncated, fs::file_size(path) / 4);
+    CHECK(!opens(truncated, n_dims));
+    // not even a whole header
+    fs::resize_file(truncated, 16);
+    CHECK(!opens(truncated, n_dims));
+
+    CHECK(opens(path, n_dims));
+}
+
+void test_full_probe(const fs::path& dir) {
+    std::mt19937 rng(4);
+    const size_t n = 3000;
+    const int n_lists = 24;
+    const std::vector<float> vectors = random_vectors(rng, n + 100);
+    const std::vector<float> queries = random_vectors(rng, 16);
+    const fs::path path = dir / "ivf.idx";
+    const fs::path flat_path = dir / "flat.idx";
+
+    VectorIndex index(path.string(), n_dims);
+    for (size_t i = 0; i < n; i++) {
+        CHECK(index.add((int64_t) i, vectors.data() + i * n_dims));
+    }
+    CHECK(index.rebuild(n_lists));
+    // clustered vectors removed, and vectors added after the lists
+    for (size_t i = 0; i < n; i += 11) {
+        CHECK(index.remove((int64_t) i));
+    }
+    for (size_t i = n; i < n + 100; i++) {
+        CHECK(index.add((int64_t) i, vectors.data() + i * n_dims));
+    }
+    index.flush();
+
+    fs::copy_file(path, flat_path);
+    VectorIndex flat(flat_path.string(), n_dims);
+    CHECK(flat.rebuild(0));
+    CHECK(flat.size() == index.size());
+
+    for (size_t q = 0; q < 16; q++) {
+        const float* query = queries.data() + q * n_dims;
+        const std::vector<VectorIndex::Result> exhaustive = flat.search(query, 20);
+        CHECK(exhaustive.size() == 20);
+        CHECK(same_results(index.search(query, 20, n_lists), exhaustive));
+    }
+}
+
+} // namespace
+
+int main() {
+    const fs::path dir = fs::temp_directory_path() / ("smollai-test-vector-index-" + std::to_string(std::random_device{}()));
+    fs::create_directories(dir);
+
+    test_replace_remove(dir);
+    test_reopen(dir);
+    test_reject(dir);
+    test_full_probe(dir);
+
+    fs::remove_all(dir);
+    if (n_failed > 0) {
+        fprintf(stderr, "%d checks failed\n", n_failed);
+        return 1;
+    }
+    printf("all checks passed\n");
+    return 0;
+}
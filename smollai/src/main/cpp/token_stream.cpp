@@ -0,0 +1,157 @@
+#include "token_stream.h"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+// Length of the longest prefix of `bytes` that does not end inside a UTF-8 sequence
+static size_t utf8_complete_prefix(const std::string& bytes) {
+    const size_t n = bytes.size();
+    for (size_t back = 1; back <= std::min<size_t>(4, n); back++) {
+        const auto c = static_cast<uint8_t>(bytes[n - back]);
+        if ((c & 0xC0) == 0x80) {
+            continue; // continuation byte, keep looking for the lead byte
+        }
+        size_t seq_len = 1;
+        if ((c & 0xE0) == 0xC0) {
+            seq_len = 2;
+        } else if ((c & 0xF0) == 0xE0) {
+            seq_len = 3;
+        } else if ((c & 0xF8) == 0xF0) {
+            seq_len = 4;
+        }
+        return seq_len > back ? n - back : n;
+    }
+    return n; // stray continuation bytes, let the decoder replace them
+}
+
+TokenStream::TokenStream(size_t capacity) : buffer(capacity) {}
+
+void TokenStream::reset(int flush_tokens, int flush_interval_ms) {
+    std::lock_guard<std::mutex> lock(mutex);
+    read_pos = write_pos = published_pos = 0;
+    pad_begin = pad_end = 0;
+    utf8_carry.clear();
+    this->flush_tokens = std::max(flush_tokens, 1);
+    this->flush_interval_ms = std::max(flush_interval_ms, 0);
+    unpublished_tokens = 0;
+    status = TOKEN_STREAM_OPEN;
+}
+
+bool TokenStream::write_bytes(std::unique_lock<std::mutex>& lock, const char* bytes, size_t n) {
+    const size_t cap = buffer.size();
+    while (n > 0) {
+        // oversized chunks (never seen for single pieces) are split without regard to UTF-8
+        const size_t chunk = std::min(n, cap / 2);
+        const size_t offset = write_pos % cap;
+        const size_t pad = offset + chunk > cap ? cap - offset : 0;
+
+        auto has_space = [&] { return status != TOKEN_STREAM_OPEN || write_pos + pad + chunk - read_pos <= cap; };
+        if (!has_space()) {
+            // the consumer can only free space by reading, so hand over everything first
+            published_pos = write_pos;
+            unpublished_tokens = 0;
+            data_cv.notify_one();
+            space_cv.wait(lock, has_space);
+        }
+        if (status != TOKEN_STREAM_OPEN) {
+            return false;
+        }
+
+        if (pad > 0) {
+            pad_begin = write_pos;
+            pad_end = write_pos + pad;
+            write_pos = pad_end;
+        }
+        memcpy(buffer.data() + write_pos % cap, bytes, chunk);
+        write_pos += chunk;
+        bytes += chunk;
+        n -= chunk;
+    }
+    return true;
+}
+
+bool TokenStream::write_piece(const std::string& piece) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (status != TOKEN_STREAM_OPEN) {
+        return false;
+    }
+
+    // hold back a trailing partial character until the next piece completes it
+    utf8_carry += piece;
+    const size_t n_complete = utf8_complete_prefix(utf8_carry);
+    if (!write_bytes(lock, utf8_carry.data(), n_complete)) {
+        return false;
+    }
+    utf8_carry.erase(0, n_complete);
+
+    if (++unpublished_tokens >= flush_tokens) {
+        published_pos = write_pos;
+        unpublished_tokens = 0;
+        data_cv.notify_one();
+    }
+    return true;
+}
+
+void TokenStream::finish(int status) {
+    std::unique_lock<std::mutex> lock(mutex);
+    if (this->status != TOKEN_STREAM_OPEN) {
+        return;
+    }
+    if (!utf8_carry.empty()) {
+        write_bytes(lock, utf8_carry.data(), utf8_carry.size());
+        utf8_carry.clear();
+    }
+    published_pos = write_pos;
+    this->status = status;
+    data_cv.notify_all();
+    space_cv.notify_all();
+}
+
+void TokenStream::close(int status) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (this->status == TOKEN_STREAM_OPEN || status == TOKEN_STREAM_CANCELLED) {
+        this->status = status;
+    }
+    data_cv.notify_all();
+    space_cv.notify_all();
+}
+
+void TokenStream::skip_padding() {
+    if (pad_end > pad_begin && read_pos == pad_begin && published_pos >= pad_end) {
+        read_pos = pad_end;
+    }
+}
+
+int64_t TokenStream::read(size_t consumed) {
+    std::unique_lock<std::mutex> lock(mutex);
+    read_pos = std::min(read_pos + consumed, published_pos);
+    skip_padding();
+    space_cv.notify_one();
+
+    while (status != TOKEN_STREAM_CANCELLED && published_pos == read_pos) {
+        if (status != TOKEN_STREAM_OPEN) {
+            return status;
+        }
+        auto has_data = [&] { return status != TOKEN_STREAM_OPEN || published_pos != read_pos; };
+        if (flush_interval_ms == 0) {
+            data_cv.wait(lock, has_data);
+        } else if (!data_cv.wait_for(lock, std::chrono::milliseconds(flush_interval_ms), has_data) &&
+                   write_pos != read_pos) {
+            // the batch did not fill up in time, hand over what is there
+            published_pos = write_pos;
+            unpublished_tokens = 0;
+        }
+        skip_padding();
+    }
+    if (status == TOKEN_STREAM_CANCELLED) {
+        return status;
+    }
+
+    const size_t cap = buffer.size();
+    const size_t offset = read_pos % cap;
+    uint64_t end = std::min<uint64_t>(published_pos, read_pos + (cap - offset));
+    if (pad_end > pad_begin && pad_begin > read_pos) {
+        end = std::min(end, pad_begin);
+    }
+    return (static_cast<int64_t>(offset) << 32) | static_cast<int64_t>(end - read_pos);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Terminal states reported to the consumer once all published bytes are read
+enum TokenStreamStatus : int {
+    TOKEN_STREAM_OPEN = 0,
+    TOKEN_STREAM_END = -1,          // end of generation (EOG or context full)
+    TOKEN_STREAM_ERROR = -2,        // generation failed
+    TOKEN_STREAM_CANCELLED = -3,    // closed by the consumer, pending bytes are dropped
+};
+
+// Single-producer/single-consumer byte ring carrying generated text from the
+// native generation thread to Kotlin, which reads it through a direct ByteBuffer
+// wrapping data(). Only complete UTF-8 sequences are written, and a write never
+// straddles the physical end of the ring (the tail is skipped instead), so every
+// segment returned by read() decodes on its own.
+//
+// Bytes become visible to the consumer in batches: after `flush_tokens` pieces,
+// or once the consumer has waited `flush_interval_ms` for more.
+class TokenStream {
+
+    std::vector<uint8_t> buffer;
+    std::mutex mutex;
+    std::condition_variable data_cv;
+    std::condition_variable space_cv;
+
+    // logical positions, the physical offset is pos % buffer.size()
+    uint64_t read_pos = 0;
+    uint64_t write_pos = 0;
+    uint64_t published_pos = 0;
+    // bytes skipped by the writer at the physical end of the ring
+    uint64_t pad_begin = 0;
+    uint64_t pad_end = 0;
+
+    std::string utf8_carry;
+    int flush_tokens = 1;
+    int flush_interval_ms = 0;
+    int unpublished_tokens = 0;
+    int status = TOKEN_STREAM_OPEN;
+
+    bool write_bytes(std::unique_lock<std::mutex>& lock, const char* bytes, size_t n);
+
+    void skip_padding();
+
+    public:
+
+    explicit TokenStream(size_t capacity = 64 * 1024);
+
+    uint8_t* data() { return buffer.data(); }
+
+    size_t capacity() const { return buffer.size(); }
+
+    void reset(int flush_tokens, int flush_interval_ms);
+
+    // Producer: appends a detokenized piece, returns false once the stream is closed
+    bool write_piece(const std::string& piece);
+
+    // Producer: publishes everything written so far and ends the stream
+    void finish(int status);
+
+    // Either side: ends the stream immediately, waking up a blocked producer or consumer
+    void close(int status);
+
+    // Consumer: releases `consumed` bytes of the previous segment and waits for the next
+    // one. Returns (offset << 32) | length, or a negative TokenStreamStatus at the end.
+    int64_t read(size_t consumed);
+
+};
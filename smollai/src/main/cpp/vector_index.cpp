@@ -0,0 +1,456 @@
+#include "vector_index.h"
+#include "logging.h"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// File layout: the header, the record offsets of the lists, their centroids and then
+// the records, an int64 id followed by the vector, each padded to 8 bytes. The first
+// n_clustered records are sorted by list.
+struct VectorIndex::Header {
+    char magic[4];
+    uint32_t version;
+    uint32_t dim;
+    uint32_t n_lists;
+    uint64_t n_records;         // records written, removed ones included
+    uint64_t n_clustered;       // records sorted into the lists by the last rebuild()
+    uint8_t reserved[32];
+};
+
+namespace {
+
+const size_t header_size = 64;
+const char index_magic[4] = {'S', 'M', 'V', 'I'};
+const uint32_t index_version = 1;
+// id of a removed record
+const int64_t removed_id = INT64_MIN;
+// records a new file has room for
+const uint64_t initial_capacity = 256;
+const int n_kmeans_iterations = 10;
+// vectors per list k-means is trained on, at most
+const size_t n_train_per_list = 64;
+
+// independent running sums, which compilers turn into vector multiply-adds
+const int n_lanes = 16;
+
+float dot(const float* a, const float* b, size_t n) {
+    float lanes[n_lanes] = {};
+    size_t i = 0;
+    for (; i + n_lanes <= n; i += n_lanes) {
+        const float* x = a + i;
+        const float* y = b + i;
+        for (int j = 0; j < n_lanes; j++) {
+            lanes[j] += x[j] * y[j];
+        }
+    }
+    float sum = 0.0f;
+    for (float lane : lanes) {
+        sum += lane;
+    }
+    for (; i < n; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+size_t layout_records_offset(uint32_t n_lists, uint32_t dim) {
+    const size_t size = header_size + (n_lists + 1) * sizeof(uint64_t) + (size_t) n_lists * dim * sizeof(float);
+    return (size + 7) & ~(size_t) 7;
+}
+
+// index of the centroid with the highest dot product with `vector`
+uint32_t nearest_list(const float* centroids, uint32_t n_lists, const float* vector, uint32_t dim) {
+    uint32_t best = 0;
+    float best_score = -INFINITY;
+    for (uint32_t l = 0; l < n_lists; l++) {
+        const float score = dot(centroids + (size_t) l * dim, vector, dim);
+        if (score > best_score) {
+            best_score = score;
+            best = l;
+        }
+    }
+    return best;
+}
+
+// the `k` highest scores seen, in a min-heap
+class TopK {
+
+    size_t k;
+    std::vector<VectorIndex::Result> heap;
+
+    static bool worse(const VectorIndex::Result& a, const VectorIndex::Result& b) { return a.score > b.score; }
+
+    public:
+
+    explicit TopK(size_t k) : k(k) { heap.reserve(k); }
+
+    void push(int64_t id, float score) {
+        if (heap.size() < k) {
+            heap.push_back({id, score});
+            std::push_heap(heap.begin(), heap.end(), worse);
+        } else if (score > heap.front().score) {
+            std::pop_heap(heap.begin(), heap.end(), worse);
+            heap.back() = {id, score};
+            std::push_heap(heap.begin(), heap.end(), worse);
+        }
+    }
+
+    std::vector<VectorIndex::Result> sorted() {
+        std::sort_heap(heap.begin(), heap.end(), worse);
+        return std::move(heap);
+    }
+
+};
+
+}
+
+VectorIndex::VectorIndex(const std::string& path, uint32_t dim)
+    : path(path), dim(dim), record_stride(sizeof(int64_t) + ((dim * sizeof(float) + 7) & ~(size_t) 7)) {
+    static_assert(sizeof(Header) == header_size, "the header is part of the file format");
+    if (dim == 0) {
+        throw std::runtime_error("VectorIndex() failed: invalid dimension");
+    }
+    if (!open_file()) {
+        throw std::runtime_error("VectorIndex() failed: could not open " + path);
+    }
+}
+
+VectorIndex::~VectorIndex() {
+    close_file();
+}
+
+const uint64_t* VectorIndex::list_offsets() const {
+    return reinterpret_cast<const uint64_t*>(data + sizeof(Header));
+}
+
+const float* VectorIndex::centroids() const {
+    return reinterpret_cast<const float*>(data + sizeof(Header) + (header()->n_lists + 1) * sizeof(uint64_t));
+}
+
+size_t VectorIndex::records_offset() const {
+    return layout_records_offset(header()->n_lists, dim);
+}
+
+int64_t* VectorIndex::record_id(uint64_t i) const {
+    return reinterpret_cast<int64_t*>(data + records_offset() + i * record_stride);
+}
+
+float* VectorIndex::record_vector(uint64_t i) const {
+    return reinterpret_cast<float*>(data + records_offset() + i * record_stride + sizeof(int64_t));
+}
+
+bool VectorIndex::open_file() {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        LOGe("Cannot open vector index %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    struct stat st{};
+    if (fstat(fd, &st) != 0) {
+        LOGe("Cannot stat vector index %s: %s", path.c_str(), strerror(errno));
+        close_file();
+        return false;
+    }
+
+    size_t size = (size_t) st.st_size;
+    if (size == 0) {
+        // a new index: the header, the end offset of zero lists and room for some records
+        Header empty{};
+        memcpy(empty.magic, index_magic, sizeof(index_magic));
+        empty.version = index_version;
+        empty.dim = dim;
+        const uint64_t no_lists = 0;
+        size = layout_records_offset(0, dim) + initial_capacity * record_stride;
+        if (ftruncate(fd, (off_t) size) != 0 || pwrite(fd, &empty, sizeof(empty), 0) != (ssize_t) sizeof(empty) ||
+            pwrite(fd, &no_lists, sizeof(no_lists), sizeof(empty)) != (ssize_t) sizeof(no_lists)) {
+            LOGe("Cannot initialize vector index %s: %s", path.c_str(), strerror(errno));
+            close_file();
+            return false;
+        }
+    }
+    if (size < layout_records_offset(0, dim)) {
+        LOGe("Vector index %s is truncated", path.c_str());
+        close_file();
+        return false;
+    }
+
+    void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        LOGe("Cannot map vector index %s: %s", path.c_str(), strerror(errno));
+        close_file();
+        return false;
+    }
+    data = static_cast<uint8_t*>(mapped);
+    n_mapped = size;
+
+    const Header* h = header();
+    if (memcmp(h->magic, index_magic, sizeof(index_magic)) != 0 || h->version != index_version) {
+        LOGe("%s is not a vector index", path.c_str());
+        close_file();
+        return false;
+    }
+    if (h->dim != dim) {
+        LOGe("Vector index %s holds vectors of %u dimensions, not %u", path.c_str(), h->dim, dim);
+        close_file();
+        return false;
+    }
+    bool valid = layout_records_offset(h->n_lists, dim) <= size &&
+                 h->n_records <= (size - layout_records_offset(h->n_lists, dim)) / record_stride &&
+                 h->n_clustered <= h->n_records && list_offsets()[h->n_lists] == h->n_clustered;
+    for (uint32_t l = 0; valid && l < h->n_lists; l++) {
+        valid = list_offsets()[l] <= list_offsets()[l + 1];
+    }
+    if (!valid) {
+        LOGe("Vector index %s is corrupted", path.c_str());
+        close_file();
+        return false;
+    }
+
+    ids.clear();
+    for (uint64_t i = 0; i < h->n_records; i++) {
+        const int64_t id = *record_id(i);
+        if (id != removed_id) {
+            ids[id] = i;
+        }
+    }
+    LOGi("Vector index %s opened: %zu vectors, %u lists", path.c_str(), ids.size(), h->n_lists);
+    return true;
+}
+
+void VectorIndex::close_file() {
+    if (data) {
+        munmap(data, n_mapped);
+        data = nullptr;
+        n_mapped = 0;
+    }
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    ids.clear();
+}
+
+bool VectorIndex::reserve(uint64_t n_records) {
+    const uint64_t capacity = (n_mapped - records_offset()) / record_stride;
+    if (n_records <= capacity) {
+        return true;
+    }
+    const size_t size = records_offset() + std::max(n_records, capacity * 2) * record_stride;
+    // allocated rather than sparse, a write to the mapping must not run out of storage
+    const int result = posix_fallocate(fd, 0, (off_t) size);
+    if (result != 0) {
+        LOGe("Cannot grow vector index %s to %zu bytes: %s", path.c_str(), size, strerror(result));
+        return false;
+    }
+    void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (mapped == MAP_FAILED) {
+        LOGe("Cannot map vector index %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    munmap(data, n_mapped);
+    data = static_cast<uint8_t*>(mapped);
+    n_mapped = size;
+    return true;
+}
+
+size_t VectorIndex::size() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return ids.size();
+}
+
+bool VectorIndex::add(int64_t id, const float* vector) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!data || id == removed_id || !reserve(header()->n_records + 1)) {
+        return false;
+    }
+    auto it = ids.find(id);
+    if (it != ids.end()) {
+        // the old record may be in a list the new vector does not belong to
+        *record_id(it->second) = removed_id;
+    }
+    const uint64_t i = header()->n_records;
+    memcpy(record_vector(i), vector, dim * sizeof(float));
+    *record_id(i) = id;
+    // counted only once written, a record cut short by the process dying is left out
+    header()->n_records = i + 1;
+    ids[id] = i;
+    return true;
+}
+
+bool VectorIndex::remove(int64_t id) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = ids.find(id);
+    if (!data || it == ids.end()) {
+        return false;
+    }
+    *record_id(it->second) = removed_id;
+    ids.erase(it);
+    return true;
+}
+
+std::vector<VectorIndex::Result> VectorIndex::search(const float* query, int k, int n_probe) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!data || k <= 0) {
+        return {};
+    }
+    const Header* h = header();
+    TopK top((size_t) k);
+    auto scan = [&](uint64_t begin, uint64_t end) {
+        for (uint64_t i = begin; i < end; i++) {
+            const int64_t id = *record_id(i);
+            if (id != removed_id) {
+                top.push(id, dot(query, record_vector(i), dim));
+            }
+        }
+    };
+
+    if (h->n_lists > 0) {
+        const uint32_t n_lists = h->n_lists;
+        const uint32_t n_scan = std::min((uint32_t) (n_probe > 0 ? n_probe : default_n_probe), n_lists);
+        std::vector<Result> lists(n_lists);
+        for (uint32_t l = 0; l < n_lists; l++) {
+            lists[l] = {l, dot(query, centroids() + (size_t) l * dim, dim)};
+        }
+        std::partial_sort(lists.begin(), lists.begin() + n_scan, lists.end(),
+                          [](const Result& a, const Result& b) { return a.score > b.score; });
+        for (uint32_t p = 0; p < n_scan; p++) {
+            const auto l = (uint32_t) lists[p].id;
+            scan(list_offsets()[l], list_offsets()[l + 1]);
+        }
+    }
+    // added since the last rebuild(), or everything without lists
+    scan(h->n_clustered, h->n_records);
+    return top.sorted();
+}
+
+bool VectorIndex::rebuild(int n_lists) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!data) {
+        return false;
+    }
+
+    std::vector<uint64_t> live;
+    live.reserve(ids.size());
+    for (uint64_t i = 0; i < header()->n_records; i++) {
+        if (*record_id(i) != removed_id) {
+            live.push_back(i);
+        }
+    }
+    const auto n_new_lists = (uint32_t) std::min((size_t) std::max(n_lists, 0), live.size());
+
+    // spherical k-means on a sample spread over the whole index
+    std::vector<float> new_centroids((size_t) n_new_lists * dim);
+    std::vector<uint32_t> assignment(live.size(), 0);
+    if (n_new_lists > 0) {
+        const size_t step = std::max((size_t) 1, live.size() / (n_new_lists * n_train_per_list));
+        std::vector<uint64_t> train;
+        for (size_t i = 0; i < live.size(); i += step) {
+            train.push_back(live[i]);
+        }
+        for (uint32_t l = 0; l < n_new_lists; l++) {
+            const float* seed = record_vector(train[l * train.size() / n_new_lists]);
+            std::copy(seed, seed + dim, new_centroids.begin() + (size_t) l * dim);
+        }
+        std::vector<float> sums(new_centroids.size());
+        std::vector<uint32_t> counts(n_new_lists);
+        for (int iteration = 0; iteration < n_kmeans_iterations; iteration++) {
+            std::fill(sums.begin(), sums.end(), 0.0f);
+            std::fill(counts.begin(), counts.end(), 0);
+            for (uint64_t i : train) {
+                const float* vector = record_vector(i);
+                const uint32_t l = nearest_list(new_centroids.data(), n_new_lists, vector, dim);
+                counts[l]++;
+                float* sum = sums.data() + (size_t) l * dim;
+                for (uint32_t d = 0; d < dim; d++) {
+                    sum[d] += vector[d];
+                }
+            }
+            for (uint32_t l = 0; l < n_new_lists; l++) {
+                // an empty list keeps its centroid
+                const float* sum = sums.data() + (size_t) l * dim;
+                const float norm = std::sqrt(dot(sum, sum, dim));
+                if (counts[l] > 0 && norm > 0.0f) {
+                    for (uint32_t d = 0; d < dim; d++) {
+                        new_centroids[(size_t) l * dim + d] = sum[d] / norm;
+                    }
+                }
+            }
+        }
+        for (size_t i = 0; i < live.size(); i++) {
+            assignment[i] = nearest_list(new_centroids.data(), n_new_lists, record_vector(live[i]), dim);
+        }
+    }
+
+    // records sorted by list, in their previous order within a list
+    std::vector<uint64_t> offsets(n_new_lists + 1, 0);
+    std::vector<uint64_t> order = live;
+    if (n_new_lists > 0) {
+        for (uint32_t l : assignment) {
+            offsets[l + 1]++;
+        }
+        for (uint32_t l = 0; l < n_new_lists; l++) {
+            offsets[l + 1] += offsets[l];
+        }
+        std::vector<uint64_t> next(offsets.begin(), offsets.end() - 1);
+        for (size_t i = 0; i < live.size(); i++) {
+            order[next[assignment[i]]++] = live[i];
+        }
+    }
+
+    Header new_header = *header();
+    new_header.n_lists = n_new_lists;
+    new_header.n_records = live.size();
+    new_header.n_clustered = n_new_lists > 0 ? live.size() : 0;
+
+    // written next to the index and renamed over it, so a failure leaves it as it was
+    const std::string tmp_path = path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (!file) {
+        LOGe("Cannot write %s: %s", tmp_path.c_str(), strerror(errno));
+        return false;
+    }
+    const size_t new_records_offset = layout_records_offset(n_new_lists, dim);
+    const size_t n_padding = new_records_offset - header_size - offsets.size() * sizeof(uint64_t) -
+                             new_centroids.size() * sizeof(float);
+    const uint64_t zeros = 0;
+    bool written = fwrite(&new_header, sizeof(new_header), 1, file) == 1 &&
+                   fwrite(offsets.data(), sizeof(uint64_t), offsets.size(), file) == offsets.size() &&
+                   (new_centroids.empty() ||
+                    fwrite(new_centroids.data(), sizeof(float), new_centroids.size(), file) == new_centroids.size()) &&
+                   fwrite(&zeros, 1, n_padding, file) == n_padding;
+    for (size_t i = 0; written && i < order.size(); i++) {
+        written = fwrite(record_id(order[i]), record_stride, 1, file) == 1;
+    }
+    const uint64_t capacity = std::max((uint64_t) live.size() + live.size() / 4, initial_capacity);
+    written = written && fflush(file) == 0 &&
+              posix_fallocate(fileno(file), 0, (off_t) (new_records_offset + capacity * record_stride)) == 0 &&
+              fsync(fileno(file)) == 0;
+    written = fclose(file) == 0 && written;
+    if (!written || rename(tmp_path.c_str(), path.c_str()) != 0) {
+        LOGe("Cannot rebuild vector index %s: %s", path.c_str(), strerror(errno));
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+
+    close_file();
+    if (!open_file()) {
+        return false;
+    }
+    LOGi("Vector index %s rebuilt: %zu vectors in %u lists", path.c_str(), live.size(), n_new_lists);
+    return true;
+}
+
+void VectorIndex::flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (data) {
+        msync(data, n_mapped, MS_SYNC);
+    }
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Nearest neighbour search over embeddings (see Embedder), kept in a memory mapped
+// file: opening an index of thousands of messages maps it instead of reading it, and
+// added vectors are written through the mapping. Scores are dot products, which is the
+// cosine similarity for normalized vectors.
+//
+// A search scans every vector until rebuild() clusters them by k-means into inverted
+// lists; it then scans only the lists whose centroids score highest for the query, and
+// the vectors added since the rebuild.
+class VectorIndex {
+
+    struct Header;
+
+    std::string path;
+    uint32_t dim;
+    int fd = -1;
+    uint8_t* data = nullptr;
+    size_t n_mapped = 0;
+    // bytes from the start of one record (id and vector) to the next
+    size_t record_stride;
+    // live records by id
+    std::unordered_map<int64_t, uint64_t> ids;
+    std::mutex mutex;
+
+    Header* header() const { return reinterpret_cast<Header*>(data); }
+
+    const float* centroids() const;
+
+    // n_lists + 1 record offsets, list l holds the records from list_offsets()[l] on
+    const uint64_t* list_offsets() const;
+
+    size_t records_offset() const;
+
+    int64_t* record_id(uint64_t i) const;
+
+    float* record_vector(uint64_t i) const;
+
+    // maps the file at `path`, initializing it if empty, and collects the live ids
+    bool open_file();
+
+    void close_file();
+
+    // makes room for at least `n_records` records
+    bool reserve(uint64_t n_records);
+
+    public:
+
+    struct Result {
+        int64_t id;
+        float score;
+    };
+
+    // lists scanned by search() when n_probe is 0
+    static const int default_n_probe = 8;
+
+    // Opens the index stored at `path`, creating it if the file does not exist. Throws
+    // std::runtime_error if it cannot be created or mapped, or holds vectors of a
+    // different dimension.
+    VectorIndex(const std::string& path, uint32_t dim);
+
+    ~VectorIndex();
+
+    VectorIndex(const VectorIndex&) = delete;
+    VectorIndex& operator=(const VectorIndex&) = delete;
+
+    uint32_t n_dims() const { return dim; }
+
+    // Number of vectors in the index
+    size_t size();
+
+    // Stores `vector` for `id`, replacing the one it had; returns false if the file
+    // cannot grow
+    bool add(int64_t id, const float* vector);
+
+    // Returns false if there is no vector for `id`
+    bool remove(int64_t id);
+
+    // The `k` vectors with the highest dot product with `query`, best first. With inverted
+    // lists, `n_probe` of them are scanned (default_n_probe when 0).
+    std::vector<Result> search(const float* query, int k, int n_probe = 0);
+
+    // Rewrites the file without the removed vectors and clusters the rest into `n_lists`
+    // inverted lists (at most one per vector), or none for flat search. Returns false if
+    // the file cannot be written.
+    bool rebuild(int n_lists);
+
+    // Writes the mapped pages to storage
+    void flush();
+
+};
@@ -4,61 +4,548 @@ import kotlinx.coroutines.Dispatchers
 import kotlinx.coroutines.flow.Flow
 import kotlinx.coroutines.flow.flow
 import kotlinx.coroutines.withContext
+import java.nio.ByteBuffer
+import java.nio.ByteOrder
 
 class SmollAI {
     private var nativePtr = 0L
 
+    // native ring buffer the generation thread writes UTF-8 text into
+    private var streamBuffer: ByteBuffer? = null
+
+    private var embedderPtr = 0L
+
+    // direct buffer the embeddings are written into, reused while large enough
+    private var embeddingBuffer: ByteBuffer? = null
+
     companion object {
         init {
             System.loadLibrary("smollai")
         }
+
+        /** Logical batch size: the most prompt tokens submitted to a single decode call */
+        const val DEFAULT_N_BATCH = 512
+
+        /** Physical batch size: prompt tokens computed per prefill chunk */
+        const val DEFAULT_N_UBATCH = 512
+
+        /**
+         * Chats that can share one native context. Instances created on the same model with the
+         * same settings use separate sequences of a single context and KV cache, and their token
+         * generation is batched together.
+         */
+        const val DEFAULT_MAX_SEQUENCES = 4
+
+        /**
+         * Initial context (KV cache) size when [KvCacheOptions.nCtx] is 0, and the size [estimateMemory]
+         * assumes then
+         */
+        const val DEFAULT_N_CTX = 2048
+
+        /** Most tokens proposed by the draft model and verified in one decode step */
+        const val DEFAULT_N_DRAFT = 8
+
+        /** Generated pieces collected natively before they are handed over to Kotlin */
+        const val DEFAULT_FLUSH_TOKENS = 4
+
+        /** Longest time generated text waits in the native buffer before it is handed over */
+        const val DEFAULT_FLUSH_INTERVAL_MS = 50
+
+        // negative values returned by readTokens, see TokenStreamStatus in token_stream.h
+        private const val TOKEN_STREAM_ERROR = -2L
+        private const val TOKEN_STREAM_CANCELLED = -3L
+    }
+
+    /**
+     * Receives prefill progress after every ubatch-sized chunk of the prompt has been decoded.
+     * [nDone] / [nTotal] gives the fraction done, [tokensPerSecond] the prefill throughput so far.
+     */
+    fun interface PrefillProgressListener {
+        fun onProgress(
+            nDone: Int,
+            nTotal: Int,
+            tokensPerSecond: Float,
+        )
+    }
+
+    /**
+     * CPU placement of the inference threads.
+     *
+     * @param nThreads threads used to generate tokens, 0 picks one per allowed (or math) core
+     * @param nThreadsBatch threads used to process the prompt, 0 uses [nThreads]
+     * @param cpuMask bit i allows the threads to run on CPU i, 0 means no pinning
+     * @param priority scheduling priority, -1 (low) to 3 (realtime)
+     * @param poll how aggressively idle threads busy-wait for work, 0 to 100
+     * @param autoAffinity pin to the performance cores (every cluster except the slowest one)
+     * when [cpuMask] is 0
+     * @param adaptiveThreads while generating, drop to fewer threads when the cores throttle and
+     * decoding slows down, and go back up once more threads are faster again
+     * @param targetTokensPerSecond paces generation to about this many tokens per second instead of
+     * running flat out, 0 for no pacing. A rate a little above reading speed keeps the device cooler
+     * and saves battery over long replies, e.g. in battery saver mode.
+     */
+    data class ThreadingOptions(
+        val nThreads: Int = 0,
+        val nThreadsBatch: Int = 0,
+        val cpuMask: Long = 0L,
+        val priority: Int = 0,
+        val poll: Int = 50,
+        val autoAffinity: Boolean = true,
+        val adaptiveThreads: Boolean = true,
+        val targetTokensPerSecond: Float = 0f,
+    )
+
+    /** Storage type of the keys and values in the KV cache */
+    enum class KvCacheType(
+        internal val ggmlType: Int,
+    ) {
+        F16(1),
+
+        /** Half the memory of [F16] at almost no quality loss */
+        Q8_0(8),
+
+        /** A quarter of the memory of [F16]; keys lose noticeably more precision than values */
+        Q4_0(2),
+    }
+
+    /**
+     * Size and layout of the KV cache.
+     *
+     * A quantized cache lets longer contexts fit in the same memory and reads fewer bytes per
+     * generated token: an 8k context of Llama 3.2 1B takes 512 MB with [KvCacheType.F16] and
+     * 272 MB with [KvCacheType.Q8_0]. A quantized [typeV] requires [flashAttention].
+     *
+     * @param nCtx tokens of context, capped at the model's training context. 0 sizes it from the
+     * free memory: the context starts at [DEFAULT_N_CTX] tokens (fewer when memory is short) and is
+     * reallocated to grow with the conversation, keeping the cache, up to what fits next to the model
+     * when it was loaded. Older messages only slide out once that limit is reached.
+     */
+    data class KvCacheOptions(
+        val nCtx: Int = 0,
+        val typeK: KvCacheType = KvCacheType.F16,
+        val typeV: KvCacheType = KvCacheType.F16,
+        val flashAttention: Boolean = false,
+    )
+
+    /**
+     * Constrains a response to a format, see [getResponse]. Tokens the format does not allow at a
+     * point are never sampled, so the response is valid without asking again. With a [trigger], a
+     * regex matched against the whole response so far, the response is free until it matches and
+     * constrained from its first capturing group on, e.g. `[\s\S]*?(\{[\s\S]*)` for JSON after
+     * any preamble.
+     */
+    sealed class ResponseFormat {
+        abstract val trigger: String?
+
+        /** Text matching a GBNF grammar, as used by llama.cpp, starting at its `root` rule */
+        data class Grammar(
+            val gbnf: String,
+            override val trigger: String? = null,
+        ) : ResponseFormat()
+
+        /** A JSON document matching the JSON schema [schema] */
+        data class JsonSchema(
+            val schema: String,
+            override val trigger: String? = null,
+        ) : ResponseFormat()
+    }
+
+    /**
+     * Memory a model takes, see [estimateMemory]. The weights are memory mapped, so only the parts
+     * in use count towards the app's resident memory; the KV cache is allocated in full.
+     */
+    data class MemoryEstimate(
+        val weightsBytes: Long,
+        val kvCacheBytes: Long,
+    ) {
+        val totalBytes: Long get() = weightsBytes + kvCacheBytes
     }
 
+    /**
+     * Measurements of the last response, see [getCompletionMetrics]. Times are in microseconds.
+     *
+     * The per token values ([decodedTokens] to [lastWindowUs]) are 0 unless [setMetricsEnabled]
+     * was called before the response. [decodeSlowdown] compares the decode time of the latest
+     * window of 16 tokens with the fastest one; well above 1, the device slowed down during the
+     * response, usually because it throttled when it got hot.
+     */
+    data class CompletionMetrics(
+        val promptTokens: Int,
+        val reusedTokens: Int,
+        val prefillTokens: Int,
+        val tokenizeUs: Long,
+        val prefillUs: Long,
+        val timeToFirstTokenUs: Long,
+        val decodedTokens: Int,
+        val decodeUs: Long,
+        val sampledTokens: Int,
+        val sampleUs: Long,
+        val fastestWindowUs: Long,
+        val lastWindowUs: Long,
+        val draftedTokens: Int,
+        val acceptedTokens: Int,
+        val kvCells: Int,
+        val nCtx: Int,
+        val nThreads: Int,
+        val nThreadsBatch: Int,
+    ) {
+        val prefillTokensPerSecond: Float get() = if (prefillUs > 0) prefillTokens * 1e6f / prefillUs else 0f
+
+        val decodeTokensPerSecond: Float get() = if (decodeUs > 0) decodedTokens * 1e6f / decodeUs else 0f
+
+        val sampleUsPerToken: Float get() = if (sampledTokens > 0) sampleUs.toFloat() / sampledTokens else 0f
+
+        val decodeSlowdown: Float get() = if (fastestWindowUs > 0) lastWindowUs.toFloat() / fastestWindowUs else 1f
+    }
+
+    /**
+     * Estimates the memory [modelPath] needs with the KV cache described by [kvCache], from the
+     * GGUF metadata only, without loading the model. Compute buffers (tens of MB) are not included.
+     * Returns null if the file cannot be read.
+     */
+    suspend fun estimateMemory(
+        modelPath: String,
+        kvCache: KvCacheOptions = KvCacheOptions(),
+    ): MemoryEstimate? =
+        withContext(Dispatchers.IO) {
+            estimateMemory(modelPath, kvCache.nCtx, kvCache.typeK.ggmlType, kvCache.typeV.ggmlType)
+                ?.let { MemoryEstimate(it[0], it[1]) }
+        }
+
+    /**
+     * Frees native memory in response to [android.content.ComponentCallbacks2.onTrimMemory], more
+     * the higher [level] is: cached system prompt states first, then models no chat uses anymore.
+     * When memory is critical or the app is in the background, the KV cache of every chat that is
+     * not generating is written to [spillDir] and its context freed, and the pages of the mapped
+     * weights are dropped. Affects all loaded models, not only this instance's. The chats carry on
+     * as before; the next response reads the cache back (and the weights from storage) first.
+     */
+    suspend fun trimMemory(
+        level: Int,
+        spillDir: String,
+    ) = withContext(Dispatchers.IO) {
+        trimMemory(level, spillDir)
+    }
+
+    /**
+     * Loads [modelPath] and creates the native context.
+     *
+     * With [contextShift], a conversation longer than the context keeps every message: the system
+     * prompt stays pinned and the oldest turns after it slide out of the KV cache, which is shifted
+     * in place instead of processing the remaining history again. Without it, old messages are
+     * deleted once the prompt gets too long.
+     *
+     * [draftModelPath] enables speculative decoding: a small model with the same vocabulary (e.g.
+     * a 135M model of the same family) drafts up to [nDraft] tokens, which the main model checks in
+     * a single decode. Replies are sampled exactly as without it, only faster when the drafts are good.
+     * The model still loads if the draft model cannot be used; generation is then not speculative.
+     *
+     * [promptLookup] drafts without a second model: the continuation that followed the last few
+     * tokens earlier in the chat is proposed instead, which speeds up replies that quote or rewrite
+     * earlier messages or code at no memory cost. It is tried before the draft model when both are on.
+     *
+     * [kvCache] sets the context size and the KV cache types, see [KvCacheOptions]. Loading fails
+     * if a quantized value cache is requested without flash attention.
+     */
     suspend fun create(
         modelPath: String,
         minP: Float,
         temperature: Float,
         storeChats: Boolean,
+        nBatch: Int = DEFAULT_N_BATCH,
+        nUBatch: Int = DEFAULT_N_UBATCH,
+        threading: ThreadingOptions = ThreadingOptions(),
+        maxSequences: Int = DEFAULT_MAX_SEQUENCES,
+        contextShift: Boolean = true,
+        draftModelPath: String? = null,
+        nDraft: Int = DEFAULT_N_DRAFT,
+        promptLookup: Boolean = false,
+        kvCache: KvCacheOptions = KvCacheOptions(),
     ) = withContext(Dispatchers.IO) {
-        nativePtr = loadModel(modelPath, minP, temperature, storeChats)
+        // free the previous context first, the weights stay loaded natively and are
+        // reused without reading the file again when the same model is created
+        if (nativePtr != 0L) {
+            close(nativePtr)
+            nativePtr = 0L
+        }
+        nativePtr =
+            loadModel(
+                modelPath,
+                minP,
+                temperature,
+                storeChats,
+                nBatch,
+                nUBatch,
+                threading.nThreads,
+                threading.nThreadsBatch,
+                threading.cpuMask,
+                threading.priority,
+                threading.poll,
+                threading.autoAffinity,
+                maxSequences,
+                contextShift,
+                kvCache.nCtx,
+                kvCache.typeK.ggmlType,
+                kvCache.typeV.ggmlType,
+                kvCache.flashAttention,
+                threading.adaptiveThreads,
+                threading.targetTokensPerSecond,
+            )
+        if (nativePtr != 0L && draftModelPath != null) {
+            loadDraftModel(nativePtr, draftModelPath, nDraft)
+        }
+        if (nativePtr != 0L && promptLookup) {
+            setPromptLookup(nativePtr, nDraft)
+        }
+        streamBuffer = if (nativePtr != 0L) getStreamBuffer(nativePtr) else null
+    }
+
+    /** Changes the sampling parameters, keeping the loaded model, context and KV cache */
+    fun setSamplingParams(
+        minP: Float,
+        temperature: Float,
+    ) {
+        assert(nativePtr != 0L) { "Model is not loaded. Use SmollAI.create to load the model" }
+        setSamplingParams(nativePtr, minP, temperature)
+    }
+
+    /**
+     * Collects the per token measurements of [CompletionMetrics] from the next response on. This
+     * costs a few clock reads per generated token and is off by default.
+     */
+    fun setMetricsEnabled(enabled: Boolean) {
+        assert(nativePtr != 0L) { "Model is not loaded. Use SmollAI.create to load the model" }
+        setMetricsEnabled(nativePtr, enabled)
+    }
+
+    /** Measurements of the last response once [getResponse] has finished, null without a model */
+    fun getCompletionMetrics(): CompletionMetrics? {
+        if (nativePtr == 0L) {
+            return null
+        }
+        val v = getCompletionMetrics(nativePtr) ?: return null
+        return CompletionMetrics(
+            promptTokens = v[0].toInt(),
+            reusedTokens = v[1].toInt(),
+            prefillTokens = v[2].toInt(),
+            tokenizeUs = v[3],
+            prefillUs = v[4],
+            timeToFirstTokenUs = v[5],
+            decodedTokens = v[6].toInt(),
+            decodeUs = v[7],
+            sampledTokens = v[8].toInt(),
+            sampleUs = v[9],
+            fastestWindowUs = v[10],
+            lastWindowUs = v[11],
+            draftedTokens = v[12].toInt(),
+            acceptedTokens = v[13].toInt(),
+            kvCells = v[14].toInt(),
+            nCtx = v[15].toInt(),
+            nThreads = v[16].toInt(),
+            nThreadsBatch = v[17].toInt(),
+        )
     }
 
     fun addUserMessage(message: String) {
         assert(nativePtr != 0L) { "Model is not loaded. Use SmollAI.create to load the model" }
-        addChatMessage(nativePtr, message, "user")
+        addChatMessage(nativePtr, message.encodeToByteArray(), "user")
     }
 
     fun addSystemPrompt(prompt: String) {
         assert(nativePtr != 0L) { "Model is not loaded. Use SmollAI.create to load the model" }
-        addChatMessage(nativePtr, prompt, "system")
+        addChatMessage(nativePtr, prompt.encodeToByteArray(), "system")
     }
 
     fun addAssistantMessage(message: String) {
         assert(nativePtr != 0L) { "Model is not loaded. Use SmollAI.create to load the model" }
-        addChatMessage(nativePtr, message, "assistant")
+        addChatMessage(nativePtr, message.encodeToByteArray(), "assistant")
+    }
+
+    /**
+     * Replaces the conversation with [contents], sent by the matching [roles] ("system", "user" or
+     * "assistant"), in one native call that renders and tokenizes the whole history at once.
+     *
+     * With [prefill], the history is processed into the KV cache on a background thread while the
+     * app waits for input, so the first [getResponse] only has to process the new query; one that
+     * comes earlier takes over where the background work stopped. Call [setSessionFile] first: a
+     * restored cache is reused and only the messages it lacks are processed.
+     *
+     * The system prompt is processed first and kept in memory, so any chat opened later with the
+     * same system prompt and model starts with it already processed, including a new chat whose
+     * history is only the system prompt.
+     */
+    suspend fun loadHistory(
+        roles: List<String>,
+        contents: List<String>,
+        prefill: Boolean = true,
+    ) = withContext(Dispatchers.IO) {
+        assert(nativePtr != 0L) { "Model is not loaded. Use SmollAI.create to load the model" }
+        require(roles.size == contents.size) { "Every message needs a role" }
+        loadHistory(
+            nativePtr,
+            roles.toTypedArray(),
+            Array(contents.size) { contents[it].encodeToByteArray() },
+            prefill,
+        )
     }
 
-    fun getResponse(query: String): Flow<String> =
+    /**
+     * Generates the response to [query]. Tokens are produced on a native thread and emitted in
+     * batches of [flushTokens] pieces, or after at most [flushIntervalMs] milliseconds. With a
+     * [format], the response is constrained to it; an invalid grammar or schema throws
+     * IllegalArgumentException.
+     */
+    fun getResponse(
+        query: String,
+        onPrefillProgress: PrefillProgressListener? = null,
+        flushTokens: Int = DEFAULT_FLUSH_TOKENS,
+        flushIntervalMs: Int = DEFAULT_FLUSH_INTERVAL_MS,
+        format: ResponseFormat? = null,
+    ): Flow<String> =
         flow {
             assert(nativePtr != 0L) { "Model is not loaded. Use SmollAI.create to load the model" }
-            startCompletion(nativePtr, query)
-            var piece = completionLoop(nativePtr)
-            while (piece != "[EOG]") {
-                emit(piece)
-                piece = completionLoop(nativePtr)
+            val buffer = checkNotNull(streamBuffer) { "Token stream is not available" }
+            val grammar =
+                when (format) {
+                    is ResponseFormat.Grammar -> format.gbnf
+                    is ResponseFormat.JsonSchema -> format.schema
+                    null -> ""
+                }
+            require(setGrammar(nativePtr, grammar, format is ResponseFormat.JsonSchema, format?.trigger ?: "")) {
+                "Invalid response format"
+            }
+            if (!startCompletion(nativePtr, query.encodeToByteArray(), onPrefillProgress)) {
+                // cancelCompletion() or stopCompletion() interrupted the prefill
+                return@flow
+            }
+            startGeneration(nativePtr, flushTokens, flushIntervalMs)
+            var finished = false
+            try {
+                var consumed = 0
+                while (true) {
+                    // blocks until a batch is available; releases the previous one
+                    val segment = readTokens(nativePtr, consumed)
+                    if (segment == TOKEN_STREAM_CANCELLED) {
+                        return@flow
+                    }
+                    if (segment == TOKEN_STREAM_ERROR) {
+                        throw IllegalStateException("Token generation failed")
+                    }
+                    if (segment < 0) {
+                        break
+                    }
+                    val offset = (segment ushr 32).toInt()
+                    consumed = (segment and 0xFFFFFFFFL).toInt()
+                    // segments only ever contain whole UTF-8 sequences
+                    val bytes = buffer.duplicate()
+                    bytes.position(offset)
+                    bytes.limit(offset + consumed)
+                    emit(Charsets.UTF_8.decode(bytes).toString())
+                }
+                finished = true
+                stopCompletionInternal(nativePtr)
+            } finally {
+                // the collector was cancelled or stopped early (take(), first()), or the
+                // generation failed: the native thread would go on decoding on its own
+                if (!finished) {
+                    cancelCompletionInternal(nativePtr)
+                }
             }
-            stopCompletionInternal(nativePtr)
         }
     
+    /**
+     * Persists the KV cache of the chat [chatId] to [sessionDir] after every response and restores
+     * a state previously saved there for the same chat, model and chat template, so that reopening
+     * the chat does not process its whole history again. Returns true if a state was restored.
+     */
+    suspend fun setSessionFile(
+        sessionDir: String,
+        chatId: Long,
+    ): Boolean =
+        withContext(Dispatchers.IO) {
+            assert(nativePtr != 0L) { "Model is not loaded. Use SmollAI.create to load the model" }
+            setSessionFile(nativePtr, sessionDir, chatId)
+        }
+
+    /**
+     * Loads [modelPath] for [embed], next to the chat model. A dedicated embedding model (e.g. a GGUF
+     * of all-MiniLM-L6-v2 or bge-small) is small and fast; any other model works too, its hidden states
+     * are then mean pooled, but its whole output layer is computed for every token. Returns false if
+     * the model cannot be loaded.
+     */
+    suspend fun loadEmbeddingModel(
+        modelPath: String,
+        threading: ThreadingOptions = ThreadingOptions(),
+    ): Boolean =
+        withContext(Dispatchers.IO) {
+            if (embedderPtr != 0L) {
+                closeEmbeddingModel(embedderPtr)
+            }
+            embedderPtr =
+                loadEmbeddingModel(
+                    modelPath,
+                    threading.nThreads,
+                    threading.nThreadsBatch,
+                    threading.cpuMask,
+                    threading.priority,
+                    threading.poll,
+                    threading.autoAffinity,
+                )
+            embeddingBuffer = null
+            embedderPtr != 0L
+        }
+
+    /** Dimensions of the vectors returned by [embed], 0 without an embedding model */
+    val embeddingDimensions: Int
+        get() = if (embedderPtr != 0L) getEmbeddingDims(embedderPtr) else 0
+
+    /**
+     * Computes the embedding of each of [texts] with the model loaded by [loadEmbeddingModel], for
+     * semantic search with a [VectorIndex]. The vectors are L2-normalized, so the dot product of two of
+     * them is their cosine similarity. Short texts are processed together in batches; texts longer
+     * than 512 tokens are truncated.
+     */
+    suspend fun embed(texts: List<String>): List<FloatArray> =
+        withContext(Dispatchers.IO) {
+            assert(embedderPtr != 0L) { "Embedding model is not loaded. Use SmollAI.loadEmbeddingModel to load it" }
+            if (texts.isEmpty()) {
+                return@withContext emptyList()
+            }
+            val dims = getEmbeddingDims(embedderPtr)
+            val nBytes = texts.size * dims * Float.SIZE_BYTES
+            val buffer =
+                embeddingBuffer?.takeIf { it.capacity() >= nBytes }
+                    ?: ByteBuffer.allocateDirect(nBytes).order(ByteOrder.nativeOrder()).also { embeddingBuffer = it }
+            check(embed(embedderPtr, Array(texts.size) { texts[it].encodeToByteArray() }, buffer)) {
+                "Embedding failed"
+            }
+            val floats = buffer.asFloatBuffer()
+            List(texts.size) { FloatArray(dims).also { vector -> floats.get(vector) } }
+        }
+
+    /** Frees the chat model and the embedding model */
     fun close() {
         close(nativePtr)
+        nativePtr = 0L
+        streamBuffer = null
+        closeEmbeddingModel(embedderPtr)
+        embedderPtr = 0L
+        embeddingBuffer = null
     }
     
+    /**
+     * Ends the current response, keeping what was generated so far. Safe to call from another
+     * thread while [getResponse] runs: a prefill in progress is interrupted right away.
+     */
     fun stopCompletion() {
         assert(nativePtr != 0L) { "Model is not loaded. Use SmollAI.create to load the model" }
         stopCompletionInternal(nativePtr)
     }
     
+    /**
+     * Like [stopCompletion], but the partial response is discarded and removed from the KV cache
+     * again; the prompt before it stays cached.
+     */
     fun cancelCompletion() {
         assert(nativePtr != 0L) { "Model is not loaded. Use SmollAI.create to load the model" }
         cancelCompletionInternal(nativePtr)
@@ -69,22 +556,128 @@ class SmollAI {
         minP: Float,
         temperature: Float,
         storeChats: Boolean,
+        nBatch: Int,
+        nUBatch: Int,
+        nThreads: Int,
+        nThreadsBatch: Int,
+        cpuMask: Long,
+        priority: Int,
+        poll: Int,
+        autoAffinity: Boolean,
+        maxSequences: Int,
+        contextShift: Boolean,
+        nCtx: Int,
+        typeK: Int,
+        typeV: Int,
+        flashAttention: Boolean,
+        adaptiveThreads: Boolean,
+        targetTokensPerSecond: Float,
     ): Long
 
+    private external fun estimateMemory(
+        modelPath: String,
+        nCtx: Int,
+        typeK: Int,
+        typeV: Int,
+    ): LongArray?
+
+    private external fun trimMemory(
+        level: Int,
+        spillDir: String,
+    )
+
+    private external fun loadDraftModel(
+        modelPtr: Long,
+        draftModelPath: String,
+        nDraft: Int,
+    ): Boolean
+
+    private external fun setPromptLookup(
+        modelPtr: Long,
+        nDraft: Int,
+    )
+
+    private external fun setSamplingParams(
+        modelPtr: Long,
+        minP: Float,
+        temperature: Float,
+    )
+
+    private external fun setMetricsEnabled(
+        modelPtr: Long,
+        enabled: Boolean,
+    )
+
+    private external fun getCompletionMetrics(modelPtr: Long): LongArray?
+
+    private external fun setGrammar(
+        modelPtr: Long,
+        grammar: String,
+        jsonSchema: Boolean,
+        triggerPattern: String,
+    ): Boolean
+
+    // message and prompt text is passed as UTF-8 bytes, which the native side stores as is
     private external fun addChatMessage(
         modelPtr: Long,
-        message: String,
+        message: ByteArray,
         role: String,
     )
 
+    private external fun loadHistory(
+        modelPtr: Long,
+        roles: Array<String>,
+        contents: Array<ByteArray>,
+        prefill: Boolean,
+    )
+
     private external fun close(modelPtr: Long)
 
+    private external fun loadEmbeddingModel(
+        modelPath: String,
+        nThreads: Int,
+        nThreadsBatch: Int,
+        cpuMask: Long,
+        priority: Int,
+        poll: Int,
+        autoAffinity: Boolean,
+    ): Long
+
+    private external fun getEmbeddingDims(embedderPtr: Long): Int
+
+    // the embeddings are written into `out`, a direct buffer in native byte order
+    private external fun embed(
+        embedderPtr: Long,
+        texts: Array<ByteArray>,
+        out: ByteBuffer,
+    ): Boolean
+
+    private external fun closeEmbeddingModel(embedderPtr: Long)
+
+    private external fun setSessionFile(
+        modelPtr: Long,
+        sessionDir: String,
+        chatId: Long,
+    ): Boolean
+
     private external fun startCompletion(
         modelPtr: Long,
-        prompt: String,
+        prompt: ByteArray,
+        progressListener: PrefillProgressListener?,
+    ): Boolean
+
+    private external fun getStreamBuffer(modelPtr: Long): ByteBuffer
+
+    private external fun startGeneration(
+        modelPtr: Long,
+        flushTokens: Int,
+        flushIntervalMs: Int,
     )
 
-    private external fun completionLoop(modelPtr: Long): String
+    private external fun readTokens(
+        modelPtr: Long,
+        consumedBytes: Int,
+    ): Long
 
     private external fun stopCompletionInternal(modelPtr: Long)
     
@@ -0,0 +1,167 @@
+package io.smollai.smollai
+
+import kotlinx.coroutines.Dispatchers
+import kotlinx.coroutines.withContext
+import java.util.concurrent.locks.ReentrantReadWriteLock
+import kotlin.concurrent.read
+import kotlin.concurrent.write
+import kotlin.math.sqrt
+
+/**
+ * Nearest neighbour search over embeddings from [SmollAI.embed], for semantic search of chats. The
+ * index is stored in the file [path], which is memory mapped rather than read, and vectors are written
+ * to it as they are added; it is created if it does not exist. Each vector is identified by a Long,
+ * e.g. the id of the message it was computed from, and scored by its dot product with the query, the
+ * cosine similarity for normalized embeddings.
+ *
+ * A search scans every vector, a few milliseconds for tens of thousands of messages. After [rebuild]
+ * with inverted lists, it only scans the lists closest to the query and the vectors added since.
+ * Throws IllegalArgumentException if the file cannot be opened or holds vectors of a different
+ * dimension. The methods may be called from any thread; [close] waits for the calls in progress, and
+ * any call after it throws IllegalStateException.
+ */
+class VectorIndex(
+    val path: String,
+    val dimensions: Int,
+) : AutoCloseable {
+    private var nativePtr = openIndex(path, dimensions)
+
+    // held for reading by every native call, for writing by close() so that it cannot
+    // free the index under one of them
+    private val lock = ReentrantReadWriteLock()
+
+    init {
+        require(nativePtr != 0L) { "Cannot open the vector index at $path" }
+    }
+
+    companion object {
+        init {
+            System.loadLibrary("smollai")
+        }
+
+        /** Inverted lists scanned by [search] when nProbe is 0 */
+        const val DEFAULT_N_PROBE = 8
+    }
+
+    /** A vector found by [search] */
+    data class Match(
+        val id: Long,
+        val score: Float,
+    )
+
+    /** Number of vectors in the index */
+    val size: Int
+        get() = withIndex { size(it) }
+
+    /** Stores [vector] for [id], replacing the one it had. Returns false if the file cannot grow. */
+    fun add(
+        id: Long,
+        vector: FloatArray,
+    ): Boolean {
+        require(vector.size == dimensions) { "Expected a vector of $dimensions dimensions" }
+        return withIndex { add(it, longArrayOf(id), vector) }
+    }
+
+    /** Stores each of [vectors] for the id at the same position of [ids] */
+    fun addAll(
+        ids: List<Long>,
+        vectors: List<FloatArray>,
+    ): Boolean {
+        require(ids.size == vectors.size) { "Every vector needs an id" }
+        require(vectors.all { it.size == dimensions }) { "Expected vectors of $dimensions dimensions" }
+        val flat = FloatArray(vectors.size * dimensions)
+        vectors.forEachIndexed { i, vector -> vector.copyInto(flat, i * dimensions) }
+        return withIndex { add(it, ids.toLongArray(), flat) }
+    }
+
+    /** Returns false if there is no vector for [id] */
+    fun remove(id: Long): Boolean = withIndex { remove(it, id) }
+
+    /**
+     * The [k] vectors with the highest score for [query], best first. With inverted lists, [nProbe] of
+     * them are scanned ([DEFAULT_N_PROBE] when 0); more find the exact matches more often, all of them
+     * give the same results as without lists.
+     */
+    fun search(
+        query: FloatArray,
+        k: Int,
+        nProbe: Int = 0,
+    ): List<Match> {
+        require(query.size == dimensions) { "Expected a query of $dimensions dimensions" }
+        if (k <= 0) {
+            return emptyList()
+        }
+        val ids = LongArray(k)
+        val scores = FloatArray(k)
+        val n = withIndex { search(it, query, nProbe, ids, scores) }
+        return List(n) { Match(ids[it], scores[it]) }
+    }
+
+    /**
+     * Rewrites the file without the removed vectors and clusters the rest into [nLists] inverted
+     * lists, about the square root of the number of vectors by default, or none (0) for exhaustive
+     * search. Worth it from tens of thousands of vectors; it takes about a second per 10,000 of them.
+     */
+    suspend fun rebuild(nLists: Int = sqrt(size.toFloat()).toInt()): Boolean =
+        withContext(Dispatchers.IO) {
+            withIndex { rebuild(it, nLists) }
+        }
+
+    /** Writes the vectors added so far to storage, which otherwise happens in the background */
+    suspend fun flush() =
+        withContext(Dispatchers.IO) {
+            withIndex { flush(it) }
+        }
+
+    override fun close() {
+        lock.write {
+            if (nativePtr != 0L) {
+                close(nativePtr)
+                nativePtr = 0L
+            }
+        }
+    }
+
+    private inline fun <T> withIndex(block: (Long) -> T): T =
+        lock.read {
+            check(nativePtr != 0L) { "The vector index at $path is closed" }
+            block(nativePtr)
+        }
+
+    private external fun openIndex(
+        path: String,
+        dims: Int,
+    ): Long
+
+    private external fun size(indexPtr: Long): Int
+
+    // `vectors` holds the vectors of all `ids` one after another
+    private external fun add(
+        indexPtr: Long,
+        ids: LongArray,
+        vectors: FloatArray,
+    ): Boolean
+
+    private external fun remove(
+        indexPtr: Long,
+        id: Long,
+    ): Boolean
+
+    // the number of matches written to `ids` and `scores`, at most their size
+    private external fun search(
+        indexPtr: Long,
+        query: FloatArray,
+        nProbe: Int,
+        ids: LongArray,
+        scores: FloatArray,
+    ): Int
+
+    private external fun rebuild(
+        indexPtr: Long,
+        nLists: Int,
+    ): Boolean
+
+    private external fun flush(indexPtr: Long)
+
+    private external fun close(indexPtr: Long)
+}